@@ -35,6 +35,10 @@ typedef int32_t         LONG;
 typedef uint32_t        ULONG;
 typedef uint32_t        DWORD;
 
+/* 64-bit integer */
+typedef int64_t         LONGLONG;
+typedef uint64_t        QWORD;
+
 /* Boolean type */
 typedef enum { FALSE = 0, TRUE } BOOLEAN;
 typedef enum { LOW = 0, HIGH } THROTTLE;
@@ -0,0 +1,181 @@
+/*
+ *  File: sd_async.hpp
+ *  License at the end of file.
+ *
+ *  C++20 coroutines over the resumable operations of sd_io.c (SD_Poll). A
+ *  coroutine awaits an operation of the card and the event loop calls poll()
+ *  among its other work; each call runs one step of the driver and resumes
+ *  the coroutine when its operation ends:
+ *
+ *    ulibsd::Task logger(ulibsd::AsyncCard &card)
+ *    {
+ *        if(co_await card.init() != SD_OK) co_return;
+ *        co_await card.write(buf, 100, 8);
+ *    }
+ *
+ *    ulibsd::AsyncCard card(dev);
+ *    ulibsd::Task t = logger(card);
+ *    for(;;) { card.poll(); other_work(); }
+ *
+ *  The operations of several coroutines on the same card run one after the
+ *  other, in the order they were awaited.
+ */
+
+#ifndef _SD_ASYNC_HPP_
+#define _SD_ASYNC_HPP_
+
+#if __cplusplus < 202002L
+#error "sd_async.hpp needs C++20 (coroutines)"
+#endif
+
+#include <coroutine>
+#include <exception>
+
+extern "C" {
+#include "sd_io.h"
+}
+
+namespace ulibsd {
+
+/* Coroutine that runs at once and is freed with the Task */
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(Task &&t) noexcept : handle(t.handle) { t.handle = nullptr; }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() { if(handle) handle.destroy(); }
+
+    bool done() const { return !handle || handle.done(); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+/* Card driven by poll(), one SD_Poll step per call */
+class AsyncCard {
+public:
+    /* Awaitable operation, queued at the co_await. Gives the SDRESULTS. */
+    class Op {
+    public:
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            waiter = h;
+            card.enqueue(this);
+        }
+        SDRESULTS await_resume() const noexcept { return res; }
+
+    private:
+        friend class AsyncCard;
+        enum Kind { INIT, READ, WRITE };
+
+        Op(AsyncCard &c, Kind k, void *d, LBA_t s, DWORD n)
+            : card(c), kind(k), dat(d), sector(s), count(n) {}
+
+        SDRESULTS start()
+        {
+            switch(kind)
+            {
+            case INIT:  return SD_Init_Start(&card.dev);
+            case READ:  return SD_Read_Start(&card.dev, dat, sector, count);
+            default:    return SD_Write_Start(&card.dev, dat, sector, count);
+            }
+        }
+
+        AsyncCard &card;
+        Kind kind;
+        void *dat;
+        LBA_t sector;
+        DWORD count;
+        SDRESULTS res = SD_OK;
+        Op *next = nullptr;
+        std::coroutine_handle<> waiter;
+    };
+
+    explicit AsyncCard(SD_DEV &d) : dev(d) {}
+    AsyncCard(const AsyncCard &) = delete;
+    AsyncCard &operator=(const AsyncCard &) = delete;
+
+    Op init()                                           { return Op(*this, Op::INIT, nullptr, 0, 0); }
+    Op read(void *dat, LBA_t sector, DWORD count = 1)   { return Op(*this, Op::READ, dat, sector, count); }
+    Op write(void *dat, LBA_t sector, DWORD count = 1)  { return Op(*this, Op::WRITE, dat, sector, count); }
+
+    /* One step: start the next operation or run SD_Poll once, and resume the
+       coroutine of an operation that ends. False if there was nothing to do. */
+    bool poll()
+    {
+        SDRESULTS res;
+        Op *op = head;
+        if(!op) return false;
+        if(!running)
+        {
+            res = op->start();
+            if(res == SD_OK)
+            {
+                running = true;
+                return true;
+            }
+        } else {
+            res = SD_Poll(&dev);
+            if(res == SD_PENDING) return true;
+            running = false;
+        }
+        // Out of the queue before the resume: the coroutine may await again,
+        // and the Op lives in its frame
+        head = op->next;
+        if(!head) tail = nullptr;
+        op->res = res;
+        op->waiter.resume();
+        return true;
+    }
+
+    bool idle() const { return head == nullptr; }
+    SD_DEV &device() { return dev; }
+
+private:
+    void enqueue(Op *op)
+    {
+        if(tail) tail->next = op;
+        else head = op;
+        tail = op;
+    }
+
+    SD_DEV &dev;
+    Op *head = nullptr;
+    Op *tail = nullptr;
+    bool running = false;       // The operation at the head is started
+};
+
+} // namespace ulibsd
+
+#endif
+
+// «sd_async.hpp» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
@@ -0,0 +1,507 @@
+/*
+ *  File: sd_card.hpp
+ *  License at the end of file.
+ *
+ *  Header-only C++17 front-end of the SD protocol of sd_io.c. The SPI port is
+ *  a policy class of static methods, so a port written inline gets every byte
+ *  of the hot loops inlined. Addressing mode, CRC, write-back and multiple
+ *  block transfers are options fixed at compile time: the paths not selected
+ *  aren't even compiled, and the frames of the fixed commands (CRC included)
+ *  are built by the compiler.
+ */
+
+#ifndef _SD_CARD_HPP_
+#define _SD_CARD_HPP_
+
+extern "C" {
+#include "sd_io.h"
+}
+
+namespace ulibsd {
+
+/******************************************************************************
+ SPI policies
+******************************************************************************/
+
+/* Policy over the C port (spi_io.h). A port written as a struct with the
+   same static methods, defined inline, removes the call of each byte. */
+struct SpiPort {
+    static void init()              { SPI_Init(); }
+    static BYTE rw(BYTE d)          { return SPI_RW(d); }
+    static void release()           { SPI_Release(); }
+    static void select()            { SPI_CS_Low(); }
+    static void deselect()          { SPI_CS_High(); }
+    static void freq_high()         { SPI_Freq_High(); }
+    static void freq_low()          { SPI_Freq_Low(); }
+    static void timer_on(WORD ms)   { SPI_Timer_On(ms); }
+    static bool timer_status()      { return SPI_Timer_Status() == TRUE; }
+    static void timer_off()         { SPI_Timer_Off(); }
+};
+
+/* Options of SdCard. Derive and override the ones to change. */
+struct SdOptions {
+    static constexpr bool block_addr = true;    // SDHC/SDXC, false for SDSC
+    static constexpr bool crc = false;          // CRC of commands and data (CMD59)
+    static constexpr bool write_back = false;   // Wait the busy of a write at
+                                                // the next command, not after it
+    static constexpr bool multi_block = true;   // CMD18/CMD25 for runs of sectors
+    static constexpr WORD read_ms = SD_IO_READ_TIMEOUT_WAIT;
+    static constexpr WORD write_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+};
+
+/******************************************************************************
+ CRC tables and command frames, built at compile time
+******************************************************************************/
+
+namespace detail {
+
+template<typename T> struct Table { T v[256]; };
+
+/* CRC7 (x^7 + x^3 + 1) of the commands, kept shifted one bit to the left */
+constexpr Table<BYTE> crc7_table()
+{
+    Table<BYTE> t{};
+    for(int idx = 0; idx != 256; idx++)
+    {
+        BYTE crc = (BYTE)idx;
+        for(int bit = 0; bit != 8; bit++)
+            crc = (crc & 0x80) ? (BYTE)((crc << 1) ^ 0x12) : (BYTE)(crc << 1);
+        t.v[idx] = crc;
+    }
+    return t;
+}
+
+/* CRC16 (CCITT, x^16 + x^12 + x^5 + 1) of the data blocks */
+constexpr Table<WORD> crc16_table()
+{
+    Table<WORD> t{};
+    for(int idx = 0; idx != 256; idx++)
+    {
+        WORD crc = (WORD)(idx << 8);
+        for(int bit = 0; bit != 8; bit++)
+            crc = (crc & 0x8000) ? (WORD)((crc << 1) ^ 0x1021) : (WORD)(crc << 1);
+        t.v[idx] = crc;
+    }
+    return t;
+}
+
+inline constexpr Table<BYTE> CRC7 = crc7_table();
+inline constexpr Table<WORD> CRC16 = crc16_table();
+
+/* Last byte of a command frame: CRC7 and end bit */
+constexpr BYTE crc7(BYTE cmd, DWORD arg)
+{
+    BYTE crc = CRC7.v[cmd];
+    crc = CRC7.v[crc ^ (BYTE)(arg >> 24)];
+    crc = CRC7.v[crc ^ (BYTE)(arg >> 16)];
+    crc = CRC7.v[crc ^ (BYTE)(arg >> 8)];
+    crc = CRC7.v[crc ^ (BYTE)arg];
+    return (BYTE)(crc | 0x01);
+}
+
+constexpr WORD crc16(WORD crc, BYTE d)
+{
+    return (WORD)((crc << 8) ^ CRC16.v[(BYTE)(crc >> 8) ^ d]);
+}
+
+/* Frame of a command with a fixed argument */
+template<BYTE Cmd, DWORD Arg>
+struct Frame {
+    static constexpr BYTE bytes[6] = {
+        Cmd, (BYTE)(Arg >> 24), (BYTE)(Arg >> 16), (BYTE)(Arg >> 8), (BYTE)Arg,
+        crc7(Cmd, Arg)
+    };
+};
+
+static_assert(crc7(CMD0, 0) == 0x95, "CRC7 of CMD0");
+static_assert(crc7(CMD8, 0x1AA) == 0x87, "CRC7 of CMD8");
+
+} // namespace detail
+
+/******************************************************************************
+ SD card over a SPI policy
+******************************************************************************/
+
+template<class Spi, class Options = SdOptions>
+class SdCard {
+public:
+    /**
+        \brief Initialization the SD card. The card must match the addressing
+               mode of Options (block_addr), otherwise SD_NOINIT.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS init()
+    {
+        BYTE r1, ocr[4], csd[16];
+        bool hc = false;
+        mount_ = false;
+        busy_ = false;
+        Spi::init();
+        Spi::deselect();
+        Spi::freq_low();
+        // 80 dummy clocks
+        for(BYTE idx = 0; idx != 10; idx++) Spi::rw(0xFF);
+        // Software reset
+        Spi::timer_on(500);
+        do {
+            r1 = command<CMD0, 0>();
+        } while((r1 != 1) && Spi::timer_status());
+        Spi::timer_off();
+        if(r1 != 1) return finish(SD_NOINIT);
+        // SD version 2? Leave the idle state with HCS and read the CCS
+        if(command<CMD8, 0x1AA>() == 1)
+        {
+            for(BYTE idx = 0; idx != 4; idx++) ocr[idx] = Spi::rw(0xFF);
+            if((ocr[2] != 0x01)||(ocr[3] != 0xAA)) return finish(SD_NOINIT);
+            if(!leave_idle<ACMD41, 1UL << 30>()) return finish(SD_NOINIT);
+            if(command<CMD58, 0>() != 0) return finish(SD_NOINIT);
+            for(BYTE idx = 0; idx != 4; idx++) ocr[idx] = Spi::rw(0xFF);
+            hc = (ocr[0] & 0x40) != 0;
+        }
+        else if(!leave_idle<ACMD41, 0>()) return finish(SD_NOINIT);
+        // This instance only speaks one addressing mode
+        if(hc != Options::block_addr) return finish(SD_NOINIT);
+        if constexpr(!Options::block_addr)
+            if(command<CMD16, SD_BLK_SIZE>() != 0) return finish(SD_NOINIT);
+        if constexpr(Options::crc)
+            if(command<CMD59, 1>() != 0) return finish(SD_NOINIT);
+        if((command<CMD9, 0>() != 0)||!rx_block(csd, 0, 16, 16))
+            return finish(SD_NOINIT);
+        // An unknown capacity would wrap last_sector_ around
+        LBA_t count = sectors(csd);
+        if(count == 0) return finish(SD_NOINIT);
+        last_sector_ = count - 1;
+        Spi::release();
+        Spi::freq_high();
+        mount_ = true;
+        return SD_OK;
+    }
+
+    /**
+        \brief Read a part of a sector.
+        \param dat Data buffer to store the data.
+        \param sector Sector number.
+        \param ofs Offset in the sector (0..511).
+        \param cnt Byte count (1..512).
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS read(void *dat, LBA_t sector, WORD ofs = 0, WORD cnt = SD_BLK_SIZE)
+    {
+        if(!mount_) return SD_NOINIT;
+        if((sector > last_sector_)||(cnt == 0)||(ofs + cnt > SD_BLK_SIZE)) return SD_PARERR;
+        if(command(CMD17, addr(sector)) != 0) return finish(SD_ERROR);
+        return finish(rx_block((BYTE*)dat, ofs, cnt, SD_BLK_SIZE) ? SD_OK : SD_ERROR);
+    }
+
+    /**
+        \brief Read consecutive sectors (CMD18, or CMD17 each one without
+               multi_block).
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS read_blocks(void *dat, LBA_t sector, DWORD count)
+    {
+        BYTE *p = (BYTE*)dat;
+        if(!mount_) return SD_NOINIT;
+        if((count == 0)||(sector > last_sector_)||(count - 1 > last_sector_ - sector))
+            return SD_PARERR;
+        if constexpr(Options::multi_block)
+        {
+            bool ok;
+            if(command(CMD18, addr(sector)) != 0) return finish(SD_ERROR);
+            do {
+                ok = rx_block(p, 0, SD_BLK_SIZE, SD_BLK_SIZE);
+                p += SD_BLK_SIZE;
+            } while(ok && --count);
+            // Stop transmission, R1b
+            command<CMD12, 0>();
+            wait_ready(Options::write_ms);
+            return finish(ok ? SD_OK : SD_ERROR);
+        }
+        else
+        {
+            SDRESULTS res;
+            do {
+                res = read(p, sector++);
+                p += SD_BLK_SIZE;
+            } while((res == SD_OK) && --count);
+            return res;
+        }
+    }
+
+    /**
+        \brief Write a sector (CMD24).
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS write(const void *dat, LBA_t sector)
+    {
+        if(!mount_) return SD_NOINIT;
+        if(sector > last_sector_) return SD_PARERR;
+        if(command(CMD24, addr(sector)) != 0) return finish(SD_ERROR);
+        return finish(tx_block((const BYTE*)dat, 0xFE));
+    }
+
+    /**
+        \brief Write consecutive sectors (ACMD23 and CMD25, or CMD24 each one
+               without multi_block).
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS write_blocks(const void *dat, LBA_t sector, DWORD count)
+    {
+        const BYTE *p = (const BYTE*)dat;
+        SDRESULTS res;
+        if(!mount_) return SD_NOINIT;
+        if((count == 0)||(sector > last_sector_)||(count - 1 > last_sector_ - sector))
+            return SD_PARERR;
+        if constexpr(Options::multi_block)
+        {
+            SDRESULTS end;
+            if(count == 1) return write(dat, sector);
+            // Pre-erase, only a hint
+            command(ACMD23, (count > SD_ACMD23_MAX) ? SD_ACMD23_MAX : count);
+            if(command(CMD25, addr(sector)) != 0) return finish(SD_ERROR);
+            do {
+                res = tx_block(p, 0xFC);
+                p += SD_BLK_SIZE;
+            } while((res == SD_OK) && --count);
+            // Stop tran token, also after an error
+            end = tx_block(nullptr, 0xFD);
+            return finish((res == SD_OK) ? end : res);
+        }
+        else
+        {
+            do {
+                res = write(p, sector++);
+                p += SD_BLK_SIZE;
+            } while((res == SD_OK) && --count);
+            return res;
+        }
+    }
+
+    /**
+        \brief Wait for the end of the programming of the last write. Only
+               needed with write_back, before power off or deselect for long.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS sync()
+    {
+        if(!busy_) return SD_OK;
+        Spi::select();
+        busy_ = !wait_ready(Options::write_ms);
+        return finish(busy_ ? SD_BUSY : SD_OK);
+    }
+
+    /**
+        \brief Status of the card (CMD13), without reset it.
+        \return If all goes well returns SD_OK.
+     */
+    SDRESULTS status()
+    {
+        BYTE r1, r2;
+        if(!mount_) return SD_NOINIT;
+        r1 = command<CMD13, 0>();
+        r2 = Spi::rw(0xFF);
+        if(r1 & 0x80) return finish(SD_NORESPONSE);
+        if(r1 & 0x01) return finish(SD_NOINIT);
+        return finish((r1 || r2) ? SD_ERROR : SD_OK);
+    }
+
+    LBA_t last_sector() const { return last_sector_; }
+    bool mounted() const { return mount_; }
+
+private:
+    LBA_t last_sector_ = 0;
+    bool mount_ = false;
+    bool busy_ = false;     // Programming in course (write_back)
+
+    /* Argument of the data commands */
+    static constexpr DWORD addr(LBA_t sector)
+    {
+        if constexpr(Options::block_addr) return (DWORD)sector;
+        else return (DWORD)sector * SD_BLK_SIZE;
+    }
+
+    /* Capacity in sectors from the CSD (version 1.0 or 2.0), 0 if unknown */
+    static LBA_t sectors(const BYTE *csd)
+    {
+        if((csd[0] >> 6) == 1)
+            return ((LBA_t)(((DWORD)(csd[7] & 0x3F) << 16) | ((DWORD)csd[8] << 8) | csd[9]) + 1) * 1024;
+        DWORD c_size = ((DWORD)(csd[6] & 0x03) << 10) | ((DWORD)csd[7] << 2) | (csd[8] >> 6);
+        BYTE mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+        BYTE bl_len = csd[5] & 0x0F;
+        if(bl_len < 9) return 0;
+        return (LBA_t)(c_size + 1) << (mult + 2 + bl_len - 9);
+    }
+
+    /* End of an operation */
+    static SDRESULTS finish(SDRESULTS res)
+    {
+        Spi::release();
+        return res;
+    }
+
+    static bool wait_ready(WORD ms)
+    {
+        BYTE line;
+        Spi::timer_on(ms);
+        do {
+            line = Spi::rw(0xFF);
+        } while((line == 0) && Spi::timer_status());
+        Spi::timer_off();
+        return line != 0;
+    }
+
+    /* Select the card, after the busy of a write-back */
+    void begin()
+    {
+        Spi::deselect();
+        Spi::rw(0xFF);
+        Spi::select();
+        Spi::rw(0xFF);
+        if constexpr(Options::write_back)
+        {
+            if(busy_) busy_ = !wait_ready(Options::write_ms);
+        }
+    }
+
+    /* R1 within NCR */
+    static BYTE response()
+    {
+        BYTE res, n = 10;
+        do {
+            res = Spi::rw(0xFF);
+        } while((res & 0x80) && --n);
+        return res;
+    }
+
+    /* Command with a fixed argument, frame built at compile time */
+    template<BYTE Cmd, DWORD Arg>
+    BYTE command()
+    {
+        if constexpr((Cmd & 0x80) != 0)
+        {
+            BYTE res = command<CMD55, 0>();
+            if(res > 1) return res;
+        }
+        begin();
+        for(BYTE b : detail::Frame<(BYTE)(Cmd & 0x7F), Arg>::bytes) Spi::rw(b);
+        if constexpr((Cmd & 0x7F) == CMD12) Spi::rw(0xFF);  // Stuff byte
+        return response();
+    }
+
+    /* Command with an argument known at run time */
+    BYTE command(BYTE cmd, DWORD arg)
+    {
+        if(cmd & 0x80)
+        {
+            BYTE res = command<CMD55, 0>();
+            if(res > 1) return res;
+            cmd &= 0x7F;
+        }
+        begin();
+        Spi::rw(cmd);
+        Spi::rw((BYTE)(arg >> 24));
+        Spi::rw((BYTE)(arg >> 16));
+        Spi::rw((BYTE)(arg >> 8));
+        Spi::rw((BYTE)arg);
+        if constexpr(Options::crc) Spi::rw(detail::crc7(cmd, arg));
+        else Spi::rw(0x01);
+        return response();
+    }
+
+    /* Poll the initialization command until the card leaves the idle state */
+    template<BYTE Cmd, DWORD Arg>
+    bool leave_idle()
+    {
+        BYTE r1;
+        Spi::timer_on(1000);
+        do {
+            r1 = command<Cmd, Arg>();
+        } while(r1 && Spi::timer_status());
+        Spi::timer_off();
+        return r1 == 0;
+    }
+
+    /* Receive a data packet of len bytes, keep cnt bytes from ofs */
+    static bool rx_block(BYTE *dat, WORD ofs, WORD cnt, WORD len)
+    {
+        BYTE tkn;
+        WORD idx, rest = len - ofs - cnt;
+        WORD crc = 0;
+        Spi::timer_on(Options::read_ms);
+        do {
+            tkn = Spi::rw(0xFF);
+        } while((tkn == 0xFF) && Spi::timer_status());
+        Spi::timer_off();
+        if(tkn != 0xFE) return false;
+        for(idx = 0; idx != ofs; idx++)
+        {
+            BYTE b = Spi::rw(0xFF);
+            if constexpr(Options::crc) crc = detail::crc16(crc, b);
+        }
+        for(idx = 0; idx != cnt; idx++)
+        {
+            BYTE b = Spi::rw(0xFF);
+            dat[idx] = b;
+            if constexpr(Options::crc) crc = detail::crc16(crc, b);
+        }
+        for(idx = 0; idx != rest; idx++)
+        {
+            BYTE b = Spi::rw(0xFF);
+            if constexpr(Options::crc) crc = detail::crc16(crc, b);
+        }
+        WORD rx = (WORD)(Spi::rw(0xFF) << 8);
+        rx |= Spi::rw(0xFF);
+        if constexpr(Options::crc) return rx == crc;
+        else return true;
+    }
+
+    /* Send a data block with its token, or the stop tran token */
+    SDRESULTS tx_block(const BYTE *dat, BYTE token)
+    {
+        Spi::rw(token);
+        if(token != 0xFD)
+        {
+            WORD crc = 0;
+            for(WORD idx = 0; idx != SD_BLK_SIZE; idx++)
+            {
+                Spi::rw(dat[idx]);
+                if constexpr(Options::crc) crc = detail::crc16(crc, dat[idx]);
+            }
+            Spi::rw((BYTE)(crc >> 8));
+            Spi::rw((BYTE)crc);
+            // If not accepted, returns the reject error
+            if((Spi::rw(0xFF) & 0x1F) != 0x05) return SD_REJECT;
+        }
+        else Spi::rw(0xFF);     // One byte before the busy of the stop token
+        if constexpr(Options::write_back)
+        {
+            // Tokens of the same CMD25 need the card ready
+            if(token == 0xFC) return wait_ready(Options::write_ms) ? SD_OK : SD_BUSY;
+            busy_ = true;
+            return SD_OK;
+        }
+        else return wait_ready(Options::write_ms) ? SD_OK : SD_BUSY;
+    }
+};
+
+} // namespace ulibsd
+
+#endif
+
+// «sd_card.hpp» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
@@ -6,11 +6,129 @@
  *  License at the end of file.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // fallocate() for the erase emulation over x86
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64    // Images over 2GB over x86
+#endif
+
 #include "sd_io.h"
 #include "spi_io.h"
 #include "stdio.h"
+#include <string.h>
+
+#if defined(SD_IO_ZERO_ELIDE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/******************************************************************************
+ Private Methods - Segment vectors (common to both targets)
+******************************************************************************/
+
+/* Position in a vector of segments */
+typedef struct _SD_IOPOS {
+    const SD_IOVEC *seg;
+    DWORD ofs;          /* Bytes of seg already done */
+} SD_IOPOS;
+
+/**
+    \brief Sectors covered by a vector of segments.
+    \return Zero if the vector is empty or doesn't end at a sector boundary.
+ */
+DWORD __SD_IOV_Sectors(const SD_IOVEC *iov, WORD cnt);
+
+/**
+    \brief Next contiguous piece of a vector, and advance over it.
+    \param pos Position in the vector.
+    \param n Bytes wanted, on return the bytes of the piece (up to n).
+    \return Start of the piece.
+ */
+BYTE *__SD_IOV_Next(SD_IOPOS *pos, WORD *n);
+
+DWORD __SD_IOV_Sectors(const SD_IOVEC *iov, WORD cnt)
+{
+    QWORD total = 0;
+    WORD idx;
+    for(idx=0; idx!=cnt; idx++) total += iov[idx].len;
+    if((total % SD_BLK_SIZE)||(total / SD_BLK_SIZE > 0xFFFFFFFFUL)) return(0);
+    return((DWORD)(total / SD_BLK_SIZE));
+}
+
+BYTE *__SD_IOV_Next(SD_IOPOS *pos, WORD *n)
+{
+    BYTE *p;
+    // Skip the empty segments and the ones already done
+    while(pos->ofs == pos->seg->len)
+    {
+        pos->seg++;
+        pos->ofs = 0;
+    }
+    p = (BYTE*)pos->seg->buf + pos->ofs;
+    if(*n > pos->seg->len - pos->ofs) *n = (WORD)(pos->seg->len - pos->ofs);
+    pos->ofs += *n;
+    return(p);
+}
+
+/******************************************************************************
+ Private Methods - Diagnostics
+******************************************************************************/
+
+/* Big endian word of 4 bytes */
+#define __SD_BE32(p) (((DWORD)(p)[0] << 24) | ((DWORD)(p)[1] << 16) | \
+                      ((DWORD)(p)[2] << 8) | (DWORD)(p)[3])
+
+#ifdef SD_IO_DIAG
+/**
+    \brief Record a message in the ring of the device.
+    \param id Message (SD_DIAG_*), its format stays on the host.
+ */
+void __SD_Diag_Put(SD_DEV *dev, BYTE level, BYTE id, DWORD a, DWORD b, DWORD c, DWORD d);
+
+/* A message of the driver, compiled out above SD_IO_DIAG_LEVEL */
+#define __SD_Diag(dev, level, id, a, b, c, d) \
+    do { if((level) <= SD_IO_DIAG_LEVEL) __SD_Diag_Put(dev, level, id, a, b, c, d); } while(0)
+
+void __SD_Diag_Put(SD_DEV *dev, BYTE level, BYTE id, DWORD a, DWORD b, DWORD c, DWORD d)
+{
+    SD_DIAG_REC *r;
+    if(dev->diag == NULL) return;
+    r = &dev->diag->rec[dev->diag->count++ & (SD_IO_DIAG_SIZE - 1)];
+    r->t_us = SD_Time_Us();
+    r->id = id;
+    r->level = level;
+    r->arg[0] = a;
+    r->arg[1] = b;
+    r->arg[2] = c;
+    r->arg[3] = d;
+}
+#else
+#define __SD_Diag(dev, level, id, a, b, c, d) ((void)0)
+#endif
+
+/******************************************************************************
+ Private Methods - Operations behind the public methods (traced)
+******************************************************************************/
+
+/* Only the public methods record a trace, the driver calls these */
+SDRESULTS __SD_Read_Op(SD_DEV *dev, void *dat, LBA_t sector, WORD ofs, WORD cnt);
+SDRESULTS __SD_ReadV_Op(SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector, DWORD count);
+#ifdef SD_IO_WRITE
+SDRESULTS __SD_Write_Op(SD_DEV *dev, void *dat, LBA_t sector);
+SDRESULTS __SD_Write_Blocks_Op(SD_DEV *dev, void *dat, LBA_t sector, DWORD count);
+SDRESULTS __SD_WriteV_Op(SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector, DWORD count);
+SDRESULTS __SD_Stream_Write_Op(SD_DEV *dev, void *dat);
+SDRESULTS __SD_Erase_Op(SD_DEV *dev, LBA_t first, LBA_t last);
+#endif
 
 #ifdef _M_IX86  // For use over x86
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <stddef.h>
+
 /*****************************************************************************/
 /* Private Methods Prototypes - Direct work with PC file                     */
 /*****************************************************************************/
@@ -20,41 +138,409 @@
  * \param dev Device descriptor.
  * \return Quantity of sectors. Zero if fail.
  */
-DWORD __SD_Sectors (SD_DEV* dev);
+LBA_t __SD_Sectors (SD_DEV* dev);
+
+/**
+ * \brief Emulate the erase of a range of sectors punching a hole in the file.
+ * \param dev Device descriptor.
+ * \param first First sector to erase.
+ * \param last Last sector to erase (inclusive).
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Erase (SD_DEV *dev, LBA_t first, LBA_t last);
+
+/**
+ * \brief Write consecutive sectors in one transfer.
+ * \param dev Device descriptor.
+ * \param dat Data to write.
+ * \param sector First sector.
+ * \param count Number of sectors.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Write_Multi (SD_DEV *dev, BYTE *dat, LBA_t sector, DWORD count);
+
+/**
+ * \brief Fill the card profile as a SDHC card of class 10.
+ * \param dev Device descriptor.
+ */
+void __SD_Profile (SD_DEV *dev);
+
+/**
+ * \brief Tell if a range of an image file is a hole (SEEK_DATA), keeping the
+ *        extent found for the next queries.
+ * \param dev Device descriptor.
+ * \param img 0 for the image, 1 for the base.
+ * \param ofs First byte of the range.
+ * \param len Bytes of the range.
+ * \return TRUE if nothing of the range is allocated.
+ */
+BOOL __SD_Hole (SD_DEV *dev, BYTE img, QWORD ofs, DWORD len);
+
+/**
+ * \brief Read bytes of the emulated card: data of the image, the base under
+ *        its holes, or zeros without I/O where both are holes.
+ * \param dev Device descriptor.
+ * \param dat Destination.
+ * \param ofs Byte address in the card.
+ * \param cnt Byte count.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Image_Read (SD_DEV *dev, void *dat, QWORD ofs, WORD cnt);
+
+/**
+ * \brief Get the image ready for a write of a range of sectors: forget the
+ *        extent known and, over a base, copy the blocks of SD_IO_COW_BLOCK
+ *        sectors not yet in the image that the write covers partially.
+ * \param dev Device descriptor.
+ * \param first First sector to write.
+ * \param last Last sector to write (inclusive).
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Image_Prepare (SD_DEV *dev, LBA_t first, LBA_t last);
+
+/**
+ * \brief Vectored read or write of the image (preadv/pwritev), bypassing
+ *        the stdio buffer.
+ * \param dev Device descriptor.
+ * \param iov Segments.
+ * \param cnt Number of segments.
+ * \param ofs Byte address in the card.
+ * \param wr TRUE to write.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Image_V (SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, QWORD ofs, BOOL wr);
+
+/**
+ * \brief Open the image, and the base with the image created over it if
+ *        it's missing.
+ * \param dev Device descriptor.
+ * \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Image_Open (SD_DEV *dev);
+
+#ifdef SD_IO_MODEL
+#define SD_MODEL_CMD_BYTES  18  /* Select, frame, NCR and release of a command */
+#define SD_MODEL_BLK_BYTES  516 /* Token, data, CRC and response of a block     */
+#define SD_MODEL_ERASE      1   /* Busy of __SD_Model: erase                    */
+#define SD_MODEL_INIT       2   /* Busy of __SD_Model: SD_Init                  */
+
+/* Virtual time of the models (us) */
+static QWORD sd_model_us;
+
+/**
+ * \brief Spend the modeled time of an operation.
+ * \param dev Device descriptor.
+ * \param cmds Commands sent.
+ * \param reads Blocks read.
+ * \param writes Blocks written, each one with its busy.
+ * \param busy Other busy: SD_MODEL_ERASE, SD_MODEL_INIT or 0.
+ */
+void __SD_Model (SD_DEV *dev, WORD cmds, DWORD reads, DWORD writes, BYTE busy);
+
+/**
+ * \brief Draw the busy of a block written.
+ * \param m Timing model.
+ * \return Microseconds.
+ */
+DWORD __SD_Model_Busy (SD_MODEL *m);
+#else
+#define __SD_Model(dev, cmds, reads, writes, busy) ((void)0)
+#endif
 
 /*****************************************************************************/
 /* Private Methods - Direct work with PC file                                */
 /*****************************************************************************/
 
-DWORD __SD_Sectors (SD_DEV *dev)
+#ifdef SD_IO_MODEL
+void __SD_Model (SD_DEV *dev, WORD cmds, DWORD reads, DWORD writes, BYTE busy)
+{
+    SD_MODEL *m = dev->model;
+    QWORD us;
+    struct timespec ts;
+    if(m == NULL) return;
+    us = (QWORD)cmds * m->cmd_us + (QWORD)reads * m->read_us;
+    if(busy == SD_MODEL_ERASE) us += m->erase_us;
+    if(busy == SD_MODEL_INIT) us += m->init_us;
+    if(m->spi_khz)
+        us += ((QWORD)cmds * SD_MODEL_CMD_BYTES +
+               (QWORD)(reads + writes) * SD_MODEL_BLK_BYTES) * 8000 / m->spi_khz;
+    while(writes--) us += __SD_Model_Busy(m);
+    if(m->wall)
+    {
+        ts.tv_sec = (time_t)(us / 1000000);
+        ts.tv_nsec = (long)(us % 1000000) * 1000;
+        while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+    }
+    else sd_model_us += us;
+}
+
+DWORD __SD_Model_Busy (SD_MODEL *m)
+{
+    // Cumulated probability of each point, per million
+    static const DWORD at[SD_MODEL_POINTS] = { 0, 500000, 900000, 990000, 1000000 };
+    DWORD u, idx, us;
+    // xorshift32
+    m->seed ^= m->seed << 13;
+    m->seed ^= m->seed >> 17;
+    m->seed ^= m->seed << 5;
+    u = m->seed % 1000000;
+    for(idx = 1; u >= at[idx]; idx++);
+    us = m->prog_us[idx - 1] +
+         (DWORD)((QWORD)(m->prog_us[idx] - m->prog_us[idx - 1]) * (u - at[idx - 1]) /
+                 (at[idx] - at[idx - 1]));
+    m->seed ^= m->seed << 13;
+    m->seed ^= m->seed >> 17;
+    m->seed ^= m->seed << 5;
+    if(m->seed % 1000000 < m->gc_ppm) us += m->gc_us;
+    return(us);
+}
+#endif
+
+LBA_t __SD_Sectors (SD_DEV *dev)
 {
     if (dev->fp == NULL) return(0); // Fail
     else {
-        fseek(dev->fp, 0L, SEEK_END);
-        return (((DWORD)(ftell(dev->fp)))/((DWORD)512)-1);
+        fseeko(dev->fp, 0, SEEK_END);
+        return ((LBA_t)(ftello(dev->fp) / SD_BLK_SIZE) - 1);
+    }
+}
+
+void __SD_Profile (SD_DEV *dev)
+{
+    SD_PROFILE *p = &dev->profile;
+    memset(p, 0, sizeof(SD_PROFILE));
+    // CSD version 2.0 fixed values
+    p->csd_ver = 2;
+    p->ccc = 0x5B5;
+    p->taac_ns = 1000000;
+    p->r2w_factor = 4;
+    p->tran_khz = 25000;
+    p->erase_blk_en = TRUE;
+    p->sector_size = 128;
+    memcpy(p->oid, "PC", 3);
+    memcpy(p->pnm, "x86SD", 6);
+    p->year = 2015;
+    p->month = 1;
+    p->sd_spec = 5;
+    p->bus_widths = 0x05;
+    p->cmd_support = 0x02;
+    p->discard = TRUE;
+    p->read_ms = SD_IO_READ_TIMEOUT_WAIT;
+    p->write_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+}
+
+SDRESULTS __SD_Erase (SD_DEV *dev, LBA_t first, LBA_t last)
+{
+    BYTE zero[SD_BLK_SIZE];
+    if((first > last)||(last > dev->last_sector)) return(SD_PARERR);
+    if(dev->fp == NULL) return(SD_ERROR);
+    // CMD32, CMD33 and CMD38
+    __SD_Model(dev, 3, 0, 0, SD_MODEL_ERASE);
+    // Pending writes of the stream must reach the file before the hole
+    fflush(dev->fp);
+    dev->ext[0].end = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // A hole over a base would show the base again
+    if((dev->bfp == NULL)&&
+       (fallocate(fileno(dev->fp), FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                  (off_t)first * SD_BLK_SIZE,
+                  (off_t)(last - first + 1) * SD_BLK_SIZE)==0))
+    {
+#ifdef SD_IO_DBG_COUNT
+        dev->debug.erase++;
+#endif
+        return(SD_OK);
+    }
+#endif
+    // File system without holes, write the zeros
+    memset(zero, 0, SD_BLK_SIZE);
+    if(__SD_Image_Prepare(dev, first, last)!=SD_OK) return(SD_ERROR);
+    if(fseeko(dev->fp, (off_t)first * SD_BLK_SIZE, SEEK_SET)!=0) return(SD_ERROR);
+    do {
+        if(fwrite(zero, 1, SD_BLK_SIZE, dev->fp)!=SD_BLK_SIZE) return(SD_ERROR);
+    } while(first++ != last);
+#ifdef SD_IO_DBG_COUNT
+    dev->debug.erase++;
+#endif
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Write_Multi (SD_DEV *dev, BYTE *dat, LBA_t sector, DWORD count)
+{
+    if(dev->fp == NULL) return(SD_ERROR);
+    // ACMD23, CMD25, the blocks and the stop tran token
+    __SD_Model(dev, 4, 0, count, 0);
+    if(__SD_Image_Prepare(dev, sector, sector + count - 1)!=SD_OK) return(SD_ERROR);
+    if(fseeko(dev->fp, (off_t)sector * SD_BLK_SIZE, SEEK_SET)!=0) return(SD_ERROR);
+    if(fwrite(dat, SD_BLK_SIZE, count, dev->fp)!=count) return(SD_ERROR);
+#ifdef SD_IO_DBG_COUNT
+    dev->debug.write += count;
+#endif
+    return(SD_OK);
+}
+
+BOOL __SD_Hole (SD_DEV *dev, BYTE img, QWORD ofs, DWORD len)
+{
+#ifdef SEEK_DATA
+    SD_EXTENT *e = &dev->ext[img];
+    int fd = fileno(img ? dev->bfp : dev->fp);
+    off_t cur, data, hole;
+    if((ofs >= e->start)&&(ofs + len <= e->end)) return(e->hole);
+    // The holes are those of the file, not of the stdio buffer
+    if((img == 0)&&dev->dirty)
+    {
+        fflush(dev->fp);
+        dev->dirty = FALSE;
+    }
+    // The lookups move the offset of the file, under the feet of stdio
+    cur = lseek(fd, 0, SEEK_CUR);
+    data = lseek(fd, (off_t)ofs, SEEK_DATA);
+    if((data < 0)&&(errno == ENXIO)) data = -2;
+    hole = (data >= 0) ? lseek(fd, data, SEEK_HOLE) : -1;
+    lseek(fd, cur, SEEK_SET);
+    if(data == -1) return(FALSE);
+    if((data < 0)||((QWORD)data >= ofs + len))
+    {
+        // Hole up to the next data, or to the end of the file
+        e->start = ofs;
+        e->end = (data < 0) ? ~(QWORD)0 : (QWORD)data;
+        e->hole = TRUE;
+        return(TRUE);
+    }
+    if(((QWORD)data <= ofs)&&(hole > data))
+    {
+        e->start = (QWORD)data;
+        e->end = (QWORD)hole;
+        e->hole = FALSE;
+    }
+    return(FALSE);
+#else
+    (void)dev; (void)img; (void)ofs; (void)len;
+    return(FALSE);
+#endif
+}
+
+SDRESULTS __SD_Image_Read (SD_DEV *dev, void *dat, QWORD ofs, WORD cnt)
+{
+    if(__SD_Hole(dev, 0, ofs, cnt))
+    {
+        if((dev->bfp == NULL)||__SD_Hole(dev, 1, ofs, cnt))
+        {
+            memset(dat, 0, cnt);
+            return(SD_OK);
+        }
+        return((pread(fileno(dev->bfp), dat, cnt, (off_t)ofs)==cnt) ? SD_OK : SD_ERROR);
+    }
+    if(fseeko(dev->fp, (off_t)ofs, SEEK_SET)!=0) return(SD_ERROR);
+    return((fread(dat, 1, cnt, dev->fp)==cnt) ? SD_OK : SD_ERROR);
+}
+
+SDRESULTS __SD_Image_Prepare (SD_DEV *dev, LBA_t first, LBA_t last)
+{
+    BYTE blk[SD_IO_COW_BLOCK * SD_BLK_SIZE];
+    LBA_t b;
+    QWORD ofs;
+    dev->ext[0].end = 0;
+    dev->dirty = TRUE;
+    if(dev->bfp == NULL) return(SD_OK);
+    // Only the first and the last blocks can be partially written
+    for(b = first - first % SD_IO_COW_BLOCK; b <= last; b += SD_IO_COW_BLOCK)
+    {
+        if((b >= first)&&(b + SD_IO_COW_BLOCK - 1 <= last)) continue;
+        ofs = (QWORD)b * SD_BLK_SIZE;
+        if(!__SD_Hole(dev, 0, ofs, sizeof(blk))||__SD_Hole(dev, 1, ofs, sizeof(blk))) continue;
+        if(pread(fileno(dev->bfp), blk, sizeof(blk), (off_t)ofs)!=(ssize_t)sizeof(blk)) return(SD_ERROR);
+        if(pwrite(fileno(dev->fp), blk, sizeof(blk), (off_t)ofs)!=(ssize_t)sizeof(blk)) return(SD_ERROR);
+        dev->ext[0].end = 0;
+    }
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Image_V (SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, QWORD ofs, BOOL wr)
+{
+    struct iovec v[16];
+    WORD n, idx;
+    ssize_t len, done;
+    // The file must hold what stdio has buffered
+    if(fflush(dev->fp)!=0) return(SD_ERROR);
+    while(cnt)
+    {
+        n = (cnt > 16) ? 16 : cnt;
+        for(idx=0, len=0; idx!=n; idx++)
+        {
+            v[idx].iov_base = iov[idx].buf;
+            v[idx].iov_len = iov[idx].len;
+            len += iov[idx].len;
+        }
+        done = wr ? pwritev(fileno(dev->fp), v, n, (off_t)ofs)
+                  : preadv(fileno(dev->fp), v, n, (off_t)ofs);
+        if(done != len) return(SD_ERROR);
+        ofs += len;
+        iov += n;
+        cnt -= n;
+    }
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Image_Open (SD_DEV *dev)
+{
+    dev->bfp = NULL;
+    dev->ext[0].end = 0;
+    dev->ext[1].end = 0;
+    dev->dirty = FALSE;
+    if(dev->base != NULL)
+    {
+#ifndef SEEK_DATA
+        return(SD_ERROR);       // Can't tell the holes of the image
+#endif
+        dev->bfp = fopen(dev->base, "rb");
+        if(dev->bfp == NULL) return(SD_ERROR);
+    }
+    dev->fp = fopen(dev->fn, "r+");
+    if((dev->fp == NULL)&&(dev->bfp != NULL))
+    {
+        // A new image is all hole, as large as the base
+        dev->fp = fopen(dev->fn, "w+");
+        if((dev->fp != NULL)&&((fseeko(dev->bfp, 0, SEEK_END)!=0)||
+           (ftruncate(fileno(dev->fp), ftello(dev->bfp))!=0)))
+        {
+            fclose(dev->fp);
+            dev->fp = NULL;
+        }
     }
+    if(dev->fp != NULL) return(SD_OK);
+    if(dev->bfp != NULL) fclose(dev->bfp);
+    dev->bfp = NULL;
+    return(SD_ERROR);
 }
 #else   // For use with uControllers
 /******************************************************************************
  Private Methods Prototypes - Direct work with SD card
 ******************************************************************************/
 
-/**
-    \brief Simple function to calculate power of two.
-    \param e Exponent.
-    \return Math function result.
-*/
-DWORD __SD_Power_Of_Two(BYTE e);
-
 /**
      \brief Assert the SD card (SPI CS low).
  */
-inline void __SD_Assert (void);
+static inline void __SD_Assert (void);
 
 /**
     \brief Deassert the SD (SPI CS high).
  */
-inline void __SD_Deassert (void);
+static inline void __SD_Deassert (void);
+
+/**
+    \brief Route the bus to the card of the device (SD_IO_SLOTS), nothing
+           with a single card.
+ */
+static inline void __SD_Route (SD_DEV *dev);
+
+#if defined(SD_IO_SLOTS) && defined(SD_IO_TUNE)
+/**
+    \brief The slots share the clock: set the one tuned for the card when the
+           bus runs at the clock of another one. Nothing during an init.
+ */
+void __SD_Route_Clock (SD_DEV *dev);
+#endif
 
 /**
     \brief Change to max the speed transfer.
@@ -64,11 +550,68 @@ void __SD_Speed_Transfer (BYTE throttle);
 
 /**
     \brief Send SPI commands.
+    \param dev Device descriptor.
     \param cmd Command to send.
     \param arg Argument to send.
     \return R1 response.
  */
-BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg);
+BYTE __SD_Send_Cmd(SD_DEV *dev, BYTE cmd, DWORD arg);
+
+/**
+    \brief Wait until the card release the busy state (DO high).
+    \param ms Timeout in milliseconds.
+    \return Last byte read, zero if the card still busy.
+ */
+BYTE __SD_Wait_Ready(WORD ms);
+
+/**
+    \brief Receive a data packet (token, data and CRC) from the card, waiting
+           for the token up to the read access time of the card.
+    \param dat Storage for the data.
+    \param cnt Byte count of data in the packet.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Read_Data(SD_DEV *dev, BYTE *dat, WORD cnt);
+
+/**
+    \brief Receive a data packet into a vector of segments.
+    \param pos Position in the vector, advanced over the data.
+    \param cnt Byte count of data in the packet.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Read_Data_V(SD_DEV *dev, SD_IOPOS *pos, WORD cnt);
+
+/**
+    \brief Erase or discard a range of sectors.
+    \param first First sector.
+    \param last Last sector (inclusive).
+    \param arg Argument of CMD38 (SD_ERASE_ARG or SD_DISCARD_ARG).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Erase(SD_DEV *dev, LBA_t first, LBA_t last, DWORD arg);
+
+/**
+    \brief Write sectors [first, end) as they read back erased, for the parts
+           of an erase out of whole erase groups.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Erase_Fill(SD_DEV *dev, LBA_t first, LBA_t end);
+
+/**
+    \brief Busy time of an erase, from ERASE_TIMEOUT, ERASE_SIZE and
+           ERASE_OFFSET of the SD Status.
+    \param first First sector.
+    \param last Last sector (inclusive).
+    \return Timeout in milliseconds.
+ */
+WORD __SD_Erase_Timeout(SD_DEV *dev, LBA_t first, LBA_t last);
+
+/**
+    \brief Flush of SPI buffer at the end of an operation, skipped inside a
+           session.
+    \param dev Device descriptor.
+ */
+void __SD_Release(SD_DEV *dev);
 
 /**
     \brief Write a data block on SD card.
@@ -78,58 +621,138 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg);
 SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token);
 
 /**
-    \brief Get the total numbers of sectors in SD card.
+    \brief Write a data block taken from a vector of segments.
+    \param pos Position in the vector, advanced over the block. Not used
+           with the stop tran token.
+    \param token Inidicates the type of transfer (single or multiple).
+ */
+SDRESULTS __SD_Write_Block_V(SD_DEV *dev, SD_IOPOS *pos, BYTE token);
+
+/**
+    \brief Send a data block, or the stop tran token, without the wait for
+           the programming busy.
+    \return SD_OK, SD_REJECT if the card doesn't accept the data.
+ */
+SDRESULTS __SD_Send_Block_V(SD_DEV *dev, SD_IOPOS *pos, BYTE token);
+
+/**
+    \brief Write consecutive sectors with a single CMD25.
+    \param dat Data to write.
+    \param sector First sector.
+    \param count Number of sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Write_Multi(SD_DEV *dev, BYTE *dat, LBA_t sector, DWORD count);
+
+/**
+    \brief Argument of the data commands for a sector.
+    \param dev Device descriptor.
+    \param sector Sector number, already checked against last_sector.
+    \return Block number on SDHC/SDXC cards, byte address on the others.
+ */
+DWORD __SD_Addr (SD_DEV *dev, LBA_t sector);
+
+/**
+    \brief Read the CSD (CMD9): decode the profile, derive the read and write
+           timeouts and get the total numbers of sectors in SD card.
     \param dev Device descriptor.
     \return Quantity of sectors. Zero if fail.
  */
-DWORD __SD_Sectors (SD_DEV *dev);
+LBA_t __SD_Read_CSD (SD_DEV *dev);
+
+/**
+    \brief Read the CID (CMD10) into the profile.
+    \param dev Device descriptor.
+ */
+void __SD_Read_CID(SD_DEV *dev);
+
+/**
+    \brief Read the SCR (ACMD51) into the profile.
+    \param dev Device descriptor.
+ */
+void __SD_Read_SCR(SD_DEV *dev);
+
+/**
+    \brief Read the SD Status (ACMD13) and keep the AU size, speed class,
+           discard support and erase timing.
+    \param dev Device descriptor.
+ */
+void __SD_Read_Status(SD_DEV *dev);
+
+/**
+    \brief Ask the card status (CMD13), the R2 is kept in dev->status.
+    \param dev Device descriptor.
+    \return SD_OK if the card is ready for transfers.
+ */
+SDRESULTS __SD_Check(SD_DEV *dev);
+
+/**
+    \brief Resync the bus: wait for the end of the busy, clock the card
+           deselected and select it again.
+    \param dev Device descriptor.
+ */
+void __SD_Resync(SD_DEV *dev);
 
 /******************************************************************************
  Private Methods - Direct work with SD card
 ******************************************************************************/
 
-DWORD __SD_Power_Of_Two(BYTE e)
-{
-    DWORD partial = 1;
-    BYTE idx;
-    for(idx=0; idx!=e; idx++) partial *= 2;
-    return(partial);
-}
-
-inline void __SD_Assert(void){
+static inline void __SD_Assert(void){
     SPI_CS_Low();
 }
 
-inline void __SD_Deassert(void){
+static inline void __SD_Deassert(void){
     SPI_CS_High();
 }
 
+#if defined(SD_IO_SLOTS) && defined(SD_IO_TUNE)
+/* Card whose clock the bus runs at, NULL after a clock of the driver */
+static SD_DEV *sd_bus_clock;
+#endif
+
+static inline void __SD_Route(SD_DEV *dev){
+#ifdef SD_IO_SLOTS
+    SPI_Slot(dev->slot);
+#ifdef SD_IO_TUNE
+    __SD_Route_Clock(dev);
+#endif
+#else
+    (void)dev;
+#endif
+}
+
 void __SD_Speed_Transfer(BYTE throttle) {
     if(throttle == HIGH) SPI_Freq_High();
     else SPI_Freq_Low();
+#if defined(SD_IO_SLOTS) && defined(SD_IO_TUNE)
+    sd_bus_clock = NULL;
+#endif
 }
 
-BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
+BYTE __SD_Send_Cmd(SD_DEV *dev, BYTE cmd, DWORD arg)
 {
-    BYTE crc, res;
+    BYTE crc, res, idx;
+    __SD_Route(dev);
     // ACMD«n» is the command sequense of CMD55-CMD«n»
-    SD_PRINTF("cmd & 0x80= %d\n",(cmd&0x80));
     if(cmd & 0x80) {
-        SD_PRINTF("acilea\n");
         cmd &= 0x7F;
-        res = __SD_Send_Cmd(CMD55, 0);
-        SD_PRINTF("send command res= %d\n", res);
+        res = __SD_Send_Cmd(dev, CMD55, 0);
         if (res > 1) return (res);
     }
 
-    // Select the card
-    __SD_Deassert();
-    SPI_RW(0xFF);
-    __SD_Assert();
-    SPI_RW(0xFF);
+    // Select the card, inside a session it's already selected
+    if(dev->session == FALSE)
+    {
+        __SD_Deassert();
+        SPI_RW(0xFF);
+        __SD_Assert();
+        SPI_RW(0xFF);
+    }
+#ifdef SD_IO_DBG_COUNT
+    else dev->debug.saved += 2;
+#endif
 
     // Send complete command set
-    SD_PRINTF("cmd= %d\n",cmd);
     SPI_RW(cmd);                        // Start and command index
     SPI_RW((BYTE)(arg >> 24));          // Arg[31-24]
     SPI_RW((BYTE)(arg >> 16));          // Arg[23-16]
@@ -143,412 +766,2142 @@ BYTE __SD_Send_Cmd(BYTE cmd, DWORD arg)
     if(cmd == CMD55)  crc = 0x65;         // Valid CRC for CMD8(0x1AA)
     if(cmd == ACMD41) crc = 0x77;         // Valid CRC for CMD8(0x1AA)
     SPI_RW(crc);
+    if(cmd == CMD12) SPI_RW(0xFF);      // Skip a stuff byte on stop reading
 
     // Receive command response
-    // Wait for a valid response in timeout of 5 milliseconds
-    SPI_Timer_On(5);
+    // The response comes within NCR (8 bytes), counting bytes leaves the
+    // timer free for the loops of the caller
+    idx = 10;
     do {
         res = SPI_RW(0xFF);
-        SD_PRINTF("SPI_RW res= %d\n",res);
-    } while((res & 0x80)&&(SPI_Timer_Status()==TRUE));
-    SPI_Timer_Off();
+    } while((res & 0x80)&&(--idx));
+    __SD_Diag(dev, SD_DIAG_DEBUG, SD_DIAG_CMD, cmd & 0x3F, arg, res, 0);
     // Return with the response value
     return(res);
 }
 
-SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token)
+void __SD_Release(SD_DEV *dev)
+{
+    if(dev->session == FALSE) SPI_Release();
+#ifdef SD_IO_DBG_COUNT
+    else dev->debug.saved += SD_RELEASE_BYTES;
+#endif
+}
+
+BYTE __SD_Wait_Ready(WORD ms)
 {
-    WORD idx;
     BYTE line;
-    // Send token (single or multiple)
-    SPI_RW(token);
-    // Single block write?
-    if(token != 0xFD)
-    {
-        // Send block data
-        for(idx=0; idx!=SD_BLK_SIZE; idx++) SPI_RW(*((BYTE*)dat + idx));
-        /* Dummy CRC */
-        SPI_RW(0xFF);
-        SPI_RW(0xFF);
-        // If not accepted, returns the reject error
-        if((SPI_RW(0xFF) & 0x1F) != 0x05) return(SD_REJECT);
-    }
-#ifdef SD_IO_WRITE_WAIT_BLOCKER
-    // Waits until finish of data programming (blocked)
-    while(SPI_RW(0xFF)==0);
-    return(SD_OK);
-#else
-    // Waits until finish of data programming with a timeout
-    SPI_Timer_On(SD_IO_WRITE_TIMEOUT_WAIT);
+    SPI_Timer_On(ms);
     do {
         line = SPI_RW(0xFF);
     } while((line==0)&&(SPI_Timer_Status()==TRUE));
     SPI_Timer_Off();
-#ifdef SD_IO_DBG_COUNT
-    dev->debug.write++;
-#endif
-    if(line==0) return(SD_BUSY);
-    else return(SD_OK);
-#endif
+    return(line);
 }
 
-DWORD __SD_Sectors (SD_DEV *dev)
+SDRESULTS __SD_Read_Data(SD_DEV *dev, BYTE *dat, WORD cnt)
 {
-    BYTE csd[16];
-    BYTE idx;
-    DWORD ss = 0;
-    WORD C_SIZE = 0;
-    BYTE C_SIZE_MULT = 0;
-    BYTE READ_BL_LEN = 0;
-    if(__SD_Send_Cmd(CMD9, 0)==0)
-    {
-        printf("cmd9\n");
-        // Wait for response
-        while (SPI_RW(0xFF) == 0xFF);
-        for (idx=0; idx!=16; idx++) csd[idx] = SPI_RW(0xFF);
-
-        for (int i = 0; i < 16; i++) {
-            printf("csd[%d] = 0x%02X\n", i, csd[i]);
-        }
-        printf("Card type = 0x%02X\n", dev->cardtype);
-        // Dummy CRC
-        SPI_RW(0xFF);
-        SPI_RW(0xFF);
-        SPI_Release();
-        if(dev->cardtype & SDCT_SD1)
-        {
-            ss = csd[0];
-            // READ_BL_LEN[83:80]: max. read data block length
-            READ_BL_LEN = (csd[5] & 0x0F);
-            // C_SIZE [73:62]
-            C_SIZE = (csd[6] & 0x03);
-            C_SIZE <<= 8;
-            C_SIZE |= (csd[7]);
-            C_SIZE <<= 2;
-            C_SIZE |= ((csd[8] >> 6) & 0x03);
-            // C_SIZE_MULT [49:47]
-            C_SIZE_MULT = (csd[9] & 0x03);
-            C_SIZE_MULT <<= 1;
-            C_SIZE_MULT |= ((csd[10] >> 7) & 0x01);
-        }
-        else if (dev->cardtype & SDCT_SD2)
-        {
-            // C_SIZE [69:48]
-            C_SIZE = ((DWORD)(csd[7] & 0x3F) << 16) |
-                     ((DWORD)csd[8] << 8) |
-                     (DWORD)csd[9];
-
-            if (dev->cardtype & SDCT_BLOCK) {
-                // SDHC/SDXC card (block addressing)
-                ss = C_SIZE + 1;  // Number of 512-byte sectors
-            } else {
-                // SDSC card (byte addressing — rare for SDv2)
-                C_SIZE_MULT = ((csd[9] & 0x03) << 1) | ((csd[10] >> 7) & 0x01);
-                READ_BL_LEN = csd[5] & 0x0F;
-                ss = (C_SIZE + 1);
-                ss <<= (C_SIZE_MULT + 2);
-                ss >>= (READ_BL_LEN - 9);  // Convert to 512-byte sectors
-            }
-        }
-        ss = (C_SIZE + 1) * 1024;
-        // ss *= __SD_Power_Of_Two(C_SIZE_MULT + 2);
-        // ss *= __SD_Power_Of_Two(READ_BL_LEN);
-        // ss /= SD_BLK_SIZE;
-        return (ss);
-    } else return (0); // Error
+    SD_IOVEC seg;
+    SD_IOPOS pos;
+    seg.buf = dat;
+    seg.len = cnt;
+    pos.seg = &seg;
+    pos.ofs = 0;
+    return(__SD_Read_Data_V(dev, &pos, cnt));
 }
-#endif // Private methods for uC
 
-/******************************************************************************
- Public Methods - Direct work with SD card
-******************************************************************************/
+SDRESULTS __SD_Read_Data_V(SD_DEV *dev, SD_IOPOS *pos, WORD cnt)
+{
+    BYTE tkn, *dat;
+    WORD n;
+    SPI_Timer_On(dev->profile.read_ms);     // Wait for data packet
+    do {
+        tkn = SPI_RW(0xFF);
+    } while((tkn==0xFF)&&(SPI_Timer_Status()==TRUE));
+    SPI_Timer_Off();
+    if(tkn!=0xFE)
+    {
+        __SD_Diag(dev, SD_DIAG_ERROR, SD_DIAG_TOKEN, tkn, 0, 0, 0);
+        return(SD_ERROR);
+    }
+    // Piece by piece, each one straight into its segment
+    do {
+        n = cnt;
+        dat = __SD_IOV_Next(pos, &n);
+        cnt -= n;
+        do {
+            *dat++ = SPI_RW(0xFF);
+        } while(--n);
+    } while(cnt);
+    // Dummy CRC
+    SPI_RW(0xFF);
+    SPI_RW(0xFF);
+    return(SD_OK);
+}
 
-SDRESULTS SD_Init(SD_DEV *dev)
+SDRESULTS __SD_Erase(SD_DEV *dev, LBA_t first, LBA_t last, DWORD arg)
 {
-#if defined(_M_IX86)    // x86
-    dev->fp = fopen(dev->fn, "r+");
-    if (dev->fp == NULL)
-        return (SD_ERROR);
-    else
+    SDRESULTS res = SD_OK;
+    LBA_t head, tail;
+    WORD size = 1;
+    if((first > last)||(last > dev->last_sector)) return(SD_PARERR);
+    // MMC use CMD35/CMD36 instead, not supported
+    if(!(dev->cardtype & SDCT_SDC)) return(SD_ERROR);
+    if(!(dev->profile.ccc & SD_CCC_ERASE)) return(SD_ERROR);
+    // Without ERASE_BLK_EN (SDSC) the card erases whole SECTOR_SIZE groups:
+    // erase only the groups inside [head, tail), write the rest
+    if(!dev->profile.erase_blk_en) size = dev->profile.sector_size;
+    head = (first + size - 1) / size * size;
+    tail = (last + 1) / size * size;
+    if(head >= tail) head = tail = last + 1;
+    // A discard leaves them undefined anyway
+    if(arg != SD_DISCARD_ARG) res = __SD_Erase_Fill(dev, first, head);
+    if((res==SD_OK)&&(head < tail))
     {
-        dev->last_sector = __SD_Sectors(dev);
+        res = SD_ERROR;
+        if((__SD_Send_Cmd(dev, CMD32, __SD_Addr(dev, head))==0)&&
+           (__SD_Send_Cmd(dev, CMD33, __SD_Addr(dev, tail - 1))==0)&&
+           (__SD_Send_Cmd(dev, CMD38, arg)==0))
+        {
+            // The erase takes the busy state until finish
+            res = __SD_Wait_Ready(__SD_Erase_Timeout(dev, head, tail - 1)) ? SD_OK : SD_BUSY;
 #ifdef SD_IO_DBG_COUNT
-        dev->debug.read = 0;
-        dev->debug.write = 0;
+            dev->debug.erase++;
 #endif
-        return (SD_OK);
+        }
+        __SD_Release(dev);
     }
-#else   // uControllers
-    BYTE n, cmd, ct, ocr[4];
-    BYTE idx;
-    BYTE init_trys;
-    ct = 0;
-    SD_PRINTF("entering sd_init()\n");
+    if((res==SD_OK)&&(arg != SD_DISCARD_ARG)) res = __SD_Erase_Fill(dev, tail, last + 1);
+    return(res);
+}
 
-    for(init_trys=0; ((init_trys!=SD_INIT_TRYS)&&(!ct)); init_trys++)
+SDRESULTS __SD_Erase_Fill(SD_DEV *dev, LBA_t first, LBA_t end)
+{
+    SDRESULTS res = SD_OK;
+    SD_IOVEC seg[SD_BLK_SIZE / 32];
+    SD_IOPOS pos;
+    BYTE fill[32];
+    WORD idx;
+    // One small buffer over the whole block
+    memset(fill, dev->erase_zero ? 0x00 : 0xFF, sizeof(fill));
+    for(idx = 0; idx != SD_BLK_SIZE / 32; idx++)
     {
-        SD_PRINTF("Attempt #%d\n", init_trys);
-        // Initialize SPI for use with the memory card
-        SPI_Init();
+        seg[idx].buf = fill;
+        seg[idx].len = sizeof(fill);
+    }
+    for(; (first < end)&&(res==SD_OK); first++)
+    {
+        pos.seg = seg;
+        pos.ofs = 0;
+        // Single block write (token <- 0xFE)
+        if(__SD_Send_Cmd(dev, CMD24, __SD_Addr(dev, first))!=0) res = SD_ERROR;
+        else res = __SD_Write_Block_V(dev, &pos, 0xFE);
+        __SD_Release(dev);
+    }
+    return(res);
+}
+
+WORD __SD_Erase_Timeout(SD_DEV *dev, LBA_t first, LBA_t last)
+{
+    DWORD ms;
+    if((dev->profile.erase_au_ms == 0)||(dev->au_size == 0))
+        return(SD_IO_ERASE_TIMEOUT_WAIT);
+    // Every AU touched by the range, plus the offset
+    ms = (DWORD)(last / dev->au_size - first / dev->au_size + 1);
+    if(ms > (0xFFFFUL / dev->profile.erase_au_ms)) return(0xFFFF);
+    ms = ms * dev->profile.erase_au_ms + dev->profile.erase_ofs_ms;
+    return((ms > 0xFFFFUL) ? 0xFFFF : (WORD)ms);
+}
+
+SDRESULTS __SD_Write_Block(SD_DEV *dev, void *dat, BYTE token)
+{
+    SD_IOVEC seg;
+    SD_IOPOS pos;
+    seg.buf = dat;
+    seg.len = SD_BLK_SIZE;
+    pos.seg = &seg;
+    pos.ofs = 0;
+    return(__SD_Write_Block_V(dev, &pos, token));
+}
 
-        // Power On step
+SDRESULTS __SD_Write_Block_V(SD_DEV *dev, SD_IOPOS *pos, BYTE token)
+{
+    if(__SD_Send_Block_V(dev, pos, token)!=SD_OK) return(SD_REJECT);
+#ifdef SD_IO_WRITE_WAIT_BLOCKER
+    // Waits until finish of data programming (blocked)
+    while(SPI_RW(0xFF)==0);
+    return(SD_OK);
+#else
+    // Waits until finish of data programming with a timeout
+    if(__SD_Wait_Ready(dev->profile.write_ms)==0)
+    {
+        __SD_Diag(dev, SD_DIAG_WARN, SD_DIAG_BUSY, dev->profile.write_ms, 0, 0, 0);
+        return(SD_BUSY);
+    }
+    else return(SD_OK);
+#endif
+}
+
+SDRESULTS __SD_Send_Block_V(SD_DEV *dev, SD_IOPOS *pos, BYTE token)
+{
+    WORD cnt, n;
+    BYTE *dat, resp;
+    (void)dev;
+    // Send token (single or multiple)
+    SPI_RW(token);
+    // Single block write?
+    if(token != 0xFD)
+    {
+        // Send block data, piece by piece
+        cnt = SD_BLK_SIZE;
+        do {
+            n = cnt;
+            dat = __SD_IOV_Next(pos, &n);
+            cnt -= n;
+            do {
+                SPI_RW(*dat++);
+            } while(--n);
+        } while(cnt);
+        /* Dummy CRC */
+        SPI_RW(0xFF);
+        SPI_RW(0xFF);
+        // If not accepted, returns the reject error
+        resp = SPI_RW(0xFF);
+        if((resp & 0x1F) != 0x05)
         {
-            /*
-             * Power ON or card insersion
-               After supply voltage reached above 2.2 volts, wait for one millisecond at least.
-               Set SPI clock rate between 100 kHz and 400 kHz. Set DI and CS high and apply 74 or more clock pulses to SCLK.
-               The card will enter its native operating mode and go ready to accept native command.
-             * */
-            SPI_CS_High();  //CS high
-            SPI_Freq_Low(); // set spi to between 100 - 400 kHz
-
-            // 80 dummy clocks
-            for(idx = 0; idx != 10; idx++) SPI_RW(0xFF);
+            __SD_Diag(dev, SD_DIAG_ERROR, SD_DIAG_REJECT, resp, 0, 0, 0);
+            return(SD_REJECT);
         }
+#ifdef SD_IO_DBG_COUNT
+        dev->debug.write++;
+#endif
+    }
+    else SPI_RW(0xFF);  // One byte before the busy of the stop token
+    return(SD_OK);
+}
 
-        // 80 dummy clocks
-        for(idx = 0; idx != 10; idx++) SPI_RW(0xFF);
+SDRESULTS __SD_Write_Multi(SD_DEV *dev, BYTE *dat, LBA_t sector, DWORD count)
+{
+    SDRESULTS res, end;
+    if(count == 1) return(__SD_Write_Op(dev, dat, sector));
+    res = SD_Stream_Begin(dev, sector, count);
+    if(res!=SD_OK) return(res);
+    do {
+        res = __SD_Stream_Write_Op(dev, dat);
+        dat += SD_BLK_SIZE;
+    } while((res==SD_OK)&&(--count));
+    // Stop tran token, also after an error to leave the receive state
+    end = SD_Stream_End(dev);
+    return((res==SD_OK) ? end : res);
+}
 
-        // Software reset
-        /*
-           Send a CMD0 with CS low to reset the card.
-           The card samples CS signal on a CMD0 is received successfully.
-           If the CS signal is low, the card enters SPI mode and responds R1 with In Idle State bit set (0x01).
-           Since the CMD0 must be sent as a native command, the CRC field must have a valid value.
-           When once the card enters SPI mode, the CRC feature is disabled and the command CRC and data CRC are not checked by the card,
-           so that command transmission routine can be written with the hardcorded CRC value that valid for only CMD0 and CMD8 used in the initialization process.
-           The CRC feature can also be switched on/off with CMD59.
-         * */
+void __SD_Read_Status(SD_DEV *dev)
+{
+    // AU_SIZE[431:428] code to sectors
+    static const DWORD au_sectors[16] = {
+        0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+        16384, 24576, 32768, 49152, 65536, 131072
+    };
+    // SPEED_CLASS[447:440] code to class
+    static const BYTE speed_class[5] = { 0, 2, 4, 6, 10 };
+    BYTE sds[64];
+    WORD erase_size;
+    dev->au_size = 0;
+    dev->speed_class = 0;
+    if(!(dev->cardtype & SDCT_SDC)) return;
+    // R2 response, the second byte follows the R1
+    if(__SD_Send_Cmd(dev, ACMD13, 0)==0)
+    {
+        SPI_RW(0xFF);
+        if(__SD_Read_Data(dev, sds, 64)==SD_OK)
         {
-            SD_PRINTF("Sending CMD0...\n");
-            BYTE r1 = 0;
-            dev->mount = FALSE;
-            SPI_Timer_On(500);
-            // while (((r1 =__SD_Send_Cmd(CMD0, 0)) != 1)&&(SPI_Timer_Status()==TRUE));
-            while ((r1 != 1) && (SPI_Timer_Status()==TRUE))
+            dev->au_size = au_sectors[sds[10] >> 4];
+            if(sds[8] < 5) dev->speed_class = speed_class[sds[8]];
+            // DISCARD_SUPPORT[313]
+            dev->profile.discard = (sds[24] & 0x02) ? TRUE : FALSE;
+            // ERASE_SIZE[423:408] AUs take ERASE_TIMEOUT[407:402] seconds,
+            // plus ERASE_OFFSET[401:400] seconds
+            erase_size = ((WORD)sds[11] << 8) | sds[12];
+            if(erase_size && (sds[13] >> 2))
             {
-                r1 = __SD_Send_Cmd(CMD0, 0);
-                SD_PRINTF("r1= %d\n", r1);
-            }
-            SPI_Timer_Off();
-        }
-
-        // Idle state
-        if (__SD_Send_Cmd(CMD0, 0) == 1) {
-            // SD version 2?
-            if (__SD_Send_Cmd(CMD8, 0x1AA) == 1) {
-                SD_PRINTF("here1\n");
-                // Get trailing return value of R7 resp
-                for (n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
-
-                for (n = 0; n < 4; n++)
-                {
-                    SD_PRINTF("%X ",ocr[n]);
-                }
-                SD_PRINTF("\n");
-                // VDD range of 2.7-3.6V is OK?
-                if ((ocr[2] == 0x01)&&(ocr[3] == 0xAA))
-                {
-                    BYTE r2 = 0xFF;
-                    BYTE r3 = 0xFF;
-                    // Wait for leaving idle state (ACMD41 with HCS bit)...
-                    SD_PRINTF("__SD_Send_Cmd(41,1<<30)\n");
-                    SPI_Timer_On(1000);
-                    while (SPI_Timer_Status() == TRUE)
-                    {
-                        r2 = __SD_Send_Cmd(ACMD41, 1UL << 30);
-                        // r2 = __SD_Send_Cmd(CMD1, 0);
-                        SD_PRINTF("r2_here= %d\n",r2);
-                        if(r2 == 0)
-                            break;
-                    }
-                    SPI_Timer_Off();
-
-                    SPI_Timer_On(1000);
-                    while (SPI_Timer_Status() == TRUE)
-                    {
-                        r2 = __SD_Send_Cmd(ACMD41, 1UL << 30);
-                        SD_PRINTF("r2_here= %d\n",r2);
-                        if(r2 == 0)
-                            break;
-                    }
-                    SPI_Timer_Off();
-
-                    SD_PRINTF("r2 = %d\n", r2);
-                    // CCS in the OCR?
-                    r3 = __SD_Send_Cmd(CMD58, 0);
-                    SD_PRINTF("r3 = %d\n", r3);
-                    SD_PRINTF("Timer_status = %d\n", SPI_Timer_Status());
-                    if (r3 == 0)
-                    {
-                        SD_PRINTF("init ct\n");
-                        for (n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
-                        // SD version 2?
-                        ct = (ocr[0] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
-                    }
-                    SD_PRINTF("init ct failed\n");
-                    SD_PRINTF("r3 = %d\n", r2);
-                }
-            } else {
-                SD_PRINTF("here\n");
-                // SD version 1 or MMC?
-                if (__SD_Send_Cmd(ACMD41, 0) <= 1)
-                {
-                    // SD version 1
-                    ct = SDCT_SD1;
-                    cmd = ACMD41;
-                } else {
-                    // MMC version 3
-                    ct = SDCT_MMC;
-                    cmd = CMD1;
-                }
-                // Wait for leaving idle state
-                SPI_Timer_On(250);
-                while((SPI_Timer_Status()==TRUE)&&(__SD_Send_Cmd(cmd, 0)));
-                SPI_Timer_Off();
-                if(SPI_Timer_Status()==FALSE) ct = 0;
-                if(__SD_Send_Cmd(CMD59, 0))   ct = 0;   // Deactivate CRC check (default)
-                if(__SD_Send_Cmd(CMD16, 512)) ct = 0;   // Set R/W block length to 512 bytes
+                dev->profile.erase_au_ms = (WORD)((DWORD)(sds[13] >> 2) * 1000 / erase_size);
+                if(dev->profile.erase_au_ms == 0) dev->profile.erase_au_ms = 1;
+                dev->profile.erase_ofs_ms = (WORD)(sds[13] & 0x03) * 1000;
             }
-            SD_PRINTF("cmd 2 failed\n");
         }
-        SD_PRINTF("cmd 1 failed\n");
     }
+    SPI_Release();
+}
 
-    if(ct) {
-        dev->cardtype = ct;
-        dev->mount = TRUE;
-        dev->last_sector = __SD_Sectors(dev) - 1;
+SDRESULTS __SD_Check(SD_DEV *dev)
+{
+    BYTE r1, r2;
+    r1 = __SD_Send_Cmd(dev, CMD13, 0);
+    r2 = SPI_RW(0xFF);
+    __SD_Release(dev);
+    dev->status = ((WORD)r1 << 8) | r2;
+    if(r1 & 0x80) return(SD_NORESPONSE);
+    // Back in idle state, the card lost the initialization
+    if(r1 & 0x01) return(SD_NOINIT);
+    if(r1 || r2) return(SD_ERROR);
+    return(SD_OK);
+}
+
+void __SD_Resync(SD_DEV *dev)
+{
+    BYTE idx;
+    // The busy is only seen with the card selected
+    __SD_Assert();
+    __SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT);
+    __SD_Deassert();
+    for(idx = 0; idx != 10; idx++) SPI_RW(0xFF);
+    if(dev->session)
+    {
+        __SD_Assert();
+        SPI_RW(0xFF);
+    }
+}
 
-        UINT r3;
-        r3 = __SD_Send_Cmd(CMD58, 0);
+DWORD __SD_Addr (SD_DEV *dev, LBA_t sector)
+{
+    if(dev->cardtype & SDCT_BLOCK) return((DWORD)sector);
+    return((DWORD)sector * SD_BLK_SIZE);
+}
 
-        if (r3 == 0) {
-            for (n = 0; n < 4; n++) {
-                ocr[n] = SPI_RW(0xFF);
-                printf("OCR[%d] = 0x%02X\n", n, ocr[n]);
-            }
-        }
-        printf("last_sector= %d\n",dev->last_sector);
-#ifdef SD_IO_DBG_COUNT
-        dev->debug.read = 0;
-        dev->debug.write = 0;
-#endif
-        __SD_Speed_Transfer(HIGH); // High speed transfer
+LBA_t __SD_Read_CSD (SD_DEV *dev)
+{
+    // TAAC and TRAN_SPEED time value, in tenths
+    static const BYTE time_value[16] = {
+        0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+    };
+    SD_PROFILE *p = &dev->profile;
+    BYTE csd[16];
+    BYTE idx;
+    DWORD C_SIZE, access_us;
+    BYTE C_SIZE_MULT;
+    BYTE READ_BL_LEN;
+    if((__SD_Send_Cmd(dev, CMD9, 0)!=0)||(__SD_Read_Data(dev, csd, 16)!=SD_OK))
+    {
+        SPI_Release();
+        return (0); // Error
     }
+    __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_CSD, __SD_BE32(csd), __SD_BE32(csd + 4),
+             __SD_BE32(csd + 8), __SD_BE32(csd + 12));
     SPI_Release();
-    return (ct ? SD_OK : SD_NOINIT);
-#endif
+    // CSD_STRUCTURE[127:126]
+    p->csd_ver = (csd[0] >> 6) + 1;
+    // TAAC[119:112]: unit of 1ns * 10^n and time value
+    p->taac_ns = time_value[(csd[1] >> 3) & 0x0F];
+    for(idx = 0; idx != (csd[1] & 0x07); idx++) p->taac_ns *= 10;
+    p->taac_ns /= 10;
+    // NSAC[111:104]
+    p->nsac = csd[2];
+    // TRAN_SPEED[103:96]: unit of 100kbit/s * 10^n and time value
+    p->tran_khz = (DWORD)time_value[(csd[3] >> 3) & 0x0F] * 10;
+    for(idx = 0; idx != (csd[3] & 0x07); idx++) p->tran_khz *= 10;
+    // CCC[95:84]
+    p->ccc = ((WORD)csd[4] << 4) | (csd[5] >> 4);
+    // ERASE_BLK_EN[46], SECTOR_SIZE[45:39]
+    p->erase_blk_en = (csd[10] & 0x40) ? TRUE : FALSE;
+    p->sector_size = (((csd[10] & 0x3F) << 1) | (csd[11] >> 7)) + 1;
+    // R2W_FACTOR[28:26]
+    p->r2w_factor = 1 << ((csd[12] >> 2) & 0x07);
+    // PERM_WRITE_PROTECT[13], TMP_WRITE_PROTECT[12]
+    p->wp = (csd[14] & 0x30) ? TRUE : FALSE;
+    // The read timeout is 100 times the access time (TAAC + NSAC clocks),
+    // the write one R2W_FACTOR times more. One more ms for the timer
+    // granularity. CSD 2.0 fixed values give the 100/250 ms of SDHC.
+    access_us = p->taac_ns / 1000 + ((DWORD)p->nsac * 100 * 1000) / SD_IO_SPI_KHZ;
+    access_us = (access_us * 100) / 1000 + 1;
+    p->read_ms = (access_us > SD_IO_READ_TIMEOUT_WAIT) ?
+                 SD_IO_READ_TIMEOUT_WAIT : (WORD)access_us;
+    access_us *= p->r2w_factor;
+    p->write_ms = (access_us > SD_IO_WRITE_TIMEOUT_WAIT) ?
+                  SD_IO_WRITE_TIMEOUT_WAIT : (WORD)access_us;
+    if(p->csd_ver == 2)
+    {
+        // CSD version 2.0 (SDHC/SDXC): C_SIZE [69:48] in units of 512KB
+        C_SIZE = ((DWORD)(csd[7] & 0x3F) << 16) |
+                 ((DWORD)csd[8] << 8) |
+                 (DWORD)csd[9];
+        return (((LBA_t)C_SIZE + 1) * 1024);
+    }
+    // CSD version 1.0 (SDSC and MMC)
+    // READ_BL_LEN[83:80]: max. read data block length
+    READ_BL_LEN = (csd[5] & 0x0F);
+    // C_SIZE [73:62]
+    C_SIZE = ((DWORD)(csd[6] & 0x03) << 10) |
+             ((DWORD)csd[7] << 2) |
+             ((csd[8] >> 6) & 0x03);
+    // C_SIZE_MULT [49:47]
+    C_SIZE_MULT = ((csd[9] & 0x03) << 1) | ((csd[10] >> 7) & 0x01);
+    // (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) blocks of 2^READ_BL_LEN bytes
+    if(READ_BL_LEN < 9) return (0);
+    return ((LBA_t)(C_SIZE + 1) << (C_SIZE_MULT + 2 + READ_BL_LEN - 9));
 }
 
-SDRESULTS SD_Read(SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt)
+void __SD_Read_CID(SD_DEV *dev)
 {
-#if defined(_M_IX86)    // x86
-    // Check the sector query
-    if((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
-    if(dev->fp!=NULL)
+    SD_PROFILE *p = &dev->profile;
+    BYTE cid[16];
+    // The MMC CID has other layout
+    if(!(dev->cardtype & SDCT_SDC)) return;
+    if((__SD_Send_Cmd(dev, CMD10, 0)==0)&&(__SD_Read_Data(dev, cid, 16)==SD_OK))
     {
-        if (fseek(dev->fp, ((512 * sector) + ofs), SEEK_SET)!=0)
-            return(SD_ERROR);
-        else {
-            if(fread(dat, 1, (cnt - ofs),dev->fp)==(cnt - ofs))
-            {
-#ifdef SD_IO_DBG_COUNT
-                dev->debug.read++;
-#endif
-                return(SD_OK);
-            }
-            else return(SD_ERROR);
-        }
-    } else {
-        return(SD_ERROR);
-    }
-#else   // uControllers
-    SDRESULTS res;
-    BYTE tkn;
-    WORD remaining;
-    res = SD_ERROR;
-    if ((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
-    // Convert sector number to byte address (sector * SD_BLK_SIZE)
-    if (__SD_Send_Cmd(CMD17, sector * SD_BLK_SIZE) == 0) {
-        SPI_Timer_On(100);  // Wait for data packet (timeout of 100ms)
-        do {
-            tkn = SPI_RW(0xFF);
-        } while((tkn==0xFF)&&(SPI_Timer_Status()==TRUE));
-        SPI_Timer_Off();
-        // Token of single block?
-        if(tkn==0xFE) {
-            // Size block (512 bytes) + CRC (2 bytes) - offset - bytes to count
-            remaining = SD_BLK_SIZE + 2 - ofs - cnt;
-            // Skip offset
-            if(ofs) {
-                do {
-                    SPI_RW(0xFF);
-                } while(--ofs);
-            }
-            // I receive the data and I write in user's buffer
-            do {
-                *(BYTE*)dat = SPI_RW(0xFF);
-                dat++;
-            } while(--cnt);
-            // Skip remaining
-            do {
-                SPI_RW(0xFF);
-            } while (--remaining);
-            res = SD_OK;
-        }
+        // MID[127:120], OID[119:104], PNM[103:64], PRV[63:56]
+        p->mid = cid[0];
+        memcpy(p->oid, &cid[1], 2);
+        p->oid[2] = 0;
+        memcpy(p->pnm, &cid[3], 5);
+        p->pnm[5] = 0;
+        p->prv = cid[8];
+        // PSN[55:24], MDT[19:8]
+        p->psn = ((DWORD)cid[9] << 24) | ((DWORD)cid[10] << 16) |
+                 ((DWORD)cid[11] << 8) | cid[12];
+        p->year = 2000 + (((cid[13] & 0x0F) << 4) | (cid[14] >> 4));
+        p->month = cid[14] & 0x0F;
     }
     SPI_Release();
-#ifdef SD_IO_DBG_COUNT
-    dev->debug.read++;
-#endif
-    return(res);
-#endif
 }
 
-#ifdef SD_IO_WRITE
-SDRESULTS SD_Write(SD_DEV *dev, void *dat, DWORD sector)
+void __SD_Read_SCR(SD_DEV *dev)
 {
-#if defined(_M_IX86)    // x86
-    // Query ok?
-    if(sector > dev->last_sector) return(SD_PARERR);
-    if(dev->fp != NULL)
+    SD_PROFILE *p = &dev->profile;
+    BYTE scr[8];
+    dev->erase_zero = FALSE;
+    if(!(dev->cardtype & SDCT_SDC)) return;
+    if((__SD_Send_Cmd(dev, ACMD51, 0)==0)&&(__SD_Read_Data(dev, scr, 8)==SD_OK))
     {
-        if(fseek(dev->fp, SD_BLK_SIZE * sector, SEEK_SET)!=0)
-            return(SD_ERROR);
-        else {
-            if(fwrite(dat, 1, SD_BLK_SIZE, dev->fp)==SD_BLK_SIZE)
-            {
-#ifdef SD_IO_DBG_COUNT
-                dev->debug.write++;
+        // SD_SPEC[59:56], SD_SPEC3[47], SD_SPEC4[42], SD_SPECX[41:38]
+        p->sd_spec = scr[0] & 0x0F;
+        if(scr[2] & 0x80) p->sd_spec = 3;
+        if(scr[2] & 0x04) p->sd_spec = 4;
+        if(((scr[2] & 0x03) << 2) | (scr[3] >> 6))
+            p->sd_spec = 4 + (((scr[2] & 0x03) << 2) | (scr[3] >> 6));
+        // DATA_STAT_AFTER_ERASE[55], SD_BUS_WIDTHS[51:48], CMD_SUPPORT[35:32]
+        dev->erase_zero = (scr[1] & 0x80) ? FALSE : TRUE;
+        p->bus_widths = scr[1] & 0x0F;
+        p->cmd_support = scr[3] & 0x0F;
+    }
+    SPI_Release();
+    // Erasing can't stand for writing zeros without the erase class
+    if(!(p->ccc & SD_CCC_ERASE)) dev->erase_zero = FALSE;
+}
+#endif // Private methods for uC
+
+/******************************************************************************
+ Private Methods - Calibration (SD_Tune)
+******************************************************************************/
+
+/**
+    \brief Write consecutive sectors in the bursts of dev->tune, in a single
+           one if the card isn't tuned.
+ */
+SDRESULTS __SD_Write_Bursts(SD_DEV *dev, BYTE *dat, LBA_t sector, DWORD count);
+
+#ifdef SD_IO_TUNE
+#if !defined(_M_IX86) && !defined(SD_IO_CLOCK)
+#error "SD_IO_TUNE needs SD_IO_CLOCK"
 #endif
-                return(SD_OK);
-            }
-            else return(SD_ERROR);
-        }
-    } else return(SD_ERROR);
-#else   // uControllers
-    // Query ok?
-    if(sector > dev->last_sector) return(SD_PARERR);
-    // Single block write (token <- 0xFE)
-    // Convert sector number to bytes address (sector * SD_BLK_SIZE)
-    if(__SD_Send_Cmd(CMD24, sector * SD_BLK_SIZE)==0)
-        return(__SD_Write_Block(dev, dat, 0xFE));
-    else
-        return(SD_ERROR);
+
+/**
+    \brief Check that the parameters are of the card in the device (CID).
+ */
+BOOL __SD_Tune_Same(SD_DEV *dev, const SD_TUNE *tune);
+
+/**
+    \brief After an init: keep dev->tune and set its clock if it's of the
+           card, else clear it.
+ */
+void __SD_Tune_Check(SD_DEV *dev);
+
+#if !defined(_M_IX86)
+/**
+    \brief Set the clock tuned for the card, SPI_Freq_High if none.
+ */
+void __SD_Tune_Apply(SD_DEV *dev);
 #endif
-}
+
+/**
+    \brief Fill the work buffer with a pattern of its sectors, or check it.
+    \param seed Changes the pattern from a transfer to the next.
+    \return FALSE if check and the buffer doesn't hold the pattern.
+ */
+BOOL __SD_Tune_Data(BYTE *work, LBA_t sector, DWORD seed, BOOL check);
+
+/**
+    \brief Throughput of a transfer.
+    \return KB/s.
+ */
+DWORD __SD_Tune_Kbs(DWORD sectors, DWORD us);
+
+/**
+    \brief Time SD_IO_TUNE_REPS writes and reads of the work buffer at the
+           clock set, and check the data.
+    \param read_kbs Throughput of the reads.
+    \return Throughput of the writes and reads, zero if an error or a
+            mismatch.
+ */
+DWORD __SD_Tune_Clock(SD_DEV *dev, BYTE *work, LBA_t base, DWORD seed, DWORD *read_kbs);
+
+/**
+    \brief Time SD_IO_TUNE_REPS multiple block writes of count sectors, the
+           first sector of the work buffer again and again.
+    \param step Sectors from the start of a write to the next one.
+    \return Throughput, zero on error.
+ */
+DWORD __SD_Tune_Writes(SD_DEV *dev, BYTE *work, LBA_t start, DWORD step, DWORD count);
+
+/**
+    \brief Checksum of a stored record: the sum of its first 9 words.
+ */
+DWORD __SD_Tune_Sum(const BYTE *rec);
 #endif
 
-SDRESULTS SD_Status(SD_DEV *dev)
+SDRESULTS __SD_Write_Bursts(SD_DEV *dev, BYTE *dat, LBA_t sector, DWORD count)
 {
-#if defined(_M_IX86)
-    return((dev->fp == NULL) ? SD_OK : SD_NORESPONSE);
+#ifdef SD_IO_TUNE
+    SDRESULTS res = SD_OK;
+    DWORD n;
+    WORD burst = dev->tune.burst, align = dev->tune.align;
+    if((burst == 0)&&(align <= 1)) return(__SD_Write_Multi(dev, dat, sector, count));
+    while(count&&(res==SD_OK))
+    {
+        // Up to the next alignment, then whole bursts
+        if((align > 1)&&(sector % align)) n = align - (DWORD)(sector % align);
+        else n = burst ? burst : count;
+        if(burst&&(n > burst)) n = burst;
+        if(n > count) n = count;
+        res = __SD_Write_Multi(dev, dat, sector, n);
+        dat += n * SD_BLK_SIZE;
+        sector += n;
+        count -= n;
+    }
+    return(res);
 #else
-    return(__SD_Send_Cmd(CMD0, 0) ? SD_OK : SD_NORESPONSE);
+    return(__SD_Write_Multi(dev, dat, sector, count));
 #endif
 }
 
+#ifdef SD_IO_TUNE
+BOOL __SD_Tune_Same(SD_DEV *dev, const SD_TUNE *tune)
+{
+    return(((tune->mid == dev->profile.mid)&&(tune->psn == dev->profile.psn)&&
+            (memcmp(tune->pnm, dev->profile.pnm, sizeof(tune->pnm)) == 0)) ? TRUE : FALSE);
+}
+
+void __SD_Tune_Check(SD_DEV *dev)
+{
+    if(__SD_Tune_Same(dev, &dev->tune) == FALSE)
+        memset(&dev->tune, 0, sizeof(SD_TUNE));
+#if !defined(_M_IX86)
+    __SD_Tune_Apply(dev);
+#endif
+}
+
+#if !defined(_M_IX86)
+void __SD_Tune_Apply(SD_DEV *dev)
+{
+    // Zero is the clock of the card without tuning
+    if(dev->tune.khz) SPI_Freq_Khz(dev->tune.khz);
+    else SPI_Freq_High();
+#ifdef SD_IO_SLOTS
+    sd_bus_clock = dev;
+#endif
+}
+#endif
+
+BOOL __SD_Tune_Data(BYTE *work, LBA_t sector, DWORD seed, BOOL check)
+{
+    DWORD idx;
+    BYTE v;
+    for(idx = 0; idx != SD_TUNE_WORK * SD_BLK_SIZE; idx++)
+    {
+        // Never a zero byte, for SD_IO_ZERO_ELIDE
+        v = (BYTE)(((DWORD)sector + idx / SD_BLK_SIZE) * 31 + idx * 7 + seed) | 0x01;
+        if(check == FALSE) work[idx] = v;
+        else if(work[idx] != v) return(FALSE);
+    }
+    return(TRUE);
+}
+
+DWORD __SD_Tune_Kbs(DWORD sectors, DWORD us)
+{
+    // sectors * 512 bytes / 1024 in us / 1000000
+    return((DWORD)((QWORD)sectors * 500000UL / (us ? us : 1)));
+}
+
+DWORD __SD_Tune_Clock(SD_DEV *dev, BYTE *work, LBA_t base, DWORD seed, DWORD *read_kbs)
+{
+    SD_IOVEC seg;
+    DWORD rep, t0, wr_us = 0, rd_us = 0;
+    seg.buf = work;
+    seg.len = SD_TUNE_WORK * SD_BLK_SIZE;
+    for(rep = 0; rep != SD_IO_TUNE_REPS; rep++)
+    {
+        __SD_Tune_Data(work, base, seed + rep, FALSE);
+        t0 = SD_Time_Us();
+        if(SD_Write_Blocks(dev, work, base, SD_TUNE_WORK) != SD_OK) return(0);
+        wr_us += SD_Time_Us() - t0;
+        memset(work, 0, SD_TUNE_WORK * SD_BLK_SIZE);
+        t0 = SD_Time_Us();
+        if(SD_ReadV(dev, &seg, 1, base) != SD_OK) return(0);
+        rd_us += SD_Time_Us() - t0;
+        // A clock too fast for the card or the board garbles the data
+        if(__SD_Tune_Data(work, base, seed + rep, TRUE) == FALSE) return(0);
+    }
+    *read_kbs = __SD_Tune_Kbs(SD_IO_TUNE_REPS * SD_TUNE_WORK, rd_us);
+    return(__SD_Tune_Kbs(2 * SD_IO_TUNE_REPS * SD_TUNE_WORK, wr_us + rd_us));
+}
+
+DWORD __SD_Tune_Writes(SD_DEV *dev, BYTE *work, LBA_t start, DWORD step, DWORD count)
+{
+    SDRESULTS res = SD_OK;
+    DWORD rep, idx, t0 = SD_Time_Us();
+    for(rep = 0; (rep != SD_IO_TUNE_REPS)&&(res==SD_OK); rep++, start += step)
+    {
+        if(count == 1)
+        {
+            res = SD_Write(dev, work, start);
+            continue;
+        }
+        res = SD_Stream_Begin(dev, start, count);
+        for(idx = 0; (idx != count)&&(res==SD_OK); idx++) res = SD_Stream_Write(dev, work);
+        if(SD_Stream_End(dev) != SD_OK) res = SD_ERROR;
+    }
+    if(res != SD_OK) return(0);
+    return(__SD_Tune_Kbs(SD_IO_TUNE_REPS * count, SD_Time_Us() - t0));
+}
+
+DWORD __SD_Tune_Sum(const BYTE *rec)
+{
+    DWORD sum = 0;
+    BYTE idx;
+    for(idx = 0; idx != 36; idx += 4) sum += SD_Get32(rec + idx);
+    return(sum);
+}
+#endif
+
+#ifdef SD_IO_ZERO_ELIDE
+/******************************************************************************
+ Private Methods - Common to both targets
+******************************************************************************/
+
+/**
+    \brief Check if a block is filled with zeros.
+    \param dat Block of SD_BLK_SIZE bytes.
+    \return TRUE if all bytes are zero.
+ */
+BOOL __SD_Is_Zero(const void *dat);
+
+/**
+    \brief Write the pending sectors [start, end) of SD_Write_Blocks, erasing
+           the zcnt sectors at the end instead of write them.
+    \param dat Data of SD_Write_Blocks.
+    \param sector First sector of SD_Write_Blocks.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Write_Elide(SD_DEV *dev, void *dat, LBA_t sector,
+                           DWORD start, DWORD end, DWORD zcnt);
+
+BOOL __SD_Is_Zero(const void *dat)
+{
+#if defined(__SSE2__)
+    // Four 16-byte lanes each step, stop on the first lane with data
+    const __m128i *lane = (const __m128i*)dat;
+    __m128i acc;
+    WORD idx;
+    for(idx=0; idx!=SD_BLK_SIZE/16; idx+=4)
+    {
+        acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(lane + idx),
+                                        _mm_loadu_si128(lane + idx + 1)),
+                           _mm_or_si128(_mm_loadu_si128(lane + idx + 2),
+                                        _mm_loadu_si128(lane + idx + 3)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128()))!=0xFFFF)
+            return(FALSE);
+    }
+    return(TRUE);
+#else
+    const BYTE *ptr = (const BYTE*)dat;
+    WORD idx;
+    for(idx=0; idx!=SD_BLK_SIZE; idx++) if(ptr[idx]) return(FALSE);
+    return(TRUE);
+#endif
+}
+
+SDRESULTS __SD_Write_Elide(SD_DEV *dev, void *dat, LBA_t sector,
+                           DWORD start, DWORD end, DWORD zcnt)
+{
+    SDRESULTS res = SD_OK;
+    if(end - zcnt > start)
+        res = __SD_Write_Bursts(dev, (BYTE*)dat + start * SD_BLK_SIZE,
+                                sector + start, end - zcnt - start);
+    if((res==SD_OK)&&zcnt)
+        res = __SD_Erase_Op(dev, sector + end - zcnt, sector + end - 1);
+    return(res);
+}
+#endif
+
+/******************************************************************************
+ Private Methods - Trace ring
+******************************************************************************/
+
+#ifdef SD_IO_TRACE
+/**
+    \brief Start of an operation.
+    \return Its time, zero if the device isn't traced.
+ */
+DWORD __SD_Trace_Begin(SD_DEV *dev);
+
+/**
+    \brief Record an operation in the ring of the device.
+    \param t0 Time of __SD_Trace_Begin.
+    \return The result of the operation.
+ */
+SDRESULTS __SD_Trace(SD_DEV *dev, BYTE op, LBA_t sector, DWORD len, WORD ofs,
+                     DWORD t0, SDRESULTS res);
+
+DWORD __SD_Trace_Begin(SD_DEV *dev)
+{
+    return((dev->trace != NULL) ? SD_Time_Us() : 0);
+}
+
+SDRESULTS __SD_Trace(SD_DEV *dev, BYTE op, LBA_t sector, DWORD len, WORD ofs,
+                     DWORD t0, SDRESULTS res)
+{
+    SD_TRACE_REC *r;
+    if(dev->trace == NULL) return(res);
+    r = &dev->trace->rec[dev->trace->count++ & (SD_IO_TRACE_SIZE - 1)];
+    r->t_us = t0;
+    r->lat_us = SD_Time_Us() - t0;
+    r->sector = sector;
+    r->len = len;
+    r->ofs = ofs;
+    r->op = op;
+    r->res = (BYTE)res;
+    return(res);
+}
+#endif
+
+/******************************************************************************
+ Private Methods - Resumable operations (SD_Poll)
+******************************************************************************/
+
+/* Steps of SD_POLL.state */
+#define SDP_IDLE            0
+#define SDP_INIT_POWER      1   /* Dummy clocks of an init attempt          */
+#define SDP_INIT_RESET      2   /* CMD0 until the idle state                */
+#define SDP_INIT_COND       3   /* CMD8, version of the card                */
+#define SDP_INIT_HCS        4   /* ACMD41 with HCS until ready, CCS (SD2)   */
+#define SDP_INIT_OP         5   /* ACMD41 or CMD1 until ready (SD1, MMC)    */
+#define SDP_INIT_CSD        6
+#define SDP_INIT_CID        7
+#define SDP_INIT_SCR        8
+#define SDP_INIT_STATUS     9   /* SD Status, then the end of the init      */
+#define SDP_READ_CMD        10
+#define SDP_READ_TOKEN      11
+#define SDP_READ_DATA       12
+#define SDP_WRITE_CMD       13
+#define SDP_WRITE_DATA      14
+#define SDP_WRITE_BUSY      15
+#define SDP_READY           16  /* Busy after the stop of a transfer        */
+
+#if !defined(_M_IX86)   // uControllers
+/**
+    \brief Prepare an operation from its first step.
+    \param cmd Read/write command (CMD17, CMD18, CMD24 or CMD25), 0 for the
+           init.
+ */
+void __SD_Poll_Begin(SD_DEV *dev, BYTE state, BYTE cmd, void *dat, LBA_t sector, DWORD count);
+
+/**
+    \brief Prepare SD_Init: worst case timeouts until the CSD tells the ones
+           of the card.
+ */
+void __SD_Poll_Init(SD_DEV *dev);
+
+/**
+    \brief Run one step of the operation.
+    \return SD_PENDING until the last step, then the result.
+ */
+SDRESULTS __SD_Poll_Step(SD_DEV *dev);
+
+/**
+    \brief Run the operation to the end (blocking methods).
+ */
+SDRESULTS __SD_Poll_Run(SD_DEV *dev);
+
+/**
+    \brief Stop a multiple block transfer (CMD12 or stop tran token) and wait
+           for the busy in the next steps, or end a single one.
+    \param res Result of the operation.
+ */
+SDRESULTS __SD_Poll_Stop(SD_DEV *dev, SDRESULTS res);
+
+/**
+    \brief End of the operation: release the bus and keep the result.
+ */
+SDRESULTS __SD_Poll_End(SD_DEV *dev, SDRESULTS res);
+
+/**
+    \brief Clock up to SD_IO_POLL_BYTES bytes while the line stays idle.
+    \param idle 0xFF waiting for a token, 0x00 for the end of a busy.
+    \return The first byte that isn't idle, idle if none.
+ */
+BYTE __SD_Poll_Wait(BYTE idle);
+
+/**
+    \brief Start the timeout of a wait of the operation.
+    \param ms Timeout in milliseconds.
+ */
+void __SD_Poll_Timer_On(SD_DEV *dev, WORD ms);
+
+/**
+    \brief Check the timeout of the wait.
+    \return TRUE if the timeout is not reached yet.
+ */
+BOOL __SD_Poll_Timer_Status(SD_DEV *dev);
+
+/**
+    \brief End of the wait.
+ */
+void __SD_Poll_Timer_Off(SD_DEV *dev);
+
+void __SD_Poll_Begin(SD_DEV *dev, BYTE state, BYTE cmd, void *dat, LBA_t sector, DWORD count)
+{
+    SD_POLL *p = &dev->poll;
+    p->state = state;
+    p->cmd = cmd;
+    p->dat = (BYTE*)dat;
+    p->sector = sector;
+    p->count = count;
+    p->left = count;
+    p->ofs = 0;
+    p->cnt = SD_BLK_SIZE;
+    p->tries = 0;
+    p->ct = 0;
+#ifdef SD_IO_TRACE
+    p->op = 0;
+#endif
+}
+
+#if defined(SD_IO_SLOTS) && defined(SD_IO_TUNE)
+void __SD_Route_Clock(SD_DEV *dev)
+{
+    if((sd_bus_clock == dev)||(dev->mount == FALSE)) return;
+    // The init sets its own clocks, and checks the tuning at its end
+    if((dev->poll.state >= SDP_INIT_POWER)&&(dev->poll.state <= SDP_INIT_STATUS)) return;
+    __SD_Tune_Apply(dev);
+}
+#endif
+
+void __SD_Poll_Init(SD_DEV *dev)
+{
+    dev->session = FALSE;
+    memset(&dev->profile, 0, sizeof(SD_PROFILE));
+    dev->profile.read_ms = SD_IO_READ_TIMEOUT_WAIT;
+    dev->profile.write_ms = SD_IO_WRITE_TIMEOUT_WAIT;
+    __SD_Poll_Begin(dev, SDP_INIT_POWER, 0, NULL, 0, 0);
+    dev->poll.start = SD_Time_Us();
+    dev->poll.due = dev->poll.start;
+}
+
+SDRESULTS __SD_Poll_Run(SD_DEV *dev)
+{
+    SDRESULTS res;
+    do {
+        res = __SD_Poll_Step(dev);
+    } while(res==SD_PENDING);
+    return(res);
+}
+
+BYTE __SD_Poll_Wait(BYTE idle)
+{
+    BYTE line, n = SD_IO_POLL_BYTES;
+    do {
+        line = SPI_RW(0xFF);
+    } while((line==idle)&&(--n));
+    return(line);
+}
+
+void __SD_Poll_Timer_On(SD_DEV *dev, WORD ms)
+{
+#ifdef SD_IO_CLOCK
+    // A deadline of each device, the waits of several cards overlap
+    dev->poll.until = SD_Time_Us() + (DWORD)ms * 1000;
+#else
+    (void)dev;
+    SPI_Timer_On(ms);
+#endif
+}
+
+BOOL __SD_Poll_Timer_Status(SD_DEV *dev)
+{
+#ifdef SD_IO_CLOCK
+    return(((LONG)(SD_Time_Us() - dev->poll.until) < 0) ? TRUE : FALSE);
+#else
+    (void)dev;
+    return(SPI_Timer_Status());
+#endif
+}
+
+void __SD_Poll_Timer_Off(SD_DEV *dev)
+{
+    (void)dev;
+#ifndef SD_IO_CLOCK
+    SPI_Timer_Off();
+#endif
+}
+
+SDRESULTS __SD_Poll_Stop(SD_DEV *dev, SDRESULTS res)
+{
+    SD_POLL *p = &dev->poll;
+    p->res = (BYTE)res;
+    if(p->cmd == CMD18)
+    {
+        __SD_Send_Cmd(dev, CMD12, 0);
+        __SD_Poll_Timer_On(dev, dev->profile.read_ms);
+    }
+    else if(p->cmd == CMD25)
+    {
+        // Stop tran token, one byte before the busy
+        SPI_RW(0xFD);
+        SPI_RW(0xFF);
+        __SD_Poll_Timer_On(dev, dev->profile.write_ms);
+    }
+    else return(__SD_Poll_End(dev, res));
+    p->state = SDP_READY;
+    return(SD_PENDING);
+}
+
+SDRESULTS __SD_Poll_End(SD_DEV *dev, SDRESULTS res)
+{
+    SD_POLL *p = &dev->poll;
+    if((p->state >= SDP_INIT_POWER)&&(p->state <= SDP_INIT_STATUS))
+    {
+        dev->init_us = SD_Time_Us() - p->start;
+        __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_INIT, res, dev->init_us, 0, 0);
+#ifdef SD_IO_TUNE
+        // Every init, polled or not: drop the tuning of a swapped card
+        if(res == SD_OK) __SD_Tune_Check(dev);
+#endif
+    }
+    p->state = SDP_IDLE;
+    p->res = (BYTE)res;
+    __SD_Release(dev);
+#ifdef SD_IO_TRACE
+    if(p->op) __SD_Trace(dev, p->op, p->sector, p->count, 0, p->t0, res);
+#endif
+    return(res);
+}
+
+SDRESULTS __SD_Poll_Step(SD_DEV *dev)
+{
+    SD_POLL *p = &dev->poll;
+    BYTE n, r1, line, ocr[4];
+    WORD cnt, rest;
+    SD_IOVEC seg;
+    SD_IOPOS pos;
+    __SD_Route(dev);
+    switch(p->state)
+    {
+    case SDP_INIT_POWER:
+        if(p->tries == SD_INIT_TRYS) return(__SD_Poll_End(dev, SD_NOINIT));
+        p->tries++;
+        p->ct = 0;
+        __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_ATTEMPT, p->tries, 0, 0, 0);
+        // Initialize SPI for use with the memory card
+        SPI_Init();
+        /*
+         * Power ON or card insersion
+           After supply voltage reached above 2.2 volts, wait for one millisecond at least.
+           Set SPI clock rate between 100 kHz and 400 kHz. Set DI and CS high and apply 74 or more clock pulses to SCLK.
+           The card will enter its native operating mode and go ready to accept native command.
+         * */
+        SPI_CS_High();  //CS high
+        __SD_Speed_Transfer(LOW); // set spi to between 100 - 400 kHz
+        // 160 dummy clocks
+        for(n = 0; n != 20; n++) SPI_RW(0xFF);
+        dev->mount = FALSE;
+        __SD_Poll_Timer_On(dev, 500);
+        p->state = SDP_INIT_RESET;
+        break;
+    case SDP_INIT_RESET:
+        /*
+           Send a CMD0 with CS low to reset the card.
+           The card samples CS signal on a CMD0 is received successfully.
+           If the CS signal is low, the card enters SPI mode and responds R1 with In Idle State bit set (0x01).
+           Since the CMD0 must be sent as a native command, the CRC field must have a valid value.
+           When once the card enters SPI mode, the CRC feature is disabled and the command CRC and data CRC are not checked by the card,
+           so that command transmission routine can be written with the hardcorded CRC value that valid for only CMD0 and CMD8 used in the initialization process.
+           The CRC feature can also be switched on/off with CMD59.
+         * */
+        r1 = __SD_Send_Cmd(dev, CMD0, 0);
+        if((r1 != 1)&&(__SD_Poll_Timer_Status(dev)==TRUE))
+        {
+            // Next poll of this card, SD_Init_Multi serves the others
+            p->due = SD_Time_Us() + SD_IO_INIT_POLL_US;
+            break;
+        }
+        __SD_Poll_Timer_Off(dev);
+        p->state = SDP_INIT_COND;
+        break;
+    case SDP_INIT_COND:
+        // Next attempt unless the card goes on
+        p->state = SDP_INIT_POWER;
+        // Idle state
+        if(__SD_Send_Cmd(dev, CMD0, 0) != 1) break;
+        // SD version 2?
+        if(__SD_Send_Cmd(dev, CMD8, 0x1AA) == 1)
+        {
+            // Get trailing return value of R7 resp
+            for(n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
+            // VDD range of 2.7-3.6V is OK?
+            if((ocr[2] == 0x01)&&(ocr[3] == 0xAA))
+            {
+                // Wait for leaving idle state (ACMD41 with HCS bit)...
+                __SD_Poll_Timer_On(dev, 1000);
+                p->state = SDP_INIT_HCS;
+            }
+        } else {
+            // SD version 1 or MMC?
+            if(__SD_Send_Cmd(dev, ACMD41, 0) <= 1)
+            {
+                // SD version 1
+                p->ct = SDCT_SD1;
+                p->cmd = ACMD41;
+            } else {
+                // MMC version 3
+                p->ct = SDCT_MMC;
+                p->cmd = CMD1;
+            }
+            // Wait for leaving idle state
+            __SD_Poll_Timer_On(dev, 250);
+            p->state = SDP_INIT_OP;
+        }
+        break;
+    case SDP_INIT_HCS:
+        r1 = __SD_Send_Cmd(dev, ACMD41, 1UL << 30);
+        if((r1 != 0)&&(__SD_Poll_Timer_Status(dev)==TRUE))
+        {
+            p->due = SD_Time_Us() + SD_IO_INIT_POLL_US;
+            break;
+        }
+        __SD_Poll_Timer_Off(dev);
+        p->state = SDP_INIT_POWER;
+        // CCS in the OCR?
+        if(__SD_Send_Cmd(dev, CMD58, 0) == 0)
+        {
+            for(n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
+            // SD version 2?
+            p->ct = (ocr[0] & 0x40) ? SDCT_SD2 | SDCT_BLOCK : SDCT_SD2;
+            p->state = SDP_INIT_CSD;
+        }
+        break;
+    case SDP_INIT_OP:
+        r1 = __SD_Send_Cmd(dev, p->cmd, 0);
+        if((r1 != 0)&&(__SD_Poll_Timer_Status(dev)==TRUE))
+        {
+            p->due = SD_Time_Us() + SD_IO_INIT_POLL_US;
+            break;
+        }
+        __SD_Poll_Timer_Off(dev);
+        if(__SD_Send_Cmd(dev, CMD59, 0))   r1 = 1;   // Deactivate CRC check (default)
+        if(__SD_Send_Cmd(dev, CMD16, 512)) r1 = 1;   // Set R/W block length to 512 bytes
+        p->state = (r1 == 0) ? SDP_INIT_CSD : SDP_INIT_POWER;
+        break;
+    case SDP_INIT_CSD:
+        dev->cardtype = p->ct;
+        dev->mount = TRUE;
+        dev->stream = FALSE;
+        dev->last_sector = __SD_Read_CSD(dev) - 1;
+        p->state = SDP_INIT_CID;
+        break;
+    case SDP_INIT_CID:
+        __SD_Read_CID(dev);
+#if defined(SD_IO_DIAG) && (SD_IO_DIAG_LEVEL >= SD_DIAG_INFO)
+        // OCR of the mounted card, only for the diagnostics
+        memset(ocr, 0, sizeof(ocr));
+        if(__SD_Send_Cmd(dev, CMD58, 0) == 0)
+            for(n = 0; n < 4; n++) ocr[n] = SPI_RW(0xFF);
+        __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_CARD, dev->cardtype, __SD_BE32(ocr),
+                 (DWORD)dev->last_sector, 0);
+#endif
+        p->state = SDP_INIT_SCR;
+        break;
+    case SDP_INIT_SCR:
+        __SD_Read_SCR(dev);
+        p->state = SDP_INIT_STATUS;
+        break;
+    case SDP_INIT_STATUS:
+        __SD_Read_Status(dev);
+#ifdef SD_IO_DBG_COUNT
+        dev->debug.read = 0;
+        dev->debug.write = 0;
+        dev->debug.erase = 0;
+        dev->debug.saved = 0;
+#endif
+        __SD_Speed_Transfer(HIGH); // High speed transfer
+        return(__SD_Poll_End(dev, SD_OK));
+    case SDP_READ_CMD:
+        if(__SD_Send_Cmd(dev, p->cmd, __SD_Addr(dev, p->sector)) != 0)
+            return(__SD_Poll_End(dev, SD_ERROR));
+        __SD_Poll_Timer_On(dev, dev->profile.read_ms);     // Wait for data packet
+        p->state = SDP_READ_TOKEN;
+        break;
+    case SDP_READ_TOKEN:
+        line = __SD_Poll_Wait(0xFF);
+        if((line==0xFF)&&(__SD_Poll_Timer_Status(dev)==TRUE)) break;
+        __SD_Poll_Timer_Off(dev);
+        // Token of data block?
+        if(line != 0xFE)
+        {
+            __SD_Diag(dev, SD_DIAG_ERROR, SD_DIAG_TOKEN, line, 0, 0, 0);
+            return(__SD_Poll_Stop(dev, SD_ERROR));
+        }
+        p->state = SDP_READ_DATA;
+        break;
+    case SDP_READ_DATA:
+        // Size block (512 bytes) + CRC (2 bytes) - offset - bytes to count
+        cnt = p->cnt;
+        rest = SD_BLK_SIZE + 2 - p->ofs - cnt;
+        // Skip offset
+        for(cnt = p->ofs; cnt; cnt--) SPI_RW(0xFF);
+        // I receive the data and I write in user's buffer
+        for(cnt = p->cnt; cnt; cnt--) *p->dat++ = SPI_RW(0xFF);
+        // Skip remaining
+        do {
+            SPI_RW(0xFF);
+        } while(--rest);
+#ifdef SD_IO_DBG_COUNT
+        dev->debug.read++;
+#endif
+        if(--p->left == 0) return(__SD_Poll_Stop(dev, SD_OK));
+        __SD_Poll_Timer_On(dev, dev->profile.read_ms);
+        p->state = SDP_READ_TOKEN;
+        break;
+#ifdef SD_IO_WRITE
+    case SDP_WRITE_CMD:
+        // Number of blocks to pre-erase (only a hint for the card)
+        if((p->cmd == CMD25)&&(dev->cardtype & SDCT_SDC))
+            __SD_Send_Cmd(dev, ACMD23, (p->count > SD_ACMD23_MAX) ? SD_ACMD23_MAX : p->count);
+        if(__SD_Send_Cmd(dev, p->cmd, __SD_Addr(dev, p->sector)) != 0)
+            return(__SD_Poll_End(dev, SD_ERROR));
+        p->state = SDP_WRITE_DATA;
+        break;
+    case SDP_WRITE_DATA:
+        seg.buf = p->dat;
+        seg.len = SD_BLK_SIZE;
+        pos.seg = &seg;
+        pos.ofs = 0;
+        // Token of single (0xFE) or multiple (0xFC) block write
+        if(__SD_Send_Block_V(dev, &pos, (p->cmd == CMD25) ? 0xFC : 0xFE) != SD_OK)
+            return(__SD_Poll_Stop(dev, SD_REJECT));
+        p->dat += SD_BLK_SIZE;
+        __SD_Poll_Timer_On(dev, dev->profile.write_ms);
+        p->state = SDP_WRITE_BUSY;
+        break;
+    case SDP_WRITE_BUSY:
+        line = __SD_Poll_Wait(0x00);
+#ifdef SD_IO_WRITE_WAIT_BLOCKER
+        if(line==0) break;
+#else
+        if((line==0)&&(__SD_Poll_Timer_Status(dev)==TRUE)) break;
+#endif
+        __SD_Poll_Timer_Off(dev);
+        if(line==0)
+        {
+            __SD_Diag(dev, SD_DIAG_WARN, SD_DIAG_BUSY, dev->profile.write_ms, 0, 0, 0);
+            return(__SD_Poll_Stop(dev, SD_BUSY));
+        }
+        if(--p->left == 0) return(__SD_Poll_Stop(dev, SD_OK));
+        p->state = SDP_WRITE_DATA;
+        break;
+#endif
+    case SDP_READY:
+        line = __SD_Poll_Wait(0x00);
+        if((line==0)&&(__SD_Poll_Timer_Status(dev)==TRUE)) break;
+        __SD_Poll_Timer_Off(dev);
+        if((line==0)&&(p->res==SD_OK)) p->res = SD_BUSY;
+        return(__SD_Poll_End(dev, (SDRESULTS)p->res));
+    default:
+        return((SDRESULTS)p->res);
+    }
+    return(SD_PENDING);
+}
+#endif
+
+/******************************************************************************
+ Public Methods - Direct work with SD card
+******************************************************************************/
+
+SDRESULTS SD_Init(SD_DEV *dev)
+{
+#if defined(_M_IX86)    // x86
+    DWORD t0 = SD_Time_Us();
+    if (__SD_Image_Open(dev) != SD_OK)
+    {
+        dev->init_us = SD_Time_Us() - t0;
+        __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_INIT, SD_ERROR, dev->init_us, 0, 0);
+        return (SD_ERROR);
+    }
+    else
+    {
+        dev->mount = TRUE;
+        dev->stream = FALSE;
+        dev->last_sector = __SD_Sectors(dev);
+        // A hole in the file reads back as zeros
+        dev->erase_zero = TRUE;
+        // As a class 10 card with AU of 4MB
+        dev->au_size = 8192;
+        dev->speed_class = 10;
+        __SD_Profile(dev);
+#ifdef SD_IO_TUNE
+        __SD_Tune_Check(dev);
+#endif
+        // The commands up to the SD Status, and the ACMD41 loop
+        __SD_Model(dev, 11, 0, 0, SD_MODEL_INIT);
+#ifdef SD_IO_DBG_COUNT
+        dev->debug.read = 0;
+        dev->debug.write = 0;
+        dev->debug.erase = 0;
+        dev->debug.saved = 0;
+#endif
+        dev->init_us = SD_Time_Us() - t0;
+        __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_INIT, SD_OK, dev->init_us, 0, 0);
+        return (SD_OK);
+    }
+#else   // uControllers
+    __SD_Poll_Init(dev);
+    return(__SD_Poll_Run(dev));
+#endif
+}
+
+#if defined(_M_IX86) || defined(SD_IO_SLOTS)
+SDRESULTS SD_Init_Multi(SD_DEV *dev, BYTE count, SDRESULTS *res)
+{
+    SDRESULTS r, all = SD_OK;
+    BYTE idx;
+#if !defined(_M_IX86) && defined(SD_IO_CLOCK)
+    BYTE next, left = count;
+    BOOL high = FALSE;
+    for(idx = 0; idx < count; idx++) __SD_Poll_Init(&dev[idx]);
+    while(left)
+    {
+        // The card due first, the others are inside their poll interval
+        next = count;
+        for(idx = 0; idx < count; idx++)
+        {
+            if(dev[idx].poll.state == SDP_IDLE) continue;
+            if((next == count)||((LONG)(dev[idx].poll.due - dev[next].poll.due) < 0))
+                next = idx;
+        }
+        while((LONG)(dev[next].poll.due - SD_Time_Us()) > 0);
+        // The end of an init leaves the bus at high speed
+        __SD_Speed_Transfer(LOW);
+        if(__SD_Poll_Step(&dev[next]) != SD_PENDING) left--;
+    }
+#endif
+    for(idx = 0; idx < count; idx++)
+    {
+#if !defined(_M_IX86) && defined(SD_IO_CLOCK)
+        r = (SDRESULTS)dev[idx].poll.res;
+        if(r == SD_OK) high = TRUE;
+#else
+        r = SD_Init(&dev[idx]);
+#endif
+        if(res != NULL) res[idx] = r;
+        if(all == SD_OK) all = r;
+    }
+#if !defined(_M_IX86) && defined(SD_IO_CLOCK)
+    // Each card takes its tuned clock back at its next command
+    if(high) __SD_Speed_Transfer(HIGH);
+#endif
+    return(all);
+}
+#endif
+
+SDRESULTS __SD_Read_Op(SD_DEV *dev, void *dat, LBA_t sector, WORD ofs, WORD cnt)
+{
+#if defined(_M_IX86)    // x86
+    // Check the sector query
+    if((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
+    if(dev->fp!=NULL)
+    {
+        // CMD17 and the whole block
+        __SD_Model(dev, 1, 1, 0, 0);
+        if(__SD_Image_Read(dev, dat, (QWORD)sector * SD_BLK_SIZE + ofs, cnt)==SD_OK)
+        {
+#ifdef SD_IO_DBG_COUNT
+            dev->debug.read++;
+#endif
+            return(SD_OK);
+        }
+        else return(SD_ERROR);
+    } else {
+        return(SD_ERROR);
+    }
+#else   // uControllers
+    if ((sector > dev->last_sector)||(cnt == 0)) return(SD_PARERR);
+    if (dev->poll.state != SDP_IDLE) return(SD_BUSY);
+    __SD_Poll_Begin(dev, SDP_READ_CMD, CMD17, dat, sector, 1);
+    dev->poll.ofs = ofs;
+    dev->poll.cnt = cnt;
+    return(__SD_Poll_Run(dev));
+#endif
+}
+
+SDRESULTS SD_Read(SD_DEV *dev, void *dat, LBA_t sector, WORD ofs, WORD cnt)
+{
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+    return(__SD_Trace(dev, SD_TRACE_READ, sector, cnt, ofs, t0,
+                      __SD_Read_Op(dev, dat, sector, ofs, cnt)));
+#else
+    return(__SD_Read_Op(dev, dat, sector, ofs, cnt));
+#endif
+}
+
+SDRESULTS __SD_ReadV_Op(SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector, DWORD count)
+{
+#if defined(_M_IX86)    // x86
+    SD_IOPOS pos;
+    BYTE *dat;
+    WORD n;
+    QWORD ofs, end;
+    if(dev->fp == NULL) return(SD_ERROR);
+    // CMD18, the blocks and CMD12
+    __SD_Model(dev, 2, count, 0, 0);
+    // Without a base the whole vector is one preadv of the image
+    if(dev->bfp == NULL)
+    {
+        if(__SD_Image_V(dev, iov, cnt, (QWORD)sector * SD_BLK_SIZE, FALSE)!=SD_OK)
+            return(SD_ERROR);
+    } else {
+        // The holes come from the base, piece by piece
+        pos.seg = iov;
+        pos.ofs = 0;
+        ofs = (QWORD)sector * SD_BLK_SIZE;
+        end = ofs + (QWORD)count * SD_BLK_SIZE;
+        while(ofs != end)
+        {
+            n = (end - ofs > 0x8000) ? 0x8000 : (WORD)(end - ofs);
+            dat = __SD_IOV_Next(&pos, &n);
+            if(__SD_Image_Read(dev, dat, ofs, n)!=SD_OK) return(SD_ERROR);
+            ofs += n;
+        }
+    }
+#ifdef SD_IO_DBG_COUNT
+    dev->debug.read += count;
+#endif
+    return(SD_OK);
+#else   // uControllers
+    SDRESULTS res;
+    SD_IOPOS pos;
+    (void)cnt;
+    if(dev->stream) return(SD_BUSY);
+    pos.seg = iov;
+    pos.ofs = 0;
+    if(__SD_Send_Cmd(dev, CMD18, __SD_Addr(dev, sector))!=0)
+    {
+        __SD_Release(dev);
+        return(SD_ERROR);
+    }
+    // Each data packet straight into the segments it covers
+    do {
+        res = __SD_Read_Data_V(dev, &pos, SD_BLK_SIZE);
+#ifdef SD_IO_DBG_COUNT
+        if(res==SD_OK) dev->debug.read++;
+#endif
+    } while((res==SD_OK)&&(--count));
+    // Stop the transfer, also after an error
+    __SD_Send_Cmd(dev, CMD12, 0);
+    if(__SD_Wait_Ready(dev->profile.read_ms)==0) res = SD_BUSY;
+    __SD_Release(dev);
+    return(res);
+#endif
+}
+
+SDRESULTS SD_ReadV(SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector)
+{
+    DWORD count = __SD_IOV_Sectors(iov, cnt);
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+#endif
+    SDRESULTS res;
+    // Query ok?
+    if((count == 0)||(sector > dev->last_sector)||
+       (count - 1 > dev->last_sector - sector)) res = SD_PARERR;
+    else res = __SD_ReadV_Op(dev, iov, cnt, sector, count);
+#ifdef SD_IO_TRACE
+    __SD_Trace(dev, SD_TRACE_READV, sector, count, 0, t0, res);
+#endif
+    return(res);
+}
+
+#ifdef SD_IO_WRITE
+SDRESULTS __SD_Write_Op(SD_DEV *dev, void *dat, LBA_t sector)
+{
+#if defined(_M_IX86)    // x86
+    // Query ok?
+    if(sector > dev->last_sector) return(SD_PARERR);
+    if(dev->fp != NULL)
+    {
+        // CMD24 and the block
+        __SD_Model(dev, 1, 0, 1, 0);
+        if((__SD_Image_Prepare(dev, sector, sector)!=SD_OK)||
+           (fseeko(dev->fp, (off_t)sector * SD_BLK_SIZE, SEEK_SET)!=0))
+            return(SD_ERROR);
+        else {
+            if(fwrite(dat, 1, SD_BLK_SIZE, dev->fp)==SD_BLK_SIZE)
+            {
+#ifdef SD_IO_DBG_COUNT
+                dev->debug.write++;
+#endif
+                return(SD_OK);
+            }
+            else return(SD_ERROR);
+        }
+    } else return(SD_ERROR);
+#else   // uControllers
+    // Query ok?
+    if(sector > dev->last_sector) return(SD_PARERR);
+    if(dev->poll.state != SDP_IDLE) return(SD_BUSY);
+    // Single block write (token <- 0xFE)
+    __SD_Poll_Begin(dev, SDP_WRITE_CMD, CMD24, dat, sector, 1);
+    return(__SD_Poll_Run(dev));
+#endif
+}
+
+SDRESULTS SD_Write(SD_DEV *dev, void *dat, LBA_t sector)
+{
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+    return(__SD_Trace(dev, SD_TRACE_WRITE, sector, 1, 0, t0,
+                      __SD_Write_Op(dev, dat, sector)));
+#else
+    return(__SD_Write_Op(dev, dat, sector));
+#endif
+}
+
+SDRESULTS __SD_Write_Blocks_Op(SD_DEV *dev, void *dat, LBA_t sector, DWORD count)
+{
+#ifdef SD_IO_ZERO_ELIDE
+    SDRESULTS res = SD_OK;
+    DWORD idx, start, zcnt;
+#endif
+    // Query ok?
+    if((count == 0)||(sector > dev->last_sector)||
+       (count - 1 > dev->last_sector - sector)) return(SD_PARERR);
+#ifdef SD_IO_ZERO_ELIDE
+    // Erase groups larger than a block would cost writes around each run
+    if(dev->erase_zero && dev->profile.erase_blk_en)
+    {
+        // Sectors [start, idx) are pending, the last zcnt of them are zeros
+        for(idx=0, start=0, zcnt=0; (idx!=count)&&(res==SD_OK); idx++)
+        {
+            if(__SD_Is_Zero((BYTE*)dat + idx * SD_BLK_SIZE))
+            {
+                zcnt++;
+                continue;
+            }
+            if(zcnt >= SD_IO_ZERO_ELIDE_MIN)
+            {
+                res = __SD_Write_Elide(dev, dat, sector, start, idx, zcnt);
+                start = idx;
+            }
+            zcnt = 0;
+        }
+        if(res==SD_OK)
+            res = __SD_Write_Elide(dev, dat, sector, start, count,
+                                   (zcnt >= SD_IO_ZERO_ELIDE_MIN) ? zcnt : 0);
+        return(res);
+    }
+#endif
+    return(__SD_Write_Bursts(dev, (BYTE*)dat, sector, count));
+}
+
+SDRESULTS SD_Write_Blocks(SD_DEV *dev, void *dat, LBA_t sector, DWORD count)
+{
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+    return(__SD_Trace(dev, SD_TRACE_BLOCKS, sector, count, 0, t0,
+                      __SD_Write_Blocks_Op(dev, dat, sector, count)));
+#else
+    return(__SD_Write_Blocks_Op(dev, dat, sector, count));
+#endif
+}
+
+SDRESULTS __SD_WriteV_Op(SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector, DWORD count)
+{
+#if defined(_M_IX86)    // x86
+    // ACMD23, CMD25, the blocks and the stop tran token
+    __SD_Model(dev, 4, 0, count, 0);
+    if((dev->fp == NULL)||
+       (__SD_Image_Prepare(dev, sector, sector + count - 1)!=SD_OK)||
+       (__SD_Image_V(dev, iov, cnt, (QWORD)sector * SD_BLK_SIZE, TRUE)!=SD_OK))
+        return(SD_ERROR);
+#ifdef SD_IO_DBG_COUNT
+    dev->debug.write += count;
+#endif
+    return(SD_OK);
+#else   // uControllers
+    SDRESULTS res, end;
+    SD_IOPOS pos;
+    (void)cnt;
+    res = SD_Stream_Begin(dev, sector, count);
+    if(res!=SD_OK) return(res);
+    pos.seg = iov;
+    pos.ofs = 0;
+    // Each data block straight from the segments it covers (token <- 0xFC)
+    do {
+        res = __SD_Write_Block_V(dev, &pos, 0xFC);
+    } while((res==SD_OK)&&(--count));
+    // Stop tran token, also after an error to leave the receive state
+    end = SD_Stream_End(dev);
+    return((res==SD_OK) ? end : res);
+#endif
+}
+
+SDRESULTS SD_WriteV(SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector)
+{
+    DWORD count = __SD_IOV_Sectors(iov, cnt);
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+#endif
+    SDRESULTS res;
+    // Query ok?
+    if((count == 0)||(sector > dev->last_sector)||
+       (count - 1 > dev->last_sector - sector)) res = SD_PARERR;
+    else res = __SD_WriteV_Op(dev, iov, cnt, sector, count);
+#ifdef SD_IO_TRACE
+    __SD_Trace(dev, SD_TRACE_WRITEV, sector, count, 0, t0, res);
+#endif
+    return(res);
+}
+
+SDRESULTS SD_Stream_Begin(SD_DEV *dev, LBA_t sector, DWORD count)
+{
+    if(dev->stream||(dev->poll.state != SDP_IDLE)) return(SD_BUSY);
+    if(sector > dev->last_sector) return(SD_PARERR);
+#if defined(_M_IX86)    // x86
+    (void)count;        // Nothing to pre-erase in a file
+    if(dev->fp == NULL) return(SD_ERROR);
+    // ACMD23 and CMD25
+    __SD_Model(dev, 3, 0, 0, 0);
+    if(fseeko(dev->fp, (off_t)sector * SD_BLK_SIZE, SEEK_SET)!=0) return(SD_ERROR);
+#else   // uControllers
+    // Number of blocks to pre-erase (only a hint for the card)
+    if(count && (dev->cardtype & SDCT_SDC))
+        __SD_Send_Cmd(dev, ACMD23, (count > SD_ACMD23_MAX) ? SD_ACMD23_MAX : count);
+    if(__SD_Send_Cmd(dev, CMD25, __SD_Addr(dev, sector))!=0)
+    {
+        __SD_Release(dev);
+        return(SD_ERROR);
+    }
+#endif
+    dev->stream = TRUE;
+    dev->stream_next = sector;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Stream_Write_Op(SD_DEV *dev, void *dat)
+{
+    SDRESULTS res;
+    if((dev->stream == FALSE)||(dev->stream_next > dev->last_sector))
+        return(SD_PARERR);
+#if defined(_M_IX86)    // x86
+    __SD_Model(dev, 0, 0, 1, 0);
+    // The copy from the base moves the file, come back to the stream
+    if(dev->bfp != NULL)
+    {
+        if((__SD_Image_Prepare(dev, dev->stream_next, dev->stream_next)!=SD_OK)||
+           (fseeko(dev->fp, (off_t)dev->stream_next * SD_BLK_SIZE, SEEK_SET)!=0))
+            return(SD_ERROR);
+    }
+    else __SD_Image_Prepare(dev, dev->stream_next, dev->stream_next);
+    if(fwrite(dat, 1, SD_BLK_SIZE, dev->fp)!=SD_BLK_SIZE) return(SD_ERROR);
+#ifdef SD_IO_DBG_COUNT
+    dev->debug.write++;
+#endif
+    res = SD_OK;
+#else   // uControllers
+    // Multiple block write (token <- 0xFC)
+    __SD_Route(dev);
+    res = __SD_Write_Block(dev, dat, 0xFC);
+#endif
+    if(res==SD_OK) dev->stream_next++;
+    return(res);
+}
+
+SDRESULTS SD_Stream_Write(SD_DEV *dev, void *dat)
+{
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+    LBA_t sector = dev->stream_next;
+    return(__SD_Trace(dev, SD_TRACE_STREAM, sector, 1, 0, t0,
+                      __SD_Stream_Write_Op(dev, dat)));
+#else
+    return(__SD_Stream_Write_Op(dev, dat));
+#endif
+}
+
+SDRESULTS SD_Stream_End(SD_DEV *dev)
+{
+#if !defined(_M_IX86)
+    SDRESULTS res;
+#endif
+    if(dev->stream == FALSE) return(SD_OK);
+    dev->stream = FALSE;
+#if defined(_M_IX86)    // x86
+    // Stop tran token
+    __SD_Model(dev, 1, 0, 0, 0);
+    return((fflush(dev->fp)==0) ? SD_OK : SD_ERROR);
+#else   // uControllers
+    // Stop tran token (0xFD), then the card lets the bus go
+    __SD_Route(dev);
+    res = __SD_Write_Block(dev, NULL, 0xFD);
+    __SD_Release(dev);
+    return(res);
+#endif
+}
+
+SDRESULTS __SD_Erase_Op(SD_DEV *dev, LBA_t first, LBA_t last)
+{
+#if defined(_M_IX86)    // x86
+    return(__SD_Erase(dev, first, last));
+#else   // uControllers
+    return(__SD_Erase(dev, first, last, SD_ERASE_ARG));
+#endif
+}
+
+SDRESULTS SD_Erase(SD_DEV *dev, LBA_t first, LBA_t last)
+{
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+    return(__SD_Trace(dev, SD_TRACE_ERASE, first, (DWORD)(last - first + 1), 0, t0,
+                      __SD_Erase_Op(dev, first, last)));
+#else
+    return(__SD_Erase_Op(dev, first, last));
+#endif
+}
+
+SDRESULTS SD_Discard(SD_DEV *dev, LBA_t first, LBA_t last)
+{
+    SDRESULTS res;
+#ifdef SD_IO_TRACE
+    DWORD t0 = __SD_Trace_Begin(dev);
+#endif
+#if defined(_M_IX86)    // x86
+    // Nothing better than a hole to model an unused region
+    res = __SD_Erase(dev, first, last);
+#else   // uControllers
+    // Cards previous to SD 5.0 don't know the discard, they erase
+    res = SD_ERROR;
+    if(dev->profile.discard) res = __SD_Erase(dev, first, last, SD_DISCARD_ARG);
+    if(res != SD_OK) res = __SD_Erase(dev, first, last, SD_ERASE_ARG);
+#endif
+#ifdef SD_IO_TRACE
+    __SD_Trace(dev, SD_TRACE_DISCARD, first, (DWORD)(last - first + 1), 0, t0, res);
+#endif
+    return(res);
+}
+#endif
+
+SDRESULTS SD_Status(SD_DEV *dev)
+{
+    if(dev->mount == FALSE) return(SD_NOINIT);
+    // Inside a multiple block write the card only takes data tokens
+    if(dev->stream) return(SD_BUSY);
+#if defined(_M_IX86)
+    // CMD13
+    __SD_Model(dev, 1, 0, 0, 0);
+    return((dev->fp != NULL) ? SD_OK : SD_NORESPONSE);
+#else
+    return(__SD_Check(dev));
+#endif
+}
+
+SDRESULTS SD_Recover(SD_DEV *dev)
+{
+    SDRESULTS res;
+    DWORD t0 = SD_Time_Us();
+    dev->recover = SD_RECOVER_NONE;
+    res = SD_Status(dev);
+#if defined(_M_IX86)
+    if(res == SD_BUSY)
+    {
+        dev->recover = SD_RECOVER_STOP;
+        res = SD_Stream_End(dev);
+    }
+    if((res != SD_OK)&&(dev->fp != NULL))
+    {
+        dev->recover = SD_RECOVER_RESYNC;
+        clearerr(dev->fp);
+        res = SD_Status(dev);
+    }
+#else
+    if((res != SD_OK)&&(res != SD_NOINIT))
+    {
+        // Stop tran token for a write, CMD12 for a read
+        dev->recover = SD_RECOVER_STOP;
+        __SD_Route(dev);
+        if(dev->stream||((dev->poll.state!=SDP_IDLE)&&(dev->poll.cmd==CMD25)))
+        {
+            dev->stream = FALSE;
+            __SD_Write_Block(dev, NULL, 0xFD);
+        }
+        dev->poll.state = SDP_IDLE;
+        __SD_Send_Cmd(dev, CMD12, 0);
+        __SD_Wait_Ready(SD_IO_WRITE_TIMEOUT_WAIT);
+        __SD_Release(dev);
+        res = __SD_Check(dev);
+    }
+    if((res != SD_OK)&&(res != SD_NOINIT))
+    {
+        dev->recover = SD_RECOVER_RESYNC;
+        __SD_Resync(dev);
+        res = __SD_Check(dev);
+    }
+#endif
+    if(res != SD_OK)
+    {
+        dev->recover = SD_RECOVER_INIT;
+#if defined(_M_IX86)
+        if(dev->fp != NULL) fclose(dev->fp);
+        if(dev->bfp != NULL) fclose(dev->bfp);
+#endif
+        res = SD_Init(dev);
+    }
+    dev->recover_us = SD_Time_Us() - t0;
+    return(res);
+}
+
+SDRESULTS SD_Begin(SD_DEV *dev)
+{
+    if(dev->mount == FALSE) return(SD_NOINIT);
+#if !defined(_M_IX86)
+    if(dev->session == FALSE)
+    {
+        // Select the card once for all the operations of the session
+        __SD_Route(dev);
+        __SD_Deassert();
+        SPI_RW(0xFF);
+        __SD_Assert();
+        SPI_RW(0xFF);
+        dev->session = TRUE;
+    }
+#endif
+    return(SD_OK);
+}
+
+SDRESULTS SD_End(SD_DEV *dev)
+{
+#if !defined(_M_IX86)
+    if(dev->session == TRUE)
+    {
+        dev->session = FALSE;
+        __SD_Route(dev);
+        __SD_Deassert();
+        SPI_Release();
+    }
+#else
+    (void)dev;
+#endif
+    return(SD_OK);
+}
+
+SDRESULTS SD_Init_Start(SD_DEV *dev)
+{
+#if defined(_M_IX86)    // x86
+    dev->poll.state = SDP_IDLE;
+    dev->poll.res = (BYTE)SD_Init(dev);
+#else   // uControllers
+    // Abandons the operation in course, as SD_Init
+    __SD_Poll_Init(dev);
+#endif
+    return(SD_OK);
+}
+
+SDRESULTS SD_Read_Start(SD_DEV *dev, void *dat, LBA_t sector, DWORD count)
+{
+#if defined(_M_IX86)    // x86
+    SD_IOVEC seg;
+#endif
+    if(dev->poll.state != SDP_IDLE) return(SD_BUSY);
+    // Query ok?
+    if((count == 0)||(count > 0xFFFFFFFFUL / SD_BLK_SIZE)||
+       (sector > dev->last_sector)||(count - 1 > dev->last_sector - sector))
+        return(SD_PARERR);
+#if defined(_M_IX86)    // x86
+    seg.buf = dat;
+    seg.len = count * SD_BLK_SIZE;
+    dev->poll.res = (BYTE)SD_ReadV(dev, &seg, 1, sector);
+#else   // uControllers
+    __SD_Poll_Begin(dev, SDP_READ_CMD, (count > 1) ? CMD18 : CMD17, dat, sector, count);
+#ifdef SD_IO_TRACE
+    dev->poll.op = SD_TRACE_READV;
+    dev->poll.t0 = __SD_Trace_Begin(dev);
+#endif
+#endif
+    return(SD_OK);
+}
+
+#ifdef SD_IO_WRITE
+SDRESULTS SD_Write_Start(SD_DEV *dev, void *dat, LBA_t sector, DWORD count)
+{
+#if defined(_M_IX86)    // x86
+    SD_IOVEC seg;
+#endif
+    if((dev->poll.state != SDP_IDLE)||dev->stream) return(SD_BUSY);
+    // Query ok?
+    if((count == 0)||(count > 0xFFFFFFFFUL / SD_BLK_SIZE)||
+       (sector > dev->last_sector)||(count - 1 > dev->last_sector - sector))
+        return(SD_PARERR);
+#if defined(_M_IX86)    // x86
+    seg.buf = dat;
+    seg.len = count * SD_BLK_SIZE;
+    dev->poll.res = (BYTE)SD_WriteV(dev, &seg, 1, sector);
+#else   // uControllers
+    __SD_Poll_Begin(dev, SDP_WRITE_CMD, (count > 1) ? CMD25 : CMD24, dat, sector, count);
+#ifdef SD_IO_TRACE
+    dev->poll.op = SD_TRACE_WRITEV;
+    dev->poll.t0 = __SD_Trace_Begin(dev);
+#endif
+#endif
+    return(SD_OK);
+}
+#endif
+
+SDRESULTS SD_Poll(SD_DEV *dev)
+{
+#if defined(_M_IX86)    // x86
+    // The operation ended in SD_*_Start
+    return((SDRESULTS)dev->poll.res);
+#else   // uControllers
+    if(dev->poll.state == SDP_IDLE) return((SDRESULTS)dev->poll.res);
+    return(__SD_Poll_Step(dev));
+#endif
+}
+
+DWORD SD_Time_Us(void)
+{
+#if defined(_M_IX86)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#ifdef SD_IO_MODEL
+    return((DWORD)ts.tv_sec * 1000000UL + (DWORD)(ts.tv_nsec / 1000) + (DWORD)sd_model_us);
+#else
+    return((DWORD)ts.tv_sec * 1000000UL + (DWORD)(ts.tv_nsec / 1000));
+#endif
+#elif defined(SD_IO_CLOCK)
+    return(SPI_Clock_Us());
+#else
+    return(0);
+#endif
+}
+
+void SD_Put32(BYTE *p, DWORD v)
+{
+    p[0] = (BYTE)(v);
+    p[1] = (BYTE)(v >> 8);
+    p[2] = (BYTE)(v >> 16);
+    p[3] = (BYTE)(v >> 24);
+}
+
+DWORD SD_Get32(const BYTE *p)
+{
+    return((DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24));
+}
+
+#ifdef SD_IO_TRACE
+void SD_Trace_Start(SD_DEV *dev, SD_TRACE *trace)
+{
+    if(trace != NULL) trace->count = 0;
+    dev->trace = trace;
+}
+
+DWORD SD_Trace_Dump(const SD_TRACE *trace, void *dat, DWORD max)
+{
+    BYTE *p = (BYTE*)dat;
+    const SD_TRACE_REC *r;
+    DWORD n, idx;
+    if(max < SD_TRACE_DUMP_HDR) return(0);
+    n = (trace->count < SD_IO_TRACE_SIZE) ? trace->count : SD_IO_TRACE_SIZE;
+    if(n > (max - SD_TRACE_DUMP_HDR) / SD_TRACE_DUMP_REC)
+        n = (max - SD_TRACE_DUMP_HDR) / SD_TRACE_DUMP_REC;
+    SD_Put32(p, SD_TRACE_MAGIC);
+    SD_Put32(p + 4, 1);
+    SD_Put32(p + 8, trace->count);
+    SD_Put32(p + 12, n);
+    p += SD_TRACE_DUMP_HDR;
+    // The newest n records, from the oldest of them
+    for(idx = trace->count - n; idx != trace->count; idx++)
+    {
+        r = &trace->rec[idx & (SD_IO_TRACE_SIZE - 1)];
+        SD_Put32(p, r->t_us);
+        SD_Put32(p + 4, r->lat_us);
+        SD_Put32(p + 8, (DWORD)r->sector);
+        SD_Put32(p + 12, (DWORD)((QWORD)r->sector >> 32));
+        SD_Put32(p + 16, r->len);
+        p[20] = (BYTE)(r->ofs);
+        p[21] = (BYTE)(r->ofs >> 8);
+        p[22] = r->op;
+        p[23] = r->res;
+        p += SD_TRACE_DUMP_REC;
+    }
+    return(SD_TRACE_DUMP_SIZE(n));
+}
+#endif
+
+#ifdef SD_IO_DIAG
+void SD_Diag_Start(SD_DEV *dev, SD_DIAG *diag)
+{
+    if(diag != NULL) diag->count = 0;
+    dev->diag = diag;
+}
+
+DWORD SD_Diag_Dump(const SD_DIAG *diag, void *dat, DWORD max)
+{
+    BYTE *p = (BYTE*)dat;
+    const SD_DIAG_REC *r;
+    DWORD n, idx;
+    BYTE arg;
+    if(max < SD_DIAG_DUMP_HDR) return(0);
+    n = (diag->count < SD_IO_DIAG_SIZE) ? diag->count : SD_IO_DIAG_SIZE;
+    if(n > (max - SD_DIAG_DUMP_HDR) / SD_DIAG_DUMP_REC)
+        n = (max - SD_DIAG_DUMP_HDR) / SD_DIAG_DUMP_REC;
+    SD_Put32(p, SD_DIAG_MAGIC);
+    SD_Put32(p + 4, 1);
+    SD_Put32(p + 8, diag->count);
+    SD_Put32(p + 12, n);
+    p += SD_DIAG_DUMP_HDR;
+    // The newest n records, from the oldest of them
+    for(idx = diag->count - n; idx != diag->count; idx++)
+    {
+        r = &diag->rec[idx & (SD_IO_DIAG_SIZE - 1)];
+        SD_Put32(p, r->t_us);
+        p[4] = r->id;
+        p[5] = r->level;
+        p[6] = 0;
+        p[7] = 0;
+        for(arg = 0; arg < SD_DIAG_ARGS; arg++) SD_Put32(p + 8 + 4 * arg, r->arg[arg]);
+        p += SD_DIAG_DUMP_REC;
+    }
+    return(SD_DIAG_DUMP_SIZE(n));
+}
+#endif
+
+#ifdef SD_IO_TUNE
+SDRESULTS SD_Tune(SD_DEV *dev, LBA_t first, void *work)
+{
+    static const WORD bursts[] = { SD_IO_TUNE_BURSTS };
+    static const WORD aligns[] = { SD_IO_TUNE_ALIGNS };
+    const WORD nb = sizeof(bursts) / sizeof(bursts[0]);
+    const WORD na = sizeof(aligns) / sizeof(aligns[0]);
+    SD_TUNE *t = &dev->tune;
+    BYTE *w = (BYTE*)work;
+    LBA_t base;
+    DWORD step, kbs, best = 0;
+    WORD idx, burst = 1, align = 1, amax = aligns[na - 1];
+#if !defined(_M_IX86)
+    static const DWORD khz[] = { SD_IO_TUNE_KHZ };
+    DWORD set, last = 0, read_kbs;
+#endif
+    if(dev->mount == FALSE) return(SD_NOINIT);
+    if(dev->stream||(dev->poll.state != SDP_IDLE)) return(SD_BUSY);
+    // The writes of a candidate, each one step apart from an aligned base
+    step = ((DWORD)bursts[nb - 1] + 2 * amax - 1) / amax * amax;
+    base = (first + amax) / amax * amax;
+    if((first > dev->last_sector)||(dev->last_sector - first < SD_IO_TUNE_SCRATCH - 1)||
+       (base + step * SD_IO_TUNE_REPS > first + SD_IO_TUNE_SCRATCH)) return(SD_PARERR);
+    // Untuned transfers while timing, for this card
+    memset(t, 0, sizeof(SD_TUNE));
+    t->mid = dev->profile.mid;
+    memcpy(t->pnm, dev->profile.pnm, sizeof(t->pnm));
+    t->psn = dev->profile.psn;
+#if defined(_M_IX86)
+    // The emulation has no clock, only the data path is timed
+    best = __SD_Tune_Clock(dev, w, base, 0, &t->read_kbs);
+#else
+    // The fastest clock isn't the best if the card or the board can't stand it
+    for(idx = 0; idx != sizeof(khz) / sizeof(khz[0]); idx++)
+    {
+        if(khz[idx] > dev->profile.tran_khz) continue;
+        set = SPI_Freq_Khz(khz[idx]);
+#ifdef SD_IO_SLOTS
+        sd_bus_clock = dev;     // The clock under test, not the tuned one
+#endif
+        if(set == last) continue;
+        last = set;
+        kbs = __SD_Tune_Clock(dev, w, base, set, &read_kbs);
+        if(kbs == 0)
+        {
+            SD_Recover(dev);
+            continue;
+        }
+        if(kbs > best)
+        {
+            best = kbs;
+            t->khz = set;
+            t->read_kbs = read_kbs;
+        }
+    }
+    __SD_Tune_Apply(dev);
+#endif
+    if(best == 0) return(SD_ERROR);
+    // The burst with the best throughput, the shortest on a tie
+    __SD_Tune_Data(w, base, 0, FALSE);
+    best = 0;
+    for(idx = 0; idx != nb; idx++)
+    {
+        kbs = __SD_Tune_Writes(dev, w, base, step, bursts[idx]);
+        if(kbs > best)
+        {
+            best = kbs;
+            burst = bursts[idx];
+        }
+    }
+    if(best == 0) return(SD_ERROR);
+    // Starts at a multiple of the alignment and not of the next one, it must
+    // win by SD_IO_TUNE_SLACK percent over a smaller one
+    best = 0;
+    for(idx = 0; idx != na; idx++)
+    {
+        kbs = __SD_Tune_Writes(dev, w, base + ((aligns[idx] < amax) ? aligns[idx] : 0), step, burst);
+        if(kbs > best + best / 100 * SD_IO_TUNE_SLACK)
+        {
+            best = kbs;
+            align = aligns[idx];
+        }
+    }
+    if(best == 0) return(SD_ERROR);
+    t->burst = (burst == bursts[nb - 1]) ? 0 : burst;
+    t->align = align;
+    t->write_kbs = best;
+    __SD_Diag(dev, SD_DIAG_INFO, SD_DIAG_TUNE, t->khz, t->burst, t->align, t->write_kbs);
+    // The record, to take it in the next runs (SD_Tune_Load)
+    memset(w, 0, SD_BLK_SIZE);
+    SD_Put32(w, SD_TUNE_MAGIC);
+    SD_Put32(w + 4, 1);
+    SD_Put32(w + 8, t->psn);
+    SD_Put32(w + 12, t->khz);
+    SD_Put32(w + 16, t->read_kbs);
+    SD_Put32(w + 20, t->write_kbs);
+    SD_Put32(w + 24, (DWORD)t->burst | ((DWORD)t->align << 16));
+    w[28] = t->mid;
+    memcpy(w + 29, t->pnm, sizeof(t->pnm));
+    SD_Put32(w + 36, __SD_Tune_Sum(w));
+    return(SD_Write(dev, w, first));
+}
+
+SDRESULTS SD_Tune_Load(SD_DEV *dev, LBA_t first, void *work)
+{
+    SD_TUNE tune;
+    BYTE *w = (BYTE*)work;
+    SDRESULTS res = SD_Read(dev, w, first, 0, SD_BLK_SIZE);
+    if(res != SD_OK) return(res);
+    if((SD_Get32(w) != SD_TUNE_MAGIC)||(SD_Get32(w + 4) != 1)||
+       (SD_Get32(w + 36) != __SD_Tune_Sum(w))) return(SD_ERROR);
+    tune.psn = SD_Get32(w + 8);
+    tune.khz = SD_Get32(w + 12);
+    tune.read_kbs = SD_Get32(w + 16);
+    tune.write_kbs = SD_Get32(w + 20);
+    tune.burst = (WORD)SD_Get32(w + 24);
+    tune.align = (WORD)(SD_Get32(w + 24) >> 16);
+    tune.mid = w[28];
+    memcpy(tune.pnm, w + 29, sizeof(tune.pnm));
+    return(SD_Tune_Set(dev, &tune));
+}
+
+SDRESULTS SD_Tune_Set(SD_DEV *dev, const SD_TUNE *tune)
+{
+    if(dev->mount == FALSE) return(SD_NOINIT);
+    if(__SD_Tune_Same(dev, tune) == FALSE) return(SD_ERROR);
+    dev->tune = *tune;
+#if !defined(_M_IX86)
+    __SD_Tune_Apply(dev);
+#endif
+    return(SD_OK);
+}
+#endif
+
+#if defined(_M_IX86) && defined(SD_IO_MODEL)
+void SD_Model_Start(SD_DEV *dev, SD_MODEL *model)
+{
+    dev->model = model;
+    if((model != NULL)&&(model->seed == 0)) model->seed = 1;
+}
+
+SDRESULTS SD_Model_Load(SD_MODEL *model, const char *fn)
+{
+    // Default model: a class 10 SDHC card on the SPI clock of the port
+    static const SD_MODEL def = {
+        10, 500, SD_IO_SPI_KHZ, { 200, 300, 700, 2000, 10000 },
+        1000, 100000, 2000, 100000, FALSE, 1
+    };
+    static const struct {
+        const char *key;
+        size_t ofs;
+    } keys[] = {
+        { "cmd_us", offsetof(SD_MODEL, cmd_us) },
+        { "read_us", offsetof(SD_MODEL, read_us) },
+        { "spi_khz", offsetof(SD_MODEL, spi_khz) },
+        { "gc_ppm", offsetof(SD_MODEL, gc_ppm) },
+        { "gc_us", offsetof(SD_MODEL, gc_us) },
+        { "erase_us", offsetof(SD_MODEL, erase_us) },
+        { "init_us", offsetof(SD_MODEL, init_us) },
+        { "seed", offsetof(SD_MODEL, seed) }
+    };
+    FILE *fp;
+    char line[128], key[32], val[32];
+    unsigned long v[SD_MODEL_POINTS];
+    SDRESULTS res = SD_OK;
+    int n;
+    DWORD idx;
+    *model = def;
+    if(fn == NULL) return(SD_OK);
+    fp = fopen(fn, "r");
+    if(fp == NULL) return(SD_ERROR);
+    while((res == SD_OK)&&(fgets(line, sizeof(line), fp) != NULL))
+    {
+        if(strchr(line, '#') != NULL) *strchr(line, '#') = 0;
+        if(sscanf(line, "%31s", key) != 1) continue;
+        if(strcmp(key, "prog_us") == 0)
+        {
+            // Percentiles 0, 50, 90, 99 and 100, never decreasing
+            n = sscanf(line, "%*s %lu %lu %lu %lu %lu", &v[0], &v[1], &v[2], &v[3], &v[4]);
+            if(n != SD_MODEL_POINTS) res = SD_PARERR;
+            for(idx = 0; (res == SD_OK)&&(idx != SD_MODEL_POINTS); idx++)
+            {
+                if(idx && (v[idx] < v[idx - 1])) res = SD_PARERR;
+                model->prog_us[idx] = (DWORD)v[idx];
+            }
+        }
+        else if(strcmp(key, "clock") == 0)
+        {
+            if(sscanf(line, "%*s %31s", val) != 1) res = SD_PARERR;
+            else if(strcmp(val, "wall") == 0) model->wall = TRUE;
+            else if(strcmp(val, "virtual") == 0) model->wall = FALSE;
+            else res = SD_PARERR;
+        } else {
+            for(idx = 0; (idx != sizeof(keys) / sizeof(keys[0]))&&
+                         (strcmp(key, keys[idx].key) != 0); idx++);
+            if((idx == sizeof(keys) / sizeof(keys[0]))||
+               (sscanf(line, "%*s %lu", &v[0]) != 1)) res = SD_PARERR;
+            else *(DWORD*)((BYTE*)model + keys[idx].ofs) = (DWORD)v[0];
+        }
+    }
+    fclose(fp);
+    return(res);
+}
+
+QWORD SD_Model_Us(void)
+{
+    return(sd_model_us);
+}
+#endif
+
 // «sd_io.c» is part of:
 /*----------------------------------------------------------------------------/
 /  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
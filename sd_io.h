@@ -15,50 +15,327 @@
 //#define _M_IX86           // For use with x86 architecture
 #define SD_IO_WRITE
 //#define SD_IO_WRITE_WAIT_BLOCKER
-#define SD_IO_WRITE_TIMEOUT_WAIT 250
-
-// #define SPT_SD_PRINTF
-#ifdef SPT_SD_PRINTF
-#define SD_PRINTF printf
-#else
-#define SD_PRINTF(...) ((void)0)
-#endif
+#define SD_IO_READ_TIMEOUT_WAIT 100     // Upper bound of the read access (ms)
+#define SD_IO_WRITE_TIMEOUT_WAIT 250    // Upper bound of the write busy (ms)
+#define SD_IO_ERASE_TIMEOUT_WAIT 30000  // Erase busy if the card doesn't tell it
+#define SD_IO_SPI_KHZ 12000         // Clock of SPI_Freq_High, for the NSAC timing
+//#define SD_IO_ZERO_ELIDE          // Erase all-zero sectors instead of write them
+#define SD_IO_ZERO_ELIDE_MIN 8      // Shortest run of zero sectors worth an erase
 
 //#define SD_IO_DBG_COUNT
+//#define SD_IO_CLOCK               // The port provides SPI_Clock_Us()
+//#define SD_IO_LBA64               // 64-bit sector numbers (LBA_t)
+//#define SD_IO_TRACE               // Record the operations in a ring (SD_Trace_Start)
+#define SD_IO_TRACE_SIZE 128        // Records of the trace ring (power of two)
+//#define SD_IO_DIAG                // Binary diagnostics of the driver, decoded on the host (SD_Diag_Start)
+#define SD_IO_DIAG_LEVEL 3          // Messages above this level are compiled out (SD_DIAG_*)
+#define SD_IO_DIAG_SIZE 64          // Records of the diagnostics ring (power of two)
+#define SD_IO_COW_BLOCK 8           // Sectors copied from the base image on the
+                                    // first write (x86), a block of the file system
+#define SD_IO_POLL_BYTES 8          // Bytes clocked by a wait step of SD_Poll
+//#define SD_IO_MODEL               // Timing model of the emulated card (x86, SD_Model_Start)
+//#define SD_IO_SLOTS               // Several cards on the bus, the port provides SPI_Slot()
+#define SD_IO_INIT_POLL_US 2000     // Interval of the CMD0/ACMD41 polls of a card in SD_Init_Multi
+//#define SD_IO_TUNE                // Calibration of the clock, burst and alignment (SD_Tune)
+#define SD_IO_TUNE_KHZ 25000, 16000, 12000, 8000, 4000  // Clocks tried, the port has SPI_Freq_Khz()
+#define SD_IO_TUNE_BURSTS 1, 8, 32, 128 // Sectors of the multiple block writes tried
+#define SD_IO_TUNE_ALIGNS 1, 8, 64  // Alignments of the writes tried (sectors)
+#define SD_IO_TUNE_REPS 4           // Transfers timed for each candidate
+#define SD_IO_TUNE_SLACK 5          // Percent an alignment must win by over a smaller one
+#define SD_IO_TUNE_SCRATCH 1024     // Sectors of the region of SD_Tune, the record first
 /*****************************************************************************/
 
-#if defined(_M_IX86)
-
-#include <stdio.h>
 #include "integer.h"
 
+#define SD_BLK_SIZE     512
+
+/* Sector number. 32 bits address up to 2TB, the largest SDXC card */
+#ifdef SD_IO_LBA64
+typedef QWORD LBA_t;
+#else
+typedef DWORD LBA_t;
+#endif
+
 /* Results of SD functions */
 typedef enum {
     SD_OK = 0,      /* 0: Function succeeded    */
-    SD_NOINIT       /* 1: SD not initialized    */
+    SD_NOINIT,      /* 1: SD not initialized    */
     SD_ERROR,       /* 2: Disk error            */
     SD_PARERR,      /* 3: Invalid parameter     */
     SD_BUSY,        /* 4: Programming busy      */
-    SD_REJECT       /* 5: Reject data           */
+    SD_REJECT,      /* 5: Reject data           */
+    SD_NORESPONSE,  /* 6: No response           */
+    SD_PENDING      /* 7: Operation in course   */
 } SDRESULTS;
 
+/* Steps of SD_Recover, from the lightest */
+#define SD_RECOVER_NONE     0   /* The card was healthy                     */
+#define SD_RECOVER_STOP     1   /* Stop of the transfer in course           */
+#define SD_RECOVER_RESYNC   2   /* Resync of the bus and re-select          */
+#define SD_RECOVER_INIT     3   /* Full SD_Init                             */
+
+/* Card command classes (CCC of the CSD) */
+#define SD_CCC_BASIC        (1 << 0)
+#define SD_CCC_BLOCK_READ   (1 << 2)
+#define SD_CCC_BLOCK_WRITE  (1 << 4)
+#define SD_CCC_ERASE        (1 << 5)
+#define SD_CCC_WRITE_PROT   (1 << 6)
+#define SD_CCC_LOCK_CARD    (1 << 7)
+#define SD_CCC_APP_SPEC     (1 << 8)
+#define SD_CCC_SWITCH       (1 << 10)
+
+/* Card profile, decoded from the CSD, CID, SCR and SD Status by SD_Init */
+typedef struct _SD_PROFILE {
+    /* CSD */
+    BYTE csd_ver;       /* CSD structure version (1 or 2)                   */
+    WORD ccc;           /* Card command classes (SD_CCC_*)                  */
+    DWORD taac_ns;      /* Asynchronous part of the read access (ns)        */
+    BYTE nsac;          /* Clock part of the read access (100 clocks)       */
+    BYTE r2w_factor;    /* Write time as a multiple of the read time        */
+    DWORD tran_khz;     /* Max. data transfer rate (kbit/s)                 */
+    BOOL erase_blk_en;  /* Erase of single write blocks                     */
+    BYTE sector_size;   /* Erase sector in write blocks (SDSC)              */
+    BOOL wp;            /* Permanent or temporary write protection          */
+    /* CID */
+    BYTE mid;           /* Manufacturer ID                                  */
+    char oid[3];        /* OEM/Application ID                               */
+    char pnm[6];        /* Product name                                     */
+    BYTE prv;           /* Product revision (BCD)                           */
+    DWORD psn;          /* Product serial number                            */
+    WORD year;          /* Manufacturing date                               */
+    BYTE month;
+    /* SCR and SD Status */
+    BYTE sd_spec;       /* Version: 0 1.0, 1 1.10, 2 2.00, 3 3.0x, 4 4.xx,
+                           5 and up 5.xx and later                          */
+    BYTE bus_widths;    /* SD_BUS_WIDTHS (bit 0: 1 bit, bit 2: 4 bits)      */
+    BYTE cmd_support;   /* CMD_SUPPORT (bit 1: CMD23)                       */
+    BOOL discard;       /* DISCARD_SUPPORT                                  */
+    /* Timeouts sized to the card */
+    WORD read_ms;       /* Read access, up to the data token                */
+    WORD write_ms;      /* Programming busy of a block                      */
+    WORD erase_au_ms;   /* Erase busy per AU, 0 if unknown                  */
+    WORD erase_ofs_ms;  /* Fixed part of the erase busy                     */
+} SD_PROFILE;
+
+/* Segment of a vectored transfer (SD_ReadV, SD_WriteV) */
+typedef struct _SD_IOVEC {
+    void *buf;
+    DWORD len;          /* Bytes, any size: sectors may span segments       */
+} SD_IOVEC;
+
+/* Operation in course of SD_Poll */
+typedef struct _SD_POLL {
+    BYTE state;         /* Next step, 0 if idle                             */
+    BYTE res;           /* Result of the operation (SDRESULTS)              */
+    BYTE cmd;           /* Read/write command, or the init wait command     */
+    BYTE tries;         /* Init attempts done                               */
+    BYTE ct;            /* Card type found by the init                      */
+    BYTE *dat;
+    LBA_t sector;       /* First sector                                     */
+    DWORD count;        /* Sectors of the operation                         */
+    DWORD left;         /* Sectors not transferred yet                      */
+    WORD ofs;           /* Part of the sector of a single read              */
+    WORD cnt;
+    DWORD start;        /* Start of the init (SD_Time_Us)                   */
+    DWORD until;        /* End of the wait in course (SD_IO_CLOCK)          */
+    DWORD due;          /* Next poll of an init wait (SD_Init_Multi)        */
+#ifdef SD_IO_TRACE
+    BYTE op;            /* SD_TRACE_* to record at the end, 0 if none       */
+    DWORD t0;
+#endif
+} SD_POLL;
+
+#ifdef SD_IO_TUNE
+#define SD_TUNE_WORK        4   /* Sectors of the work buffer of SD_Tune    */
+#define SD_TUNE_MAGIC       0x55544453UL    /* "SDTU", record of SD_Tune   */
+
+/* Transfer parameters of a card, found by SD_Tune */
+typedef struct _SD_TUNE {
+    BYTE mid;           /* Key: manufacturer, product and serial (CID)      */
+    char pnm[6];
+    DWORD psn;
+    DWORD khz;          /* Clock of the transfers, 0 for SPI_Freq_High      */
+    WORD burst;         /* Sectors of a multiple block write, 0 unlimited   */
+    WORD align;         /* Start of the bursts (sectors), 0 or 1 for any    */
+    DWORD read_kbs;     /* Throughput measured at the chosen point (KB/s)   */
+    DWORD write_kbs;
+} SD_TUNE;
+#endif
+
 #ifdef SD_IO_DBG_COUNT
 typedef struct _DBG_COUNT {
     WORD read;
     WORD write;
+    WORD erase;
+    DWORD saved;    /* SPI bytes of framing skipped inside sessions */
 } DBG_COUNT;
 #endif
 
+#ifdef SD_IO_TRACE
+/* Operations of a trace record */
+#define SD_TRACE_READ       1   /* SD_Read, len in bytes from ofs           */
+#define SD_TRACE_WRITE      2   /* SD_Write                                 */
+#define SD_TRACE_BLOCKS     3   /* SD_Write_Blocks, len in sectors          */
+#define SD_TRACE_STREAM     4   /* SD_Stream_Write                          */
+#define SD_TRACE_ERASE      5   /* SD_Erase, len in sectors                 */
+#define SD_TRACE_DISCARD    6   /* SD_Discard, len in sectors               */
+#define SD_TRACE_READV      7   /* SD_ReadV, len in sectors                 */
+#define SD_TRACE_WRITEV     8   /* SD_WriteV, len in sectors                */
+/* SD_Read_Start and SD_Write_Start are recorded as SD_ReadV and SD_WriteV */
+
+/* Binary dump: header, then the records from the oldest, little endian */
+#define SD_TRACE_MAGIC      0x52544453UL    /* "SDTR" */
+#define SD_TRACE_DUMP_HDR   16  /* magic, version, total records, dumped    */
+#define SD_TRACE_DUMP_REC   24  /* t_us, lat_us, sector (64 bits), len, ofs,
+                                   op, res                                  */
+#define SD_TRACE_DUMP_SIZE(n) (SD_TRACE_DUMP_HDR + (DWORD)(n) * SD_TRACE_DUMP_REC)
+
+/* One operation asked to the driver */
+typedef struct _SD_TRACE_REC {
+    DWORD t_us;         /* Start (SD_Time_Us)                               */
+    DWORD lat_us;       /* Time spent in the call                           */
+    LBA_t sector;       /* First sector                                     */
+    DWORD len;          /* Sectors, or bytes for reads                      */
+    WORD ofs;           /* Byte offset of a read                            */
+    BYTE op;            /* SD_TRACE_*                                       */
+    BYTE res;           /* SDRESULTS                                        */
+} SD_TRACE_REC;
+
+/* Ring of the last SD_IO_TRACE_SIZE operations */
+typedef struct _SD_TRACE {
+    SD_TRACE_REC rec[SD_IO_TRACE_SIZE];
+    DWORD count;        /* Records since SD_Trace_Start                     */
+} SD_TRACE;
+#endif
+
+#ifdef SD_IO_DIAG
+/* Levels of the messages */
+#define SD_DIAG_ERROR       1
+#define SD_DIAG_WARN        2
+#define SD_DIAG_INFO        3
+#define SD_DIAG_DEBUG       4
+
+/* Messages, the id of a record */
+#define SD_DIAG_CMD         1   /* Command, argument and R1 (debug)         */
+#define SD_DIAG_ATTEMPT     2   /* Init attempt (info)                      */
+#define SD_DIAG_CSD         3   /* CSD, four big endian words (info)        */
+#define SD_DIAG_CARD        4   /* Card type, OCR and last sector (info)    */
+#define SD_DIAG_INIT        5   /* Result and time of the init (info)       */
+#define SD_DIAG_TOKEN       6   /* Bad data token of a read (error)         */
+#define SD_DIAG_REJECT      7   /* Data response of a rejected write (error)*/
+#define SD_DIAG_BUSY        8   /* Timeout of the write busy, ms (warn)     */
+#define SD_DIAG_TUNE        9   /* Clock, burst, alignment, KB/s (info)     */
+#define SD_DIAG_MSGS        10
+
+/* printf formats of the messages by id, for the decoder on the host: four
+   unsigned long arguments, the ones not in the format are ignored */
+#define SD_DIAG_FORMATS {                                   \
+    "unknown message",                                      \
+    "cmd%lu arg 0x%08lX r1 0x%02lX",                        \
+    "init attempt %lu",                                     \
+    "csd %08lX %08lX %08lX %08lX",                          \
+    "card type 0x%02lX ocr 0x%08lX last sector %lu",        \
+    "init result %lu in %lu us",                            \
+    "read: data token 0x%02lX",                             \
+    "write: data response 0x%02lX",                         \
+    "write: busy after %lu ms",                             \
+    "tune: %lu kHz, bursts of %lu, alignment %lu, %lu KB/s" \
+}
+
+/* Binary dump: header, then the records from the oldest, little endian */
+#define SD_DIAG_MAGIC       0x47444453UL    /* "SDDG" */
+#define SD_DIAG_DUMP_HDR    16  /* magic, version, total records, dumped    */
+#define SD_DIAG_DUMP_REC    24  /* t_us, id, level, 2 reserved, arguments   */
+#define SD_DIAG_DUMP_SIZE(n) (SD_DIAG_DUMP_HDR + (DWORD)(n) * SD_DIAG_DUMP_REC)
+#define SD_DIAG_ARGS        4
+
+/* One message: the id of its format and the arguments, not formatted */
+typedef struct _SD_DIAG_REC {
+    DWORD t_us;         /* SD_Time_Us                                       */
+    BYTE id;            /* SD_DIAG_CMD...                                   */
+    BYTE level;         /* SD_DIAG_ERROR...                                 */
+    DWORD arg[SD_DIAG_ARGS];
+} SD_DIAG_REC;
+
+/* Ring of the last SD_IO_DIAG_SIZE messages */
+typedef struct _SD_DIAG {
+    SD_DIAG_REC rec[SD_IO_DIAG_SIZE];
+    DWORD count;        /* Records since SD_Diag_Start                      */
+} SD_DIAG;
+#endif
+
+#if defined(_M_IX86)
+
+#include <stdio.h>
+
+#ifdef SD_IO_MODEL
+#define SD_MODEL_POINTS     5   /* Points of the busy distribution          */
+
+/*
+ * Timing of the emulated card. The time of each operation is the time of its
+ * commands, of its bytes at the SPI clock, the read access of each block read
+ * and a busy drawn for each block written: prog_us are the percentiles 0, 50,
+ * 90, 99 and 100 of the busy, interpolated, and one block in a million of
+ * gc_ppm stalls gc_us more (garbage collection of the card).
+ */
+typedef struct _SD_MODEL {
+    DWORD cmd_us;       /* Command, up to its response                      */
+    DWORD read_us;      /* Read access, up to the data token                */
+    DWORD spi_khz;      /* Bus clock, 0 for bytes without time              */
+    DWORD prog_us[SD_MODEL_POINTS]; /* Busy of a block written              */
+    DWORD gc_ppm;       /* Blocks per million with a stall                  */
+    DWORD gc_us;        /* Length of a stall                                */
+    DWORD erase_us;     /* Busy of an erase or a discard                    */
+    DWORD init_us;      /* SD_Init (ACMD41 loop and registers)              */
+    BOOL wall;          /* Sleep the time, else advance the virtual clock   */
+    DWORD seed;         /* State of the draws                               */
+} SD_MODEL;
+#endif
+
+/* Extent of an image file known to be data or hole */
+typedef struct _SD_EXTENT {
+    QWORD start;
+    QWORD end;          /* Exclusive, 0 if nothing is known */
+    BOOL hole;
+} SD_EXTENT;
+
 /* SD device object */
 typedef struct _SD_DEV {
     BOOL mount;
     BYTE cardtype;
     char fn[20]; /* dd if=/dev/zero of=sim_sd.raw bs=1k count=0 seek=8192 */
     FILE *fp;
-    DWORD last_sector;
+    const char *base;   /* Read-only image under fn, NULL if none. The holes
+                           of fn read from it and fn is created if missing */
+    FILE *bfp;          /* Base image */
+    SD_EXTENT ext[2];   /* Last extent looked up of fn and of the base */
+    BOOL dirty;         /* fp may hold writes not passed to the file */
+    LBA_t last_sector;
+    BOOL erase_zero;    /* Erased sectors read back as 0x00 */
+    DWORD au_size;      /* Allocation unit in sectors       */
+    BYTE speed_class;   /* Speed class (0, 2, 4, 6 or 10)   */
+    BOOL stream;        /* Multiple block write is open     */
+    LBA_t stream_next;  /* Next sector of the open write    */
+    BYTE recover;       /* Step of the last SD_Recover      */
+    DWORD recover_us;   /* Time of the last SD_Recover (us) */
+    DWORD init_us;      /* Time of the last SD_Init (us)    */
+#ifdef SD_IO_TUNE
+    SD_TUNE tune;       /* Parameters of SD_Tune            */
+#endif
+    SD_PROFILE profile; /* Card profile                     */
+    SD_POLL poll;       /* Operation of SD_Poll             */
 #ifdef SD_IO_DBG_COUNT
     DBG_COUNT debug;
 #endif
+#ifdef SD_IO_TRACE
+    SD_TRACE *trace;    /* Trace ring, NULL to record nothing */
+#endif
+#ifdef SD_IO_DIAG
+    SD_DIAG *diag;      /* Diagnostics ring, NULL to record nothing */
+#endif
+#ifdef SD_IO_MODEL
+    SD_MODEL *model;    /* Timing model, NULL for none */
+#endif
 } SD_DEV;
 
 #else // For use with uControllers
@@ -68,18 +345,37 @@ typedef struct _SD_DEV {
 /* Definitions of SD commands */
 #define CMD0    (0x40+0)        /* GO_IDLE_STATE            */
 #define CMD1    (0x40+1)        /* SEND_OP_COND (MMC)       */
+#define ACMD13  (0xC0+13)       /* SD_STATUS                */
+#define ACMD23  (0xC0+23)       /* SET_WR_BLK_ERASE_COUNT   */
 #define ACMD41  (0xC0+41)       /* SEND_OP_COND (SDC)       */
+#define ACMD51  (0xC0+51)       /* SEND_SCR                 */
 #define CMD8    (0x40+8)        /* SEND_IF_COND             */
 #define CMD9    (0x40+9)        /* SEND_CSD                 */
+#define CMD10   (0x40+10)       /* SEND_CID                 */
+#define CMD12   (0x40+12)       /* STOP_TRANSMISSION        */
+#define CMD13   (0x40+13)       /* SEND_STATUS              */
 #define CMD16   (0x40+16)       /* SET_BLOCKLEN             */
 #define CMD17   (0x40+17)       /* READ_SINGLE_BLOCK        */
+#define CMD18   (0x40+18)       /* READ_MULTIPLE_BLOCK      */
 #define CMD24   (0x40+24)       /* WRITE_SINGLE_BLOCK       */
+#define CMD25   (0x40+25)       /* WRITE_MULTIPLE_BLOCK     */
+#define CMD32   (0x40+32)       /* ERASE_WR_BLK_START       */
+#define CMD33   (0x40+33)       /* ERASE_WR_BLK_END         */
+#define CMD38   (0x40+38)       /* ERASE                    */
 #define CMD42   (0x40+42)       /* LOCK_UNLOCK              */
 #define CMD55   (0x40+55)       /* APP_CMD                  */
 #define CMD58   (0x40+58)       /* READ_OCR                 */
 #define CMD59   (0x40+59)       /* CRC_ON_OFF               */
 
+/* Arguments of CMD38 */
+#define SD_ERASE_ARG    0x00000000              /* Erase            */
+#define SD_DISCARD_ARG  0x00000001              /* Discard          */
+
+/* Largest block count of ACMD23, a 23 bits field */
+#define SD_ACMD23_MAX   0x007FFFFFUL
+
 #define SD_INIT_TRYS    0x03
+#define SD_RELEASE_BYTES 10     /* Bytes clocked by SPI_Release (statistics) */
 
 /* CardType) */
 #define SDCT_MMC        0x01                    /* MMC version 3    */
@@ -88,35 +384,38 @@ typedef struct _SD_DEV {
 #define SDCT_SDC        (SDCT_SD1|SDCT_SD2)     /* SD               */
 #define SDCT_BLOCK      0x08                    /* Block addressing */
 
-#define SD_BLK_SIZE     512
-
-/* Results of SD functions */
-typedef enum {
-    SD_OK = 0,      /* 0: Function succeeded    */
-    SD_NOINIT,      /* 1: SD not initialized    */
-    SD_ERROR,       /* 2: Disk error            */
-    SD_PARERR,      /* 3: Invalid parameter     */
-    SD_BUSY,        /* 4: Programming busy      */
-    SD_REJECT,      /* 5: Reject data           */
-    SD_NORESPONSE   /* 6: No response           */
-} SDRESULTS;
-
-#ifdef SD_IO_DBG_COUNT
-typedef struct _DBG_COUNT {
-    WORD read;
-    WORD write;
-} DBG_COUNT;
-#endif
-
-
 /* SD device object */
 typedef struct _SD_DEV {
     BOOL mount;
     BYTE cardtype;
-    DWORD last_sector;
+    LBA_t last_sector;
+    BOOL erase_zero;    /* Erased sectors read back as 0x00 (SCR) */
+    DWORD au_size;      /* Allocation unit in sectors (ACMD13), 0 if unknown */
+    BYTE speed_class;   /* Speed class (0, 2, 4, 6 or 10) (ACMD13) */
+    BOOL stream;        /* Multiple block write (CMD25) is open */
+    LBA_t stream_next;  /* Next sector of the open write */
+    BOOL session;       /* Card kept selected (SD_Begin) */
+    WORD status;        /* Last R2 of CMD13, R1 in the high byte */
+    BYTE recover;       /* Step of the last SD_Recover (SD_RECOVER_*) */
+    DWORD recover_us;   /* Time of the last SD_Recover (us) */
+    DWORD init_us;      /* Time of the last SD_Init (us) */
+#ifdef SD_IO_TUNE
+    SD_TUNE tune;       /* Parameters of SD_Tune, kept by SD_Init for the same card */
+#endif
+#ifdef SD_IO_SLOTS
+    BYTE slot;          /* Chip select of the card (SPI_Slot) */
+#endif
+    SD_PROFILE profile; /* CSD, CID and SCR of the card */
+    SD_POLL poll;       /* Operation of SD_Poll (SD_Init_Start...) */
 #ifdef SD_IO_DBG_COUNT
     DBG_COUNT debug;
 #endif
+#ifdef SD_IO_TRACE
+    SD_TRACE *trace;    /* Trace ring, NULL to record nothing */
+#endif
+#ifdef SD_IO_DIAG
+    SD_DIAG *diag;      /* Diagnostics ring, NULL to record nothing */
+#endif
 } SD_DEV;
 
 #endif
@@ -127,34 +426,313 @@ typedef struct _SD_DEV {
 
 /**
     \brief Initialization the SD card.
-    \return If all goes well returns SD_OK.
+    \return If all goes well returns SD_OK. The time spent is in
+            dev->init_us.
+    \note dev must be zeroed before the first call, then the optional fields
+          set (fn, base, trace, diag, slot).
  */
 SDRESULTS SD_Init (SD_DEV *dev);
 
+#if defined(_M_IX86) || defined(SD_IO_SLOTS)
+/**
+    \brief Initialization of several cards at once, each one in the slot of
+           dev[i].slot. The power up, CMD0, CMD8 and ACMD41 waits of the cards
+           are interleaved: each step goes to the card due first and a card
+           waiting for its ACMD41 is polled every SD_IO_INIT_POLL_US, so the
+           whole takes about the time of the slowest card. Without
+           SD_IO_CLOCK, and under _M_IX86, the cards are initialized one
+           after the other.
+    \param dev Array of count devices.
+    \param res Result of each card, NULL if not needed.
+    \return SD_OK if all the cards are mounted, else the first error. The
+            time of each card is in dev[i].init_us.
+ */
+SDRESULTS SD_Init_Multi (SD_DEV *dev, BYTE count, SDRESULTS *res);
+#endif
+
 /**
     \brief Read a single block.
     \param dest Pointer to the destination object to put data
-    \param sector Start sector number (internally is converted to byte address).
+    \param sector Start sector number (converted to byte address on SDSC cards).
     \param ofs Byte offset in the sector (0..511).
     \param cnt Byte count (1..512).
     \return If all goes well returns SD_OK.
  */
-SDRESULTS SD_Read (SD_DEV *dev, void *dat, DWORD sector, WORD ofs, WORD cnt);
+SDRESULTS SD_Read (SD_DEV *dev, void *dat, LBA_t sector, WORD ofs, WORD cnt);
 
 /**
     \brief Write a single block.
     \param dat Data to write.
-    \param sector Sector number to write (internally is converted to byte address).
+    \param sector Sector number to write (converted to byte address on SDSC cards).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Write (SD_DEV *dev, void *dat, LBA_t sector);
+
+/**
+    \brief Write consecutive blocks (CMD25).
+    \param dat Data to write, count * SD_BLK_SIZE bytes.
+    \param sector First sector number to write.
+    \param count Number of sectors to write.
+    \return If all goes well returns SD_OK.
+    \note With SD_IO_ZERO_ELIDE runs of all-zero sectors are erased instead of
+          written when the card reads erased sectors back as zero.
+ */
+SDRESULTS SD_Write_Blocks (SD_DEV *dev, void *dat, LBA_t sector, DWORD count);
+
+/**
+    \brief Read consecutive sectors into a vector of segments (CMD18). The
+           bytes of the segments, in order, map onto the sectors from the
+           first one, straight from the bus into each segment.
+    \param iov Segments, the sum of their lengths a multiple of SD_BLK_SIZE.
+    \param cnt Number of segments.
+    \param sector First sector to read.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_ReadV (SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector);
+
+/**
+    \brief Write consecutive sectors from a vector of segments (CMD25), as
+           SD_ReadV.
     \return If all goes well returns SD_OK.
  */
-SDRESULTS SD_Write (SD_DEV *dev, void *dat, DWORD sector);
+SDRESULTS SD_WriteV (SD_DEV *dev, const SD_IOVEC *iov, WORD cnt, LBA_t sector);
 
 /**
-    \brief Allows know status of SD card.
+    \brief Open a multiple block write (CMD25). Until SD_Stream_End the card
+           only accepts SD_Stream_Write.
+    \param sector First sector to write.
+    \param count Expected number of sectors, to pre-erase (ACMD23). Zero if
+           unknown.
     \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Stream_Begin (SD_DEV *dev, LBA_t sector, DWORD count);
+
+/**
+    \brief Write the next block of the open multiple block write.
+    \param dat Data to write.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Stream_Write (SD_DEV *dev, void *dat);
+
+/**
+    \brief Close the multiple block write (Stop Tran token).
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Stream_End (SD_DEV *dev);
+
+/**
+    \brief Erase a range of sectors (CMD32, CMD33 and CMD38).
+    \param first First sector to erase.
+    \param last Last sector to erase (inclusive).
+    \return If all goes well returns SD_OK. Erased sectors read back as zero
+            when dev->erase_zero is TRUE, otherwise as 0xFF.
+    \note Without ERASE_BLK_EN only the whole erase groups (SECTOR_SIZE) of
+          the range are erased, the other sectors are written.
+ */
+SDRESULTS SD_Erase (SD_DEV *dev, LBA_t first, LBA_t last);
+
+/**
+    \brief Tell the card that a range of sectors is no longer in use.
+    \param first First sector to discard.
+    \param last Last sector to discard (inclusive).
+    \return If all goes well returns SD_OK. The content of discarded sectors is
+            undefined, use SD_Erase when it must read back erased.
+ */
+SDRESULTS SD_Discard (SD_DEV *dev, LBA_t first, LBA_t last);
+
+/**
+    \brief Allows know status of SD card. Asks the card status (CMD13), so it
+           doesn't reset the card and it's cheap enough for periodic polling.
+    \return If all goes well returns SD_OK. SD_NOINIT if the card went back
+            to the idle state, SD_ERROR if it reports an error (the R2 is in
+            dev->status), SD_BUSY inside a multiple block write and
+            SD_NORESPONSE if there is no card.
 */
 SDRESULTS SD_Status (SD_DEV *dev);
 
+/**
+    \brief Bring the card back to the transfer state after an error. Climbs a
+           ladder and stops at the first step after which SD_Status is OK:
+           stop the transfer in course (stop tran token and CMD12), resync
+           the bus (wait for the busy, 80 clocks deselected and re-select)
+           and, at last, a full SD_Init (that also ends the session).
+    \return If all goes well returns SD_OK. The step used is in
+            dev->recover and the time spent in dev->recover_us.
+ */
+SDRESULTS SD_Recover (SD_DEV *dev);
+
+/**
+    \brief Begin a session: the card stays selected until SD_End, so the
+           operations in between skip the deselect/select framing of each
+           command and the SPI_Release after reads and erases.
+    \return If all goes well returns SD_OK.
+    \note Don't share the SPI bus with other devices inside a session.
+ */
+SDRESULTS SD_Begin (SD_DEV *dev);
+
+/**
+    \brief End a session: deselect the card and release the bus.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_End (SD_DEV *dev);
+
+/*******************************************************************************
+ * Public Methods - Resumable operations                                       *
+ ******************************************************************************/
+
+/*
+ * An operation started by SD_*_Start runs in steps of SD_Poll, none of them
+ * longer than one bus transaction: a command and its response, a data block,
+ * or up to SD_IO_POLL_BYTES bytes of a wait (ACMD41 idle, data token, write
+ * busy). The waits are timed across the steps by SD_Time_Us, or by
+ * SPI_Timer_* without SD_IO_CLOCK (then one device at a time). Between steps
+ * the bus is free for other work, but not for other calls to the driver on
+ * the same device: one operation at a time. Under _M_IX86 the operation
+ * runs whole in SD_*_Start and SD_Poll only returns its result.
+ */
+
+/**
+    \brief Start SD_Init, abandoning the operation in course if any.
+    \return SD_OK.
+ */
+SDRESULTS SD_Init_Start (SD_DEV *dev);
+
+/**
+    \brief Start the read of consecutive whole sectors (CMD17/CMD18).
+    \param dat Destination, count * SD_BLK_SIZE bytes.
+    \return SD_OK if started, SD_BUSY if an operation is in course, SD_PARERR
+            if the range is out of the card.
+ */
+SDRESULTS SD_Read_Start (SD_DEV *dev, void *dat, LBA_t sector, DWORD count);
+
+/**
+    \brief Start the write of consecutive sectors (CMD24/CMD25), as
+           SD_Read_Start.
+ */
+SDRESULTS SD_Write_Start (SD_DEV *dev, void *dat, LBA_t sector, DWORD count);
+
+/**
+    \brief Run one step of the operation in course.
+    \return SD_PENDING while it runs, then its result (SD_OK if there was
+            none).
+ */
+SDRESULTS SD_Poll (SD_DEV *dev);
+
+/**
+    \brief Free running microseconds counter (SPI_Clock_Us on uControllers).
+    \return Microseconds, wraps around at 2^32. Always zero without
+            SD_IO_CLOCK. Under _M_IX86 with SD_IO_MODEL it includes the
+            virtual time of the models (SD_Model_Us).
+ */
+DWORD SD_Time_Us (void);
+
+#ifdef SD_IO_TUNE
+/**
+    \brief Calibrate the card: time writes and reads across the clocks of
+           SD_IO_TUNE_KHZ (up to TRAN_SPEED, the data checked), then the
+           bursts of SD_IO_TUNE_BURSTS and the alignments of
+           SD_IO_TUNE_ALIGNS, keep the best ones in dev->tune and store
+           them in a record at the first sector. The clock is only tried on
+           uControllers. SD_Write_Blocks splits its writes in the bursts
+           found.
+    \param first Region of SD_IO_TUNE_SCRATCH sectors, its data is lost.
+    \param work Buffer of SD_TUNE_WORK sectors.
+    \return If all goes well returns SD_OK. SD_ERROR if no clock gives the
+            data back.
+ */
+SDRESULTS SD_Tune (SD_DEV *dev, LBA_t first, void *work);
+
+/**
+    \brief Take the record of SD_Tune, if it's of this card, instead of a
+           new calibration.
+    \param first Region given to SD_Tune.
+    \param work Buffer of SD_TUNE_WORK sectors.
+    \return SD_OK if it's taken, SD_ERROR if there is no record of the card.
+ */
+SDRESULTS SD_Tune_Load (SD_DEV *dev, LBA_t first, void *work);
+
+/**
+    \brief Take parameters kept elsewhere (a copy of dev->tune), if they are
+           of this card. SD_Init keeps them while the card is the same.
+    \return SD_OK if they are taken, SD_ERROR if they are of another card.
+    \note The clock is of the bus: the cards of SD_IO_SLOTS share the last
+          one set.
+ */
+SDRESULTS SD_Tune_Set (SD_DEV *dev, const SD_TUNE *tune);
+#endif
+
+#if defined(_M_IX86) && defined(SD_IO_MODEL)
+/**
+    \brief Time the operations of an emulated card with a model, from the
+           next one (SD_Init included).
+    \param model Timing model, NULL to stop.
+ */
+void SD_Model_Start (SD_DEV *dev, SD_MODEL *model);
+
+/**
+    \brief Load a profile of a card: lines "key value", '#' comments, with
+           the keys named as the fields of SD_MODEL ("clock virtual|wall").
+           The keys not given keep the default model.
+    \param fn Profile, NULL for the default model.
+    \return If all goes well returns SD_OK. SD_ERROR if the file can't be
+            read, SD_PARERR on an unknown key or a bad value.
+ */
+SDRESULTS SD_Model_Load (SD_MODEL *model, const char *fn);
+
+/**
+    \brief Virtual time added by the models since the start of the program.
+ */
+QWORD SD_Model_Us (void);
+#endif
+
+/**
+    \brief Store a 32 bits value in little endian, as the dumps and the
+           on-card records of the driver and its layers keep it.
+ */
+void SD_Put32 (BYTE *p, DWORD v);
+
+/**
+    \brief Load a 32 bits value stored by SD_Put32.
+ */
+DWORD SD_Get32 (const BYTE *p);
+
+#ifdef SD_IO_TRACE
+/**
+    \brief Start to record the reads, writes and erases of a device in a
+           ring, from empty. Latencies need SD_IO_CLOCK on uControllers.
+    \param trace Ring of the records, NULL to stop.
+ */
+void SD_Trace_Start (SD_DEV *dev, SD_TRACE *trace);
+
+/**
+    \brief Serialize the ring (SD_TRACE_DUMP_*), to send it or store it.
+    \param dat Output buffer, max bytes. SD_TRACE_DUMP_SIZE(SD_IO_TRACE_SIZE)
+           holds a full ring, a smaller one gets the newest records.
+    \return Bytes written in dat.
+ */
+DWORD SD_Trace_Dump (const SD_TRACE *trace, void *dat, DWORD max);
+#endif
+
+#ifdef SD_IO_DIAG
+/**
+    \brief Start to record the messages of the driver for a device, up to
+           SD_IO_DIAG_LEVEL, in a ring, from empty. Nothing is formatted on
+           the target: a record keeps the id of the message and its
+           arguments.
+    \param diag Ring of the records, NULL to stop.
+ */
+void SD_Diag_Start (SD_DEV *dev, SD_DIAG *diag);
+
+/**
+    \brief Serialize the ring (SD_DIAG_DUMP_*), to decode it on the host
+           (tools/sd_diag.c).
+    \param dat Output buffer, max bytes. SD_DIAG_DUMP_SIZE(SD_IO_DIAG_SIZE)
+           holds a full ring, a smaller one gets the newest records.
+    \return Bytes written in dat.
+ */
+DWORD SD_Diag_Dump (const SD_DIAG *diag, void *dat, DWORD max);
+#endif
+
 #endif
 
 // «sd_io.h» is part of:
@@ -0,0 +1,345 @@
+/*
+ *  File: sd_log.c
+ *  License at the end of file.
+ */
+
+#include "sd_log.h"
+#include <string.h>
+
+#define SD_LOG_CKPT_MAGIC   0x434C4453UL    /* "SDLC" */
+
+/******************************************************************************
+ Private Methods Prototypes - Append-only log
+******************************************************************************/
+
+/**
+    \brief Store a sector number in 64 bits, little endian.
+ */
+void __SD_Log_Put_LBA(BYTE *p, LBA_t v);
+
+/**
+    \brief Load a sector number stored in 64 bits, little endian.
+ */
+LBA_t __SD_Log_Get_LBA(const BYTE *p);
+
+/**
+    \brief Close the active buffer: fill the header and queue it.
+ */
+void __SD_Log_Seal(SD_LOG *log);
+
+#ifdef SD_LOG_DEFERRED
+/**
+    \brief Payload bytes the producer can take now, in the buffers that
+           aren't waiting for SD_Log_Service.
+ */
+WORD __SD_Log_Room(SD_LOG *log);
+#endif
+
+/**
+    \brief Write a sealed sector at the head, opening the multiple block write
+           if needed.
+    \param dat Sector to write.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Log_Put_Sector(SD_LOG *log, BYTE *dat);
+
+/**
+    \brief Close the multiple block write and save the head in the next
+           checkpoint slot, built in the scratch sector.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Log_Checkpoint(SD_LOG *log);
+
+/**
+    \brief Checksum of a checkpoint: sum of its first nine words.
+ */
+DWORD __SD_Log_Sum(const BYTE *ckpt);
+
+/**
+    \brief Load the newest valid checkpoint of the region.
+    \return TRUE if found, then head, seq and ckpt of the log are loaded.
+ */
+BOOL __SD_Log_Load(SD_LOG *log);
+
+/******************************************************************************
+ Private Methods - Append-only log
+******************************************************************************/
+
+void __SD_Log_Put_LBA(BYTE *p, LBA_t v)
+{
+    SD_Put32(p, (DWORD)v);
+    SD_Put32(p + 4, (DWORD)((QWORD)v >> 32));
+}
+
+LBA_t __SD_Log_Get_LBA(const BYTE *p)
+{
+    return((LBA_t)(SD_Get32(p) | ((QWORD)SD_Get32(p + 4) << 32)));
+}
+
+void __SD_Log_Seal(SD_LOG *log)
+{
+    BYTE *hdr = log->buf[log->active];
+    hdr[0] = (BYTE)(SD_LOG_MAGIC);
+    hdr[1] = (BYTE)(SD_LOG_MAGIC >> 8);
+    hdr[2] = (BYTE)(log->used);
+    hdr[3] = (BYTE)(log->used >> 8);
+    SD_Put32(hdr + 4, log->seq++);
+    log->pending |= (BYTE)(1 << log->active);
+    log->active ^= 1;
+    log->used = 0;
+}
+
+#ifdef SD_LOG_DEFERRED
+WORD __SD_Log_Room(SD_LOG *log)
+{
+    WORD room = 0;
+    BYTE pending = log->pending;
+    if(!(pending & (1 << log->active))) room += SD_LOG_PAYLOAD - log->used;
+    if(!(pending & (1 << (log->active ^ 1)))) room += SD_LOG_PAYLOAD;
+    return(room);
+}
+#endif
+
+SDRESULTS __SD_Log_Put_Sector(SD_LOG *log, BYTE *dat)
+{
+    SDRESULTS res;
+    SD_DEV *dev = log->dev;
+    if(log->head > log->last) return(SD_PARERR);
+    // The whole rest of the region is the pre-erase hint
+    if(dev->stream == FALSE)
+    {
+        res = SD_Stream_Begin(dev, log->head, log->last - log->head + 1);
+        if(res != SD_OK) return(res);
+    }
+    res = SD_Stream_Write(dev, dat);
+    if(res != SD_OK) return(res);
+    log->head_seq = SD_Get32(dat + 4) + 1;
+    log->head++;
+    log->since_ckpt++;
+    log->stats.sectors++;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Log_Checkpoint(SD_LOG *log)
+{
+    SDRESULTS res;
+    BYTE *scratch = log->scratch;
+    res = SD_Stream_End(log->dev);
+    if(res != SD_OK) return(res);
+    memset(scratch, 0, SD_BLK_SIZE);
+    SD_Put32(scratch +  0, SD_LOG_CKPT_MAGIC);
+    __SD_Log_Put_LBA(scratch +  4, log->first);
+    __SD_Log_Put_LBA(scratch + 12, log->last);
+    __SD_Log_Put_LBA(scratch + 20, log->head);
+    SD_Put32(scratch + 28, log->head_seq);
+    SD_Put32(scratch + 32, log->ckpt);
+    SD_Put32(scratch + 36, __SD_Log_Sum(scratch));
+    // Slots alternate, a torn checkpoint leaves the previous one valid
+    res = SD_Write(log->dev, scratch, log->first + (log->ckpt & 1));
+    if(res != SD_OK) return(res);
+    log->ckpt++;
+    log->since_ckpt = 0;
+    log->stats.checkpoints++;
+    return(SD_OK);
+}
+
+DWORD __SD_Log_Sum(const BYTE *ckpt)
+{
+    DWORD sum = 0;
+    BYTE idx;
+    for(idx=0; idx!=36; idx+=4) sum += SD_Get32(ckpt + idx);
+    return(sum);
+}
+
+BOOL __SD_Log_Load(SD_LOG *log)
+{
+    BYTE *scratch = log->scratch;
+    BYTE slot;
+    BOOL found = FALSE;
+    DWORD ckpt;
+    for(slot=0; slot!=2; slot++)
+    {
+        if(SD_Read(log->dev, scratch, log->first + slot, 0, 40) != SD_OK) continue;
+        if((SD_Get32(scratch) != SD_LOG_CKPT_MAGIC)||
+           (__SD_Log_Get_LBA(scratch + 4) != log->first)||
+           (__SD_Log_Get_LBA(scratch + 12) != log->last)||
+           (SD_Get32(scratch + 36) != __SD_Log_Sum(scratch))) continue;
+        ckpt = SD_Get32(scratch + 32);
+        if(found && (ckpt < log->ckpt)) continue;
+        found = TRUE;
+        log->head = __SD_Log_Get_LBA(scratch + 20);
+        log->seq = SD_Get32(scratch + 28);
+        log->ckpt = ckpt;
+    }
+    if(found) log->ckpt++;
+    return(found);
+}
+
+/******************************************************************************
+ Public Methods - Append-only log
+******************************************************************************/
+
+SDRESULTS SD_Log_Open(SD_LOG *log, SD_DEV *dev, LBA_t first, LBA_t last, void *bufs)
+{
+    SDRESULTS res;
+    BYTE hdr[SD_LOG_HDR];
+    if(dev->mount == FALSE) return(SD_NOINIT);
+    if((bufs == NULL)||(last > dev->last_sector)||(last < first + 2)) return(SD_PARERR);
+    memset(log, 0, sizeof(SD_LOG));
+    log->dev = dev;
+    log->first = first;
+    log->last = last;
+    log->buf[0] = (BYTE*)bufs;
+    log->buf[1] = (BYTE*)bufs + SD_BLK_SIZE;
+    log->scratch = (BYTE*)bufs + 2 * SD_BLK_SIZE;
+    if(__SD_Log_Load(log))
+    {
+        // Recovery: walk the sectors written after the checkpoint
+        while(log->head <= log->last)
+        {
+            if(SD_Read(dev, hdr, log->head, 0, SD_LOG_HDR) != SD_OK) break;
+            if((hdr[0] != (BYTE)SD_LOG_MAGIC)||(hdr[1] != (BYTE)(SD_LOG_MAGIC >> 8))||
+               (SD_Get32(hdr + 4) != log->seq)) break;
+            log->head++;
+            log->seq++;
+        }
+        log->head_seq = log->seq;
+        return(SD_OK);
+    }
+    // New log: preallocate the region, stale sectors can't be recovered then
+    log->head = first + 2;
+    log->seq = 1;
+    res = SD_Erase(dev, log->head, last);
+    if(res == SD_ERROR)
+    {
+        // No erase (MMC, no erase class): plain writes over the old sectors,
+        // numbered on from a stale log at the head so none of them matches
+        if((SD_Read(dev, hdr, log->head, 0, SD_LOG_HDR) == SD_OK)&&
+           (hdr[0] == (BYTE)SD_LOG_MAGIC)&&(hdr[1] == (BYTE)(SD_LOG_MAGIC >> 8)))
+            log->seq = SD_Get32(hdr + 4) + 1;
+        res = SD_OK;
+    }
+    if(res != SD_OK) return(res);
+    log->head_seq = log->seq;
+    return(__SD_Log_Checkpoint(log));
+}
+
+SDRESULTS SD_Log_Append(SD_LOG *log, const void *dat, WORD len)
+{
+    SDRESULTS res = SD_OK;
+    const BYTE *src = (const BYTE*)dat;
+    DWORD t0, dt;
+    WORD n;
+    t0 = SD_Time_Us();
+    if(log->stats.bytes == 0) log->stats.t_first = t0;
+#ifdef SD_LOG_DEFERRED
+    // All or nothing: the caller can't retry a record taken in part. Up to
+    // a payload always fits once SD_Log_Service empties the sealed buffers
+    if(len > SD_LOG_PAYLOAD) return(SD_PARERR);
+    if(len > __SD_Log_Room(log))
+    {
+        log->stats.overflows++;
+        return(SD_BUSY);
+    }
+#endif
+    while(len)
+    {
+#ifndef SD_LOG_DEFERRED
+        // Both buffers are sealed
+        if(log->pending & (1 << log->active))
+        {
+            res = SD_Log_Service(log);
+            if(res != SD_OK) return(res);
+        }
+#endif
+        n = SD_LOG_PAYLOAD - log->used;
+        if(n > len) n = len;
+        memcpy(log->buf[log->active] + SD_LOG_HDR + log->used, src, n);
+        log->used += n;
+        log->stats.bytes += n;
+        src += n;
+        len -= n;
+        if(log->used == SD_LOG_PAYLOAD) __SD_Log_Seal(log);
+    }
+#ifndef SD_LOG_DEFERRED
+    res = SD_Log_Service(log);
+#endif
+    dt = SD_Time_Us() - t0;
+    if(dt > log->stats.worst_us) log->stats.worst_us = dt;
+    log->stats.t_last = t0 + dt;
+    return(res);
+}
+
+SDRESULTS SD_Log_Service(SD_LOG *log)
+{
+    SDRESULTS res;
+    BYTE out;
+    while(log->pending & (1 << log->next_out))
+    {
+        out = log->next_out;
+        res = __SD_Log_Put_Sector(log, log->buf[out]);
+        if(res != SD_OK) return(res);
+        // Sent: the producer may fill it again from now on
+        SD_LOG_LOCK();
+        log->pending &= (BYTE)~(1 << out);
+        SD_LOG_UNLOCK();
+        log->next_out ^= 1;
+        if(log->since_ckpt >= SD_LOG_CHECKPOINT)
+        {
+            res = __SD_Log_Checkpoint(log);
+            if(res != SD_OK) return(res);
+        }
+    }
+    return(SD_OK);
+}
+
+SDRESULTS SD_Log_Sync(SD_LOG *log)
+{
+    SDRESULTS res;
+    SD_LOG_LOCK();
+    if(log->used && !(log->pending & (1 << log->active))) __SD_Log_Seal(log);
+    SD_LOG_UNLOCK();
+    res = SD_Log_Service(log);
+    if(res != SD_OK) return(res);
+    return(__SD_Log_Checkpoint(log));
+}
+
+SDRESULTS SD_Log_Get(SD_LOG *log, DWORD n, void *dat, WORD *len)
+{
+    SDRESULTS res;
+    BYTE hdr[SD_LOG_HDR];
+    LBA_t sector = log->first + 2 + n;
+    if((n > log->last - log->first - 2)||(sector >= log->head)) return(SD_PARERR);
+    // The card can't read inside a multiple block write
+    res = SD_Stream_End(log->dev);
+    if(res == SD_OK) res = SD_Read(log->dev, hdr, sector, 0, SD_LOG_HDR);
+    if(res != SD_OK) return(res);
+    *len = (WORD)hdr[2] | ((WORD)hdr[3] << 8);
+    if((*len == 0)||(*len > SD_LOG_PAYLOAD)) return(SD_ERROR);
+    return(SD_Read(log->dev, dat, sector, SD_LOG_HDR, *len));
+}
+
+DWORD SD_Log_Rate(SD_LOG *log)
+{
+    DWORD elapsed = log->stats.t_last - log->stats.t_first;
+    if(elapsed == 0) return(0);
+    return((DWORD)(((QWORD)log->stats.bytes * 1000000UL) / elapsed));
+}
+
+// «sd_log.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
@@ -0,0 +1,146 @@
+/*
+ *  File: sd_log.h
+ *  License at the end of file.
+ */
+
+#ifndef _SD_LOG_H_
+#define _SD_LOG_H_
+
+#include "sd_io.h"
+
+/*****************************************************************************/
+/* Configurations                                                            */
+/*****************************************************************************/
+#define SD_LOG_CHECKPOINT   256     // Sectors between checkpoints of the head
+//#define SD_LOG_DEFERRED           // SD_Log_Append only fills the buffers, the
+                                    // caller runs SD_Log_Service (ISR producer)
+#ifndef SD_LOG_LOCK
+#define SD_LOG_LOCK()               // Mask the producer while the main loop
+#define SD_LOG_UNLOCK()             // updates the buffer state (SD_LOG_DEFERRED)
+#endif
+/*****************************************************************************/
+
+/*
+ * Layout of the region [first, last]:
+ * - first, first+1: checkpoints (written alternately), the newest is valid.
+ * - first+2 .. last: data sectors, each one with a header of SD_LOG_HDR
+ *   bytes (magic, bytes used and sequence number) and the payload.
+ */
+#define SD_LOG_HDR          8
+#define SD_LOG_PAYLOAD      (SD_BLK_SIZE - SD_LOG_HDR)
+#define SD_LOG_MAGIC        0x474C  /* "LG" */
+
+/* Storage for SD_Log_Open: the double buffer and the checkpoint sector */
+#define SD_LOG_BUFS         (3 * SD_BLK_SIZE)
+
+/* Performance figures of the log */
+typedef struct _SD_LOG_STATS {
+    DWORD bytes;        /* Payload bytes appended                           */
+    DWORD sectors;      /* Data sectors written                             */
+    DWORD checkpoints;  /* Checkpoints written                              */
+    DWORD overflows;    /* Appends refused for lack of free buffers         */
+    DWORD t_first;      /* Time of the first append (us)                    */
+    DWORD t_last;       /* Time of the end of the last append (us)          */
+    DWORD worst_us;     /* Worst-case latency of SD_Log_Append (us)         */
+} SD_LOG_STATS;
+
+/*
+ * Log writer object. With SD_LOG_DEFERRED the producer (SD_Log_Append) owns
+ * the active buffer and seals it; the main loop (SD_Log_Service, SD_Log_Sync)
+ * owns the sealed ones until it clears their pending bit, and changes the
+ * volatile fields only between SD_LOG_LOCK and SD_LOG_UNLOCK.
+ */
+typedef struct _SD_LOG {
+    SD_DEV *dev;
+    LBA_t first;        /* First sector of the region                       */
+    LBA_t last;         /* Last sector of the region (inclusive)            */
+    LBA_t head;         /* Next data sector to write                        */
+    volatile DWORD seq; /* Sequence number of the next sealed sector        */
+    DWORD head_seq;     /* Sequence number of the sector at the head        */
+    DWORD since_ckpt;   /* Data sectors written since the last checkpoint   */
+    DWORD ckpt;         /* Number of checkpoints (selects the slot)         */
+    BYTE *buf[2];       /* Double buffer of sectors                         */
+    BYTE *scratch;      /* Sector of the checkpoints, never a data buffer   */
+    volatile WORD used; /* Payload bytes in the active buffer               */
+    volatile BYTE active;   /* Buffer being filled                          */
+    BYTE next_out;      /* Buffer to write next                             */
+    volatile BYTE pending;  /* Bit mask of sealed buffers waiting to be
+                               written                                      */
+    SD_LOG_STATS stats;
+} SD_LOG;
+
+/*******************************************************************************
+ * Public Methods - Append-only log                                            *
+ ******************************************************************************/
+
+/**
+    \brief Open the log in the region [first, last]. A region with a valid
+           checkpoint is recovered: the scan starts at the checkpointed head,
+           so it reads at most SD_LOG_CHECKPOINT sectors. Otherwise the region
+           is erased, if the card can, and a new log begins.
+    \param bufs Storage of SD_LOG_BUFS bytes for the double buffer and the
+           checkpoints.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Log_Open (SD_LOG *log, SD_DEV *dev, LBA_t first, LBA_t last, void *bufs);
+
+/**
+    \brief Append bytes to the log. Full sectors go to the card within an
+           open multiple block write.
+    \param dat Data to append.
+    \param len Byte count.
+    \return If all goes well returns SD_OK. SD_PARERR when the region is
+            full. With SD_LOG_DEFERRED the record is taken whole or not at
+            all: SD_BUSY if the free buffers can't hold it until
+            SD_Log_Service runs, SD_PARERR if it is longer than
+            SD_LOG_PAYLOAD.
+ */
+SDRESULTS SD_Log_Append (SD_LOG *log, const void *dat, WORD len);
+
+/**
+    \brief Write the sealed buffers to the card.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Log_Service (SD_LOG *log);
+
+/**
+    \brief Write the partial sector, close the multiple block write and
+           checkpoint the head. The next append starts a new sector.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Log_Sync (SD_LOG *log);
+
+/**
+    \brief Read the payload of a data sector of the log.
+    \param n Index of the data sector, from zero.
+    \param dat Storage of SD_LOG_PAYLOAD bytes.
+    \param len Payload bytes in the sector.
+    \return If all goes well returns SD_OK. SD_PARERR past the head.
+ */
+SDRESULTS SD_Log_Get (SD_LOG *log, DWORD n, void *dat, WORD *len);
+
+/**
+    \brief Sustained rate of the appends, from the first to the last.
+    \return Bytes per second. Zero without SD_IO_CLOCK.
+ */
+DWORD SD_Log_Rate (SD_LOG *log);
+
+#endif
+
+// «sd_log.h» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
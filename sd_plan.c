@@ -0,0 +1,100 @@
+/*
+ *  File: sd_plan.c
+ *  License at the end of file.
+ */
+
+#include "sd_plan.h"
+#include <string.h>
+
+/******************************************************************************
+ Public Methods - Writes aligned to the allocation unit
+******************************************************************************/
+
+SDRESULTS SD_Plan_Init(SD_PLAN *plan, SD_DEV *dev, void *buf, WORD sectors)
+{
+    DWORD ru;
+    if((buf == NULL)||(sectors == 0)) return(SD_PARERR);
+    if(dev->mount == FALSE) return(SD_NOINIT);
+    memset(plan, 0, sizeof(SD_PLAN));
+    plan->dev = dev;
+    plan->buf = (BYTE*)buf;
+    plan->cap = sectors;
+    // Whole RU when it fits, otherwise the largest power of two that fits
+    ru = SD_Plan_RU(dev);
+    if(sectors >= ru) plan->chunk = ru;
+    else for(plan->chunk = 1; (plan->chunk << 1) <= sectors; plan->chunk <<= 1);
+    return(SD_OK);
+}
+
+DWORD SD_Plan_RU(SD_DEV *dev)
+{
+    // The SDHC/SDXC class 10 measures performance over 512KB units
+    if(dev->speed_class == 10) return(SD_PLAN_RU_SIZE_C10);
+    return(SD_PLAN_RU_SIZE);
+}
+
+SDRESULTS SD_Plan_Write(SD_PLAN *plan, const void *dat, LBA_t sector)
+{
+    SDRESULTS res;
+    // Non-sequential, or still full after a failed flush? The buffer goes first
+    if(plan->fill && ((sector != plan->base + plan->fill)||(plan->fill == plan->cap)))
+    {
+        res = SD_Plan_Flush(plan);
+        if(res != SD_OK) return(res);
+    }
+    if(plan->fill == 0) plan->base = sector;
+    memcpy(plan->buf + (DWORD)plan->fill * SD_BLK_SIZE, dat, SD_BLK_SIZE);
+    plan->fill++;
+    // At chunk boundary or full buffer
+    if((((sector + 1) % plan->chunk) == 0)||(plan->fill == plan->cap))
+        return(SD_Plan_Flush(plan));
+    return(SD_OK);
+}
+
+SDRESULTS SD_Plan_Flush(SD_PLAN *plan)
+{
+    SDRESULTS res;
+    SD_DEV *dev = plan->dev;
+    if(plan->fill == 0) return(SD_OK);
+    res = SD_Write_Blocks(dev, plan->buf, plan->base, plan->fill);
+    if(res == SD_OK)
+    {
+        plan->stats.flushes++;
+        plan->stats.sectors += plan->fill;
+        if(((plan->base % plan->chunk) == 0)&&(plan->fill == plan->chunk))
+            plan->stats.aligned++;
+        else
+            plan->stats.partial++;
+        // An AU filled out of order loses the speed class guarantee
+        if(dev->au_size && (plan->base != plan->au_next)&&
+           ((plan->base % dev->au_size) != 0))
+            plan->stats.au_breaks++;
+        plan->au_next = plan->base + plan->fill;
+        plan->fill = 0;
+    }
+    return(res);
+}
+
+BYTE SD_Plan_Score(SD_PLAN *plan)
+{
+    if(plan->stats.sectors == 0) return(100);
+    return((BYTE)(((QWORD)plan->stats.aligned * plan->chunk * 100) / plan->stats.sectors));
+}
+
+// «sd_plan.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
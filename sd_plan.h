@@ -0,0 +1,100 @@
+/*
+ *  File: sd_plan.h
+ *  License at the end of file.
+ */
+
+#ifndef _SD_PLAN_H_
+#define _SD_PLAN_H_
+
+#include "sd_io.h"
+
+/*****************************************************************************/
+/* Configurations                                                            */
+/*****************************************************************************/
+#define SD_PLAN_RU_SIZE     32      // Recording unit of class 2, 4 and 6 (16KB)
+#define SD_PLAN_RU_SIZE_C10 1024    // Recording unit of class 10 (512KB)
+/*****************************************************************************/
+
+/* Alignment statistics of the planner */
+typedef struct _SD_PLAN_STATS {
+    DWORD sectors;      /* Sectors written                                  */
+    DWORD flushes;      /* Transfers issued to the card                     */
+    DWORD aligned;      /* Transfers that filled a whole aligned chunk      */
+    DWORD partial;      /* Transfers that started or ended inside a chunk   */
+    DWORD au_breaks;    /* Times the sequential fill of an AU was broken    */
+} SD_PLAN_STATS;
+
+/* Write planner object */
+typedef struct _SD_PLAN {
+    SD_DEV *dev;
+    BYTE *buf;          /* Buffer for cap sectors                           */
+    WORD cap;           /* Capacity of the buffer in sectors                */
+    WORD fill;          /* Sectors waiting in the buffer                    */
+    LBA_t base;         /* Sector of the first one in the buffer            */
+    DWORD chunk;        /* Flush boundary: the RU, or the buffer if smaller */
+    LBA_t au_next;      /* Next sector that keeps the AU sequential         */
+    SD_PLAN_STATS stats;
+} SD_PLAN;
+
+/*******************************************************************************
+ * Public Methods - Writes aligned to the allocation unit                      *
+ ******************************************************************************/
+
+/**
+    \brief Prepare a write planner over an initialized device.
+    \param buf Buffer of sectors * SD_BLK_SIZE bytes. The planner is most
+           effective with a whole recording unit (see SD_Plan_RU).
+    \param sectors Capacity of buf in sectors.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Plan_Init (SD_PLAN *plan, SD_DEV *dev, void *buf, WORD sectors);
+
+/**
+    \brief Recording unit of the card, from the speed class of the SD Status.
+    \return Sectors of the recording unit.
+ */
+DWORD SD_Plan_RU (SD_DEV *dev);
+
+/**
+    \brief Queue a sector. The buffer goes to the card as a single multiple
+           block write when it reaches a chunk boundary, when it's full or
+           when the sector isn't the next one of the buffer.
+    \param dat Data to write.
+    \param sector Sector number to write.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Plan_Write (SD_PLAN *plan, const void *dat, LBA_t sector);
+
+/**
+    \brief Write the sectors waiting in the buffer.
+    \return If all goes well returns SD_OK. On error the sectors stay in the
+            buffer, to retry.
+ */
+SDRESULTS SD_Plan_Flush (SD_PLAN *plan);
+
+/**
+    \brief Percentage of sectors written in transfers that filled a whole
+           aligned chunk.
+    \return 0..100.
+ */
+BYTE SD_Plan_Score (SD_PLAN *plan);
+
+#endif
+
+// «sd_plan.h» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
@@ -0,0 +1,605 @@
+/*
+ *  File: sd_zip.c
+ *  License at the end of file.
+ */
+
+#include "sd_zip.h"
+#include <string.h>
+
+#define SD_ZIP_SUPER_MAGIC  0x5A534453UL    /* "SDSZ" */
+#define SD_ZIP_JRNL_MAGIC   0x4A5A4453UL    /* "SDZJ" */
+#define SD_ZIP_JHDR         24
+#define SD_ZIP_JENTRIES     ((SD_BLK_SIZE - SD_ZIP_JHDR) / 8)
+#define SD_ZIP_MIN_MATCH    4
+/* Longest compressed sector kept, with its length word, in units */
+#define SD_ZIP_MAX_PACKED   ((SD_ZIP_UNITS - 1) * SD_ZIP_UNIT - 2)
+
+/* Fields of a map entry */
+#define SD_ZIP_E_UNITS(e)   ((BYTE)((e) & 0x3F))
+#define SD_ZIP_E_START(e)   ((BYTE)(((e) >> 6) & 0x1F))
+#define SD_ZIP_E_INDEX(e)   ((DWORD)((e) >> 11))
+#define SD_ZIP_ENTRY(i,s,u) (((DWORD)(i) << 11) | ((DWORD)(s) << 6) | (DWORD)(u))
+
+/******************************************************************************
+ Private Methods Prototypes - Compressed block layer
+******************************************************************************/
+
+/**
+    \brief Sum of the 32 bits words of a block.
+ */
+DWORD __SD_Zip_Sum(const BYTE *p, WORD len);
+
+/**
+    \brief Compress a sector.
+    \param src Sector to compress.
+    \param dst Output, max bytes.
+    \return Compressed length, zero if it doesn't fit in max bytes.
+ */
+WORD __SD_Zip_Pack(SD_ZIP *zip, const BYTE *src, BYTE *dst, WORD max);
+
+/**
+    \brief Decompress a sector.
+    \param src Compressed data, len bytes.
+    \param dst Output, a whole sector.
+    \return TRUE if the data is well formed and fills the sector exactly.
+ */
+BOOL __SD_Zip_Unpack(const BYTE *src, WORD len, BYTE *dst);
+
+/**
+    \brief Load a map sector in the cache, writing back the least recently
+           used slot if it's dirty (after the journal).
+    \param msec Map sector, from zero.
+    \param slot Slot that holds it.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS __SD_Zip_Slot(SD_ZIP *zip, DWORD msec, BYTE *slot);
+
+/**
+    \brief Read the map entry of a logical sector.
+ */
+SDRESULTS __SD_Zip_Map_Get(SD_ZIP *zip, DWORD sector, DWORD *entry);
+
+/**
+    \brief Change the map entry of a logical sector, in the cache.
+ */
+SDRESULTS __SD_Zip_Map_Set(SD_ZIP *zip, DWORD sector, DWORD entry);
+
+/**
+    \brief Write the journal buffer in its slot.
+ */
+SDRESULTS __SD_Zip_Journal_Write(SD_ZIP *zip);
+
+/**
+    \brief Add a map update to the journal, checkpoint when it's full.
+ */
+SDRESULTS __SD_Zip_Journal_Add(SD_ZIP *zip, DWORD sector, DWORD entry);
+
+/**
+    \brief Write the dirty map sectors and the superblock. The journal
+           starts again from its first slot.
+ */
+SDRESULTS __SD_Zip_Checkpoint(SD_ZIP *zip);
+
+/**
+    \brief Write the pack and move its logical sectors to the map.
+ */
+SDRESULTS __SD_Zip_Flush(SD_ZIP *zip);
+
+/**
+    \brief Load the superblock and replay the journal.
+    \return TRUE if the region holds a layer with the same geometry.
+ */
+BOOL __SD_Zip_Load(SD_ZIP *zip);
+
+/**
+    \brief Format the region: zero map, empty journal and data area.
+ */
+SDRESULTS __SD_Zip_Format(SD_ZIP *zip);
+
+/******************************************************************************
+ Private Methods - Compressed block layer
+******************************************************************************/
+
+DWORD __SD_Zip_Sum(const BYTE *p, WORD len)
+{
+    DWORD sum = 0;
+    WORD idx;
+    for(idx=0; idx<len; idx+=4) sum += SD_Get32(p + idx);
+    return(sum);
+}
+
+WORD __SD_Zip_Pack(SD_ZIP *zip, const BYTE *src, BYTE *dst, WORD max)
+{
+    WORD ip = 0, anchor = 0, op = 0, ref, len, lit, need, n;
+    DWORD h;
+    BYTE *tok;
+    // Positions plus one, zero is an empty slot
+    memset(zip->hash, 0, sizeof(zip->hash));
+    while(ip + SD_ZIP_MIN_MATCH <= SD_BLK_SIZE)
+    {
+        h = (SD_Get32(src + ip) * 2654435761UL) >> (32 - SD_ZIP_HASH_BITS);
+        ref = zip->hash[h & ((1 << SD_ZIP_HASH_BITS) - 1)];
+        zip->hash[h & ((1 << SD_ZIP_HASH_BITS) - 1)] = ip + 1;
+        if((ref == 0)||(memcmp(src + ref - 1, src + ip, SD_ZIP_MIN_MATCH) != 0))
+        {
+            ip++;
+            continue;
+        }
+        ref--;
+        len = SD_ZIP_MIN_MATCH;
+        while((ip + len < SD_BLK_SIZE) && (src[ref + len] == src[ip + len])) len++;
+        // Sequence: token, literals, offset, match length
+        lit = ip - anchor;
+        need = 1 + lit + 2;
+        if(lit >= 15) need += (lit - 15) / 255 + 1;
+        if(len - SD_ZIP_MIN_MATCH >= 15) need += (len - SD_ZIP_MIN_MATCH - 15) / 255 + 1;
+        if(op + need > max) return(0);
+        tok = dst + op++;
+        *tok = (BYTE)((lit < 15 ? lit : 15) << 4);
+        if(lit >= 15)
+        {
+            for(n = lit - 15; n >= 255; n -= 255) dst[op++] = 255;
+            dst[op++] = (BYTE)n;
+        }
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        dst[op++] = (BYTE)(ip - ref);
+        dst[op++] = (BYTE)((ip - ref) >> 8);
+        n = len - SD_ZIP_MIN_MATCH;
+        *tok |= (BYTE)(n < 15 ? n : 15);
+        if(n >= 15)
+        {
+            for(n -= 15; n >= 255; n -= 255) dst[op++] = 255;
+            dst[op++] = (BYTE)n;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    // Last literals, without offset
+    lit = SD_BLK_SIZE - anchor;
+    need = 1 + lit;
+    if(lit >= 15) need += (lit - 15) / 255 + 1;
+    if(op + need > max) return(0);
+    dst[op++] = (BYTE)((lit < 15 ? lit : 15) << 4);
+    if(lit >= 15)
+    {
+        for(n = lit - 15; n >= 255; n -= 255) dst[op++] = 255;
+        dst[op++] = (BYTE)n;
+    }
+    memcpy(dst + op, src + anchor, lit);
+    return(op + lit);
+}
+
+BOOL __SD_Zip_Unpack(const BYTE *src, WORD len, BYTE *dst)
+{
+    WORD ip = 0, op = 0, lit, mlen, off;
+    BYTE tok, b;
+    while(ip < len)
+    {
+        tok = src[ip++];
+        lit = tok >> 4;
+        if(lit == 15)
+        {
+            do {
+                if(ip >= len) return(FALSE);
+                b = src[ip++];
+                lit += b;
+            } while(b == 255);
+        }
+        if((lit > len - ip)||(lit > SD_BLK_SIZE - op)) return(FALSE);
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        // The last sequence has no match
+        if(ip == len) break;
+        if(len - ip < 2) return(FALSE);
+        off = (WORD)src[ip] | ((WORD)src[ip + 1] << 8);
+        ip += 2;
+        mlen = (tok & 0x0F) + SD_ZIP_MIN_MATCH;
+        if((tok & 0x0F) == 15)
+        {
+            do {
+                if(ip >= len) return(FALSE);
+                b = src[ip++];
+                mlen += b;
+            } while(b == 255);
+        }
+        if((off == 0)||(off > op)||(mlen > SD_BLK_SIZE - op)) return(FALSE);
+        // Byte by byte, the match may overlap its own output
+        while(mlen--)
+        {
+            dst[op] = dst[op - off];
+            op++;
+        }
+    }
+    return((op == SD_BLK_SIZE) ? TRUE : FALSE);
+}
+
+SDRESULTS __SD_Zip_Slot(SD_ZIP *zip, DWORD msec, BYTE *slot)
+{
+    SDRESULTS res;
+    BYTE idx, lru = 0;
+    zip->tick++;
+    for(idx=0; idx!=SD_ZIP_CACHE; idx++)
+    {
+        if(zip->cache_sec[idx] == msec)
+        {
+            zip->cache_use[idx] = zip->tick;
+            *slot = idx;
+            return(SD_OK);
+        }
+        if(zip->cache_use[idx] < zip->cache_use[lru]) lru = idx;
+    }
+    if(zip->cache_dirty[lru])
+    {
+        // The journal first: the map may point to packs past the head of the
+        // last checkpoint, only the journal moves it on the card
+        if(zip->jcount)
+        {
+            res = __SD_Zip_Journal_Write(zip);
+            if(res != SD_OK) return(res);
+        }
+        res = SD_Write(zip->dev, zip->cache + lru * SD_BLK_SIZE, zip->map + zip->cache_sec[lru]);
+        if(res != SD_OK) return(res);
+        zip->cache_dirty[lru] = FALSE;
+        zip->stats.maps++;
+    }
+    zip->cache_sec[lru] = 0xFFFFFFFFUL;
+    res = SD_Read(zip->dev, zip->cache + lru * SD_BLK_SIZE, zip->map + msec, 0, SD_BLK_SIZE);
+    if(res != SD_OK) return(res);
+    zip->cache_sec[lru] = msec;
+    zip->cache_use[lru] = zip->tick;
+    *slot = lru;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Zip_Map_Get(SD_ZIP *zip, DWORD sector, DWORD *entry)
+{
+    SDRESULTS res;
+    BYTE slot;
+    res = __SD_Zip_Slot(zip, sector / SD_ZIP_MAP_ENTRIES, &slot);
+    if(res != SD_OK) return(res);
+    *entry = SD_Get32(zip->cache + slot * SD_BLK_SIZE + (sector % SD_ZIP_MAP_ENTRIES) * 4);
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Zip_Map_Set(SD_ZIP *zip, DWORD sector, DWORD entry)
+{
+    SDRESULTS res;
+    BYTE slot;
+    res = __SD_Zip_Slot(zip, sector / SD_ZIP_MAP_ENTRIES, &slot);
+    if(res != SD_OK) return(res);
+    SD_Put32(zip->cache + slot * SD_BLK_SIZE + (sector % SD_ZIP_MAP_ENTRIES) * 4, entry);
+    zip->cache_dirty[slot] = TRUE;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Zip_Journal_Write(SD_ZIP *zip)
+{
+    BYTE *j = zip->jbuf;
+    SD_Put32(j +  0, SD_ZIP_JRNL_MAGIC);
+    SD_Put32(j +  4, zip->id);
+    SD_Put32(j +  8, zip->seq);
+    SD_Put32(j + 12, zip->head);
+    SD_Put32(j + 16, zip->jcount);
+    SD_Put32(j + 20, 0);
+    SD_Put32(j + 20, __SD_Zip_Sum(j, SD_ZIP_JHDR + zip->jcount * 8));
+    zip->stats.journals++;
+    return(SD_Write(zip->dev, j, zip->journal + zip->jpos));
+}
+
+SDRESULTS __SD_Zip_Journal_Add(SD_ZIP *zip, DWORD sector, DWORD entry)
+{
+    SDRESULTS res;
+    BYTE *e = zip->jbuf + SD_ZIP_JHDR + zip->jcount * 8;
+    SD_Put32(e, sector);
+    SD_Put32(e + 4, entry);
+    if(++zip->jcount != SD_ZIP_JENTRIES) return(SD_OK);
+    res = __SD_Zip_Journal_Write(zip);
+    if(res != SD_OK) return(res);
+    zip->jcount = 0;
+    zip->seq++;
+    if(++zip->jpos != SD_ZIP_JOURNAL) return(SD_OK);
+    return(__SD_Zip_Checkpoint(zip));
+}
+
+SDRESULTS __SD_Zip_Checkpoint(SD_ZIP *zip)
+{
+    SDRESULTS res;
+    BYTE idx, *s = zip->out;
+    for(idx=0; idx!=SD_ZIP_CACHE; idx++)
+    {
+        if(!zip->cache_dirty[idx]) continue;
+        res = SD_Write(zip->dev, zip->cache + idx * SD_BLK_SIZE, zip->map + zip->cache_sec[idx]);
+        if(res != SD_OK) return(res);
+        zip->cache_dirty[idx] = FALSE;
+        zip->stats.maps++;
+    }
+    // The map holds every update, the journal begins at seq in slot 0
+    memset(s, 0, SD_BLK_SIZE);
+    SD_Put32(s +  0, SD_ZIP_SUPER_MAGIC);
+    SD_Put32(s +  4, zip->id);
+    SD_Put32(s +  8, (DWORD)zip->first);
+    SD_Put32(s + 12, (DWORD)((QWORD)zip->first >> 32));
+    SD_Put32(s + 16, (DWORD)zip->last);
+    SD_Put32(s + 20, (DWORD)((QWORD)zip->last >> 32));
+    SD_Put32(s + 24, zip->sectors);
+    SD_Put32(s + 28, zip->seq);
+    SD_Put32(s + 32, zip->head);
+    SD_Put32(s + 36, __SD_Zip_Sum(s, 36));
+    res = SD_Write(zip->dev, s, zip->first);
+    if(res != SD_OK) return(res);
+    zip->jpos = 0;
+    zip->stats.checkpoints++;
+    return(SD_OK);
+}
+
+SDRESULTS __SD_Zip_Flush(SD_ZIP *zip)
+{
+    SDRESULTS res;
+    BYTE idx;
+    if(zip->used)
+    {
+        memset(zip->pack + zip->used * SD_ZIP_UNIT, 0, (SD_ZIP_UNITS - zip->used) * SD_ZIP_UNIT);
+        res = SD_Write(zip->dev, zip->pack, zip->data + zip->head);
+        if(res != SD_OK) return(res);
+        zip->head++;
+        zip->stats.sectors++;
+    }
+    // The pack is on the card, now the map may point to it
+    for(idx=0; idx!=zip->items; idx++)
+    {
+        res = __SD_Zip_Map_Set(zip, zip->item[idx].sector, zip->item[idx].entry);
+        if(res == SD_OK) res = __SD_Zip_Journal_Add(zip, zip->item[idx].sector, zip->item[idx].entry);
+        if(res != SD_OK) return(res);
+    }
+    zip->used = 0;
+    zip->items = 0;
+    return(SD_OK);
+}
+
+BOOL __SD_Zip_Load(SD_ZIP *zip)
+{
+    BYTE *s = zip->tmp, *j = zip->jbuf;
+    WORD count, idx;
+    if(SD_Read(zip->dev, s, zip->first, 0, SD_BLK_SIZE) != SD_OK) return(FALSE);
+    // A new format takes the next id, so stale journals don't replay
+    zip->id = SD_Get32(s + 4) + 1;
+    if((SD_Get32(s) != SD_ZIP_SUPER_MAGIC)||
+       (SD_Get32(s + 36) != __SD_Zip_Sum(s, 36))||
+       (SD_Get32(s + 8) != (DWORD)zip->first)||
+       (SD_Get32(s + 12) != (DWORD)((QWORD)zip->first >> 32))||
+       (SD_Get32(s + 16) != (DWORD)zip->last)||
+       (SD_Get32(s + 20) != (DWORD)((QWORD)zip->last >> 32))||
+       (SD_Get32(s + 24) != zip->sectors)) return(FALSE);
+    zip->id--;
+    zip->seq = SD_Get32(s + 28);
+    zip->head = SD_Get32(s + 32);
+    // Replay the journal written after the checkpoint
+    for(zip->jpos=0; zip->jpos!=SD_ZIP_JOURNAL; zip->jpos++)
+    {
+        if(SD_Read(zip->dev, j, zip->journal + zip->jpos, 0, SD_BLK_SIZE) != SD_OK) break;
+        count = (WORD)SD_Get32(j + 16);
+        if((SD_Get32(j) != SD_ZIP_JRNL_MAGIC)||(SD_Get32(j + 4) != zip->id)||
+           (SD_Get32(j + 8) != zip->seq)||(count > SD_ZIP_JENTRIES)) break;
+        // The sum was taken with its own field at zero
+        if(SD_Get32(j + 20) != __SD_Zip_Sum(j, SD_ZIP_JHDR + count * 8) - SD_Get32(j + 20)) break;
+        for(idx=0; idx!=count; idx++)
+            if(__SD_Zip_Map_Set(zip, SD_Get32(j + SD_ZIP_JHDR + idx * 8),
+                                SD_Get32(j + SD_ZIP_JHDR + idx * 8 + 4)) != SD_OK) return(FALSE);
+        zip->head = SD_Get32(j + 12);
+        // A partial sector is the one to go on filling
+        if(count != SD_ZIP_JENTRIES)
+        {
+            zip->jcount = count;
+            break;
+        }
+        zip->seq++;
+    }
+    if(zip->head > zip->data_sectors) return(FALSE);
+    if(zip->jpos == SD_ZIP_JOURNAL) return(__SD_Zip_Checkpoint(zip) == SD_OK);
+    return(TRUE);
+}
+
+SDRESULTS __SD_Zip_Format(SD_ZIP *zip)
+{
+    SDRESULTS res;
+    DWORD idx;
+    memset(zip->tmp, 0, SD_BLK_SIZE);
+    if(zip->dev->erase_zero) res = SD_Erase(zip->dev, zip->map, zip->journal - 1);
+    else
+    {
+        res = SD_OK;
+        for(idx=0; (res == SD_OK) && (idx != zip->journal - zip->map); idx++)
+            res = SD_Write(zip->dev, zip->tmp, zip->map + idx);
+    }
+    if(res != SD_OK) return(res);
+    if(zip->id == 0) zip->id = 1;
+    zip->seq = 1;
+    zip->head = 0;
+    return(__SD_Zip_Checkpoint(zip));
+}
+
+/******************************************************************************
+ Public Methods - Compressed block layer
+******************************************************************************/
+
+SDRESULTS SD_Zip_Open(SD_ZIP *zip, SD_DEV *dev, LBA_t first, LBA_t last, DWORD sectors, void *work)
+{
+    SDRESULTS res;
+    BYTE idx;
+    DWORD msecs;
+    if(dev->mount == FALSE) return(SD_NOINIT);
+    msecs = (sectors + SD_ZIP_MAP_ENTRIES - 1) / SD_ZIP_MAP_ENTRIES;
+    if((work == NULL)||(sectors == 0)||(last > dev->last_sector)||(last < first)||
+       (last - first < 1 + msecs + SD_ZIP_JOURNAL)) return(SD_PARERR);
+    memset(zip, 0, sizeof(SD_ZIP));
+    zip->dev = dev;
+    zip->first = first;
+    zip->last = last;
+    zip->sectors = sectors;
+    zip->map = first + 1;
+    zip->journal = zip->map + msecs;
+    zip->data = zip->journal + SD_ZIP_JOURNAL;
+    zip->data_sectors = (last - zip->data + 1 > SD_ZIP_MAX_DATA) ? SD_ZIP_MAX_DATA : (DWORD)(last - zip->data + 1);
+    zip->pack = (BYTE*)work;
+    zip->jbuf = zip->pack + SD_BLK_SIZE;
+    zip->tmp = zip->jbuf + SD_BLK_SIZE;
+    zip->out = zip->tmp + SD_BLK_SIZE;
+    zip->cache = zip->out + SD_BLK_SIZE;
+    zip->tmp_index = 0xFFFFFFFFUL;
+    for(idx=0; idx!=SD_ZIP_CACHE; idx++) zip->cache_sec[idx] = 0xFFFFFFFFUL;
+    if(__SD_Zip_Load(zip)) return(SD_OK);
+    // New layer, whatever the cache loaded is stale
+    for(idx=0; idx!=SD_ZIP_CACHE; idx++)
+    {
+        zip->cache_sec[idx] = 0xFFFFFFFFUL;
+        zip->cache_dirty[idx] = FALSE;
+    }
+    zip->jcount = 0;
+    res = __SD_Zip_Format(zip);
+    if(res != SD_OK) return(res);
+    memset(&zip->stats, 0, sizeof(zip->stats));
+    return(SD_OK);
+}
+
+SDRESULTS SD_Zip_Read(SD_ZIP *zip, void *dat, DWORD sector, WORD ofs, WORD cnt)
+{
+    SDRESULTS res;
+    DWORD entry = 0;
+    BYTE idx, units, *src = NULL, *dst;
+    WORD len;
+    if((sector >= zip->sectors)||(cnt == 0)||(ofs + cnt > SD_BLK_SIZE)) return(SD_PARERR);
+    // The newest copy may be waiting in the pack
+    for(idx=zip->items; idx!=0; idx--)
+    {
+        if(zip->item[idx - 1].sector != sector) continue;
+        entry = zip->item[idx - 1].entry;
+        src = zip->pack + SD_ZIP_E_START(entry) * SD_ZIP_UNIT;
+        break;
+    }
+    if(src == NULL)
+    {
+        res = __SD_Zip_Map_Get(zip, sector, &entry);
+        if(res != SD_OK) return(res);
+    }
+    units = SD_ZIP_E_UNITS(entry);
+    if(units == 0)
+    {
+        memset(dat, 0, cnt);
+        return(SD_OK);
+    }
+    if((units > SD_ZIP_UNITS)||(SD_ZIP_E_START(entry) + units > SD_ZIP_UNITS)||
+       (SD_ZIP_E_INDEX(entry) >= zip->data_sectors)) return(SD_ERROR);
+    if(units == SD_ZIP_UNITS)
+    {
+        // Stored as is, read only the bytes asked
+        if(src != NULL)
+        {
+            memcpy(dat, src + ofs, cnt);
+            return(SD_OK);
+        }
+        return(SD_Read(zip->dev, dat, zip->data + SD_ZIP_E_INDEX(entry), ofs, cnt));
+    }
+    if(src == NULL)
+    {
+        // The bus clocks the whole sector anyway, keep it for its neighbours
+        if(zip->tmp_index != SD_ZIP_E_INDEX(entry))
+        {
+            zip->tmp_index = 0xFFFFFFFFUL;
+            res = SD_Read(zip->dev, zip->tmp, zip->data + SD_ZIP_E_INDEX(entry), 0, SD_BLK_SIZE);
+            if(res != SD_OK) return(res);
+            zip->tmp_index = SD_ZIP_E_INDEX(entry);
+        }
+        src = zip->tmp + SD_ZIP_E_START(entry) * SD_ZIP_UNIT;
+    }
+    len = (WORD)src[0] | ((WORD)src[1] << 8);
+    if(len > units * SD_ZIP_UNIT - 2) return(SD_ERROR);
+    dst = ((ofs == 0) && (cnt == SD_BLK_SIZE)) ? (BYTE*)dat : zip->out;
+    if(!__SD_Zip_Unpack(src + 2, len, dst)) return(SD_ERROR);
+    if(dst != (BYTE*)dat) memcpy(dat, dst + ofs, cnt);
+    return(SD_OK);
+}
+
+SDRESULTS SD_Zip_Write(SD_ZIP *zip, const void *dat, DWORD sector)
+{
+    SDRESULTS res;
+    const BYTE *src = (const BYTE*)dat;
+    DWORD entry = 0;
+    WORD idx, len;
+    BYTE units;
+    if(sector >= zip->sectors) return(SD_PARERR);
+    zip->tmp_index = 0xFFFFFFFFUL;
+    if(zip->items == SD_ZIP_UNITS)
+    {
+        res = __SD_Zip_Flush(zip);
+        if(res != SD_OK) return(res);
+    }
+    for(idx=0; (idx != SD_BLK_SIZE) && (src[idx] == 0); idx++);
+    if(idx == SD_BLK_SIZE) zip->stats.zeros++;
+    else
+    {
+        len = __SD_Zip_Pack(zip, src, zip->tmp + 2, SD_ZIP_MAX_PACKED);
+        units = len ? (BYTE)((len + 2 + SD_ZIP_UNIT - 1) / SD_ZIP_UNIT) : SD_ZIP_UNITS;
+        if(zip->used + units > SD_ZIP_UNITS)
+        {
+            res = __SD_Zip_Flush(zip);
+            if(res != SD_OK) return(res);
+        }
+        if(zip->head >= zip->data_sectors) return(SD_REJECT);
+        if(len)
+        {
+            zip->tmp[0] = (BYTE)len;
+            zip->tmp[1] = (BYTE)(len >> 8);
+            memset(zip->tmp + 2 + len, 0, units * SD_ZIP_UNIT - 2 - len);
+            memcpy(zip->pack + zip->used * SD_ZIP_UNIT, zip->tmp, units * SD_ZIP_UNIT);
+        }
+        else
+        {
+            memcpy(zip->pack, src, SD_BLK_SIZE);
+            zip->stats.raw++;
+        }
+        entry = SD_ZIP_ENTRY(zip->head, zip->used, units);
+        zip->used += units;
+        zip->stats.units += units;
+    }
+    zip->item[zip->items].sector = sector;
+    zip->item[zip->items].entry = entry;
+    zip->items++;
+    zip->stats.writes++;
+    if(zip->used == SD_ZIP_UNITS) return(__SD_Zip_Flush(zip));
+    return(SD_OK);
+}
+
+SDRESULTS SD_Zip_Sync(SD_ZIP *zip)
+{
+    SDRESULTS res;
+    res = __SD_Zip_Flush(zip);
+    if((res != SD_OK)||(zip->jcount == 0)) return(res);
+    // Written again as it fills, at the same slot
+    return(__SD_Zip_Journal_Write(zip));
+}
+
+DWORD SD_Zip_Ratio(SD_ZIP *zip)
+{
+    if(zip->stats.units == 0) return(0);
+    return((DWORD)(((QWORD)zip->stats.writes * SD_ZIP_UNITS * 100) / zip->stats.units));
+}
+
+// «sd_zip.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
@@ -0,0 +1,152 @@
+/*
+ *  File: sd_zip.h
+ *  License at the end of file.
+ */
+
+#ifndef _SD_ZIP_H_
+#define _SD_ZIP_H_
+
+#include "sd_io.h"
+
+/*****************************************************************************/
+/* Configurations                                                            */
+/*****************************************************************************/
+#define SD_ZIP_JOURNAL      16      // Journal sectors between checkpoints
+#define SD_ZIP_CACHE        2       // Map sectors kept in memory
+#define SD_ZIP_HASH_BITS    8       // Hash table of the compressor (2^n words)
+/*****************************************************************************/
+
+/*
+ * Layout of the region [first, last]:
+ * - first: superblock (geometry, journal sequence and head of the checkpoint).
+ * - map: one DWORD entry per logical sector, 128 entries per sector.
+ * - journal: SD_ZIP_JOURNAL sectors of map updates written since the
+ *   checkpoint. A full journal is a checkpoint: dirty map sectors are written
+ *   and the superblock moves forward.
+ * - data: packs of compressed sectors, appended from the start of the area.
+ *
+ * Each logical sector is compressed alone (LZ77, LZ4-like sequences) and
+ * stored in units of SD_ZIP_UNIT bytes inside a pack, so several of them
+ * share one sector of the card. A sector that doesn't compress is stored as a
+ * whole pack, and an all-zero sector takes no space at all.
+ */
+#define SD_ZIP_UNIT         16
+#define SD_ZIP_UNITS        (SD_BLK_SIZE / SD_ZIP_UNIT)
+#define SD_ZIP_MAP_ENTRIES  (SD_BLK_SIZE / 4)
+#define SD_ZIP_MAX_DATA     (1UL << 21)     /* Data sectors of a map entry  */
+#define SD_ZIP_WORK         ((4 + SD_ZIP_CACHE) * SD_BLK_SIZE)
+
+/* Performance figures of the layer */
+typedef struct _SD_ZIP_STATS {
+    DWORD writes;       /* Logical sectors written                          */
+    DWORD zeros;        /* Of them, all-zero sectors (nothing stored)       */
+    DWORD raw;          /* Of them, stored without compression              */
+    DWORD units;        /* Units of data packed                             */
+    DWORD sectors;      /* Data sectors written                             */
+    DWORD journals;     /* Journal sectors written                          */
+    DWORD maps;         /* Map sectors written                              */
+    DWORD checkpoints;  /* Checkpoints written                              */
+} SD_ZIP_STATS;
+
+/* Logical sector waiting in the pack */
+typedef struct _SD_ZIP_ITEM {
+    DWORD sector;       /* Logical sector                                   */
+    DWORD entry;        /* Its map entry                                    */
+} SD_ZIP_ITEM;
+
+/* Compressed block layer object */
+typedef struct _SD_ZIP {
+    SD_DEV *dev;
+    LBA_t first;        /* First sector of the region (superblock)          */
+    LBA_t last;         /* Last sector of the region (inclusive)            */
+    DWORD sectors;      /* Logical sectors                                  */
+    LBA_t map;          /* First map sector                                 */
+    LBA_t journal;      /* First journal sector                             */
+    LBA_t data;         /* First data sector                                */
+    DWORD data_sectors; /* Size of the data area                            */
+    DWORD head;         /* Next data sector to write (index in the area)    */
+    DWORD id;           /* Format number, tags the journal                  */
+    DWORD seq;          /* Sequence of the journal sector in the buffer     */
+    WORD jpos;          /* Journal slot of the buffer                       */
+    WORD jcount;        /* Entries in the journal buffer                    */
+    BYTE used;          /* Units used in the pack                           */
+    BYTE items;         /* Logical sectors in the pack                      */
+    SD_ZIP_ITEM item[SD_ZIP_UNITS];
+    BYTE *pack;         /* Pack being filled                                */
+    BYTE *jbuf;         /* Journal sector being filled                      */
+    BYTE *tmp;          /* Compressed sector, or data sector last read      */
+    DWORD tmp_index;    /* Data sector held in tmp, 0xFFFFFFFF if none      */
+    BYTE *out;          /* Decompressed sector, partial reads               */
+    BYTE *cache;        /* SD_ZIP_CACHE map sectors                         */
+    DWORD cache_sec[SD_ZIP_CACHE];  /* Map sector of each slot              */
+    DWORD cache_use[SD_ZIP_CACHE];  /* Last use of each slot (LRU)          */
+    BYTE cache_dirty[SD_ZIP_CACHE];
+    DWORD tick;
+    WORD hash[1 << SD_ZIP_HASH_BITS];
+    SD_ZIP_STATS stats;
+} SD_ZIP;
+
+/*******************************************************************************
+ * Public Methods - Compressed block layer                                     *
+ ******************************************************************************/
+
+/**
+    \brief Open the layer in the region [first, last] with a number of logical
+           sectors. A region formatted with the same geometry is recovered
+           (the journal is replayed over the map), otherwise it's formatted
+           and all logical sectors read as zero.
+    \param sectors Logical sectors exposed by the layer.
+    \param work Storage of SD_ZIP_WORK bytes.
+    \return If all goes well returns SD_OK. SD_PARERR if the region can't
+            hold the map, the journal and one data sector.
+ */
+SDRESULTS SD_Zip_Open (SD_ZIP *zip, SD_DEV *dev, LBA_t first, LBA_t last, DWORD sectors, void *work);
+
+/**
+    \brief Read a part of a logical sector, as SD_Read.
+    \return If all goes well returns SD_OK. SD_ERROR if the stored data is
+            corrupt.
+ */
+SDRESULTS SD_Zip_Read (SD_ZIP *zip, void *dat, DWORD sector, WORD ofs, WORD cnt);
+
+/**
+    \brief Write a logical sector, as SD_Write. The data reaches the card when
+           its pack is full or in SD_Zip_Sync.
+    \return If all goes well returns SD_OK. SD_REJECT when the data area is
+            full: the area is written once, overwritten sectors aren't
+            reclaimed until the region is formatted again.
+ */
+SDRESULTS SD_Zip_Write (SD_ZIP *zip, const void *dat, DWORD sector);
+
+/**
+    \brief Write the partial pack and the journal. The writes done before
+           survive a power loss.
+    \return If all goes well returns SD_OK.
+ */
+SDRESULTS SD_Zip_Sync (SD_ZIP *zip);
+
+/**
+    \brief Compression ratio of the writes: logical sectors per data sector
+           written, in hundredths.
+ */
+DWORD SD_Zip_Ratio (SD_ZIP *zip);
+
+#endif
+
+// «sd_zip.h» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
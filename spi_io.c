@@ -76,6 +76,11 @@ inline void SPI_Freq_Low (void) {
     spi_set_baudrate(spi_default, 400 * 1000); // 400 kHz
 }
 
+DWORD SPI_Freq_Khz (DWORD khz)
+{
+    return spi_set_baudrate(spi_default, khz * 1000) / 1000; // The one set
+}
+
 void SPI_Timer_On (WORD ms)
 {
     spi_timer_expire = make_timeout_time_ms(ms);
@@ -91,6 +96,11 @@ inline void SPI_Timer_Off (void)
     spi_timer_expire = get_absolute_time();
 }
 
+DWORD SPI_Clock_Us (void)
+{
+    return time_us_32();
+}
+
 /*
 The MIT License (MIT)
 
@@ -42,11 +42,26 @@ void SPI_CS_Low (void);
  */
 void SPI_CS_High (void);
 
+/**
+    \brief Route SPI_CS_Low/SPI_CS_High to the chip select of a card, the
+           others stay deselected. Only needed with SD_IO_SLOTS.
+    \param slot Slot of the card (SD_DEV.slot).
+ */
+void SPI_Slot (BYTE slot);
+
 /**
     \brief Setting frequency of SPI's clock to maximun possible.
  */
 void SPI_Freq_High (void);
 
+/**
+    \brief Setting frequency of SPI's clock to the fastest one up to khz.
+           Only needed with SD_IO_TUNE.
+    \param khz Clock wanted (kHz).
+    \return Clock set (kHz).
+ */
+DWORD SPI_Freq_Khz (DWORD khz);
+
 /**
     \brief Setting frequency of SPI's clock equal or lower than 400kHz.
  */
@@ -69,6 +84,13 @@ BOOL SPI_Timer_Status (void);
  */
 void SPI_Timer_Off (void);
 
+/**
+    \brief Free running microseconds counter, for timings and statistics.
+           Only needed with SD_IO_CLOCK.
+    \return Microseconds, wraps around at 2^32.
+ */
+DWORD SPI_Clock_Us (void);
+
 #endif
 
 /*
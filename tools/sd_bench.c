@@ -0,0 +1,128 @@
+/*
+ *  File: sd_bench.c
+ *  License at the end of file.
+ *
+ *  Throughput benchmarks over the x86 emulation.
+ *
+ *  Build and run (GNU/Linux):
+ *    dd if=/dev/zero of=sim_sd.raw bs=1k count=0 seek=65536
+ *    gcc -D_M_IX86 -I.. -o sd_bench sd_bench.c ../sd_io.c ../sd_log.c
+ *    ./sd_bench sim_sd.raw
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sd_io.h"
+#include "sd_log.h"
+
+#define BENCH_BYTES     (8UL * 1024 * 1024)     // Data written by each test
+#define BENCH_RECORD    64                      // Bytes of a logger record
+#define BENCH_REGION    1024                    // First sector of the tests
+
+static BYTE bench_buf[SD_BLK_SIZE];
+static BYTE bench_log_bufs[SD_LOG_BUFS];
+
+/******************************************************************************
+ Private Methods - Benchmarks
+******************************************************************************/
+
+/**
+    \brief Print a result line.
+    \param name Test name.
+    \param bytes Bytes written.
+    \param us Elapsed microseconds.
+    \param worst_us Worst latency of a call.
+ */
+static void bench_report(const char *name, DWORD bytes, DWORD us, DWORD worst_us)
+{
+    printf("%-28s %8.2f MB/s   worst %7lu us\n", name,
+           us ? ((double)bytes / us) : 0.0, (unsigned long)worst_us);
+}
+
+/**
+    \brief The hand made logger: a record buffer flushed with SD_Write.
+ */
+static SDRESULTS bench_sd_write(SD_DEV *dev)
+{
+    LBA_t sector = BENCH_REGION;
+    DWORD done, t0, t, dt, worst = 0;
+    WORD used = 0;
+    BYTE rec[BENCH_RECORD];
+    memset(rec, 0xA5, sizeof(rec));
+    t0 = SD_Time_Us();
+    for(done = 0; done < BENCH_BYTES; done += BENCH_RECORD)
+    {
+        t = SD_Time_Us();
+        memcpy(bench_buf + used, rec, BENCH_RECORD);
+        used += BENCH_RECORD;
+        if(used == SD_BLK_SIZE)
+        {
+            if(SD_Write(dev, bench_buf, sector++) != SD_OK) return(SD_ERROR);
+            used = 0;
+        }
+        dt = SD_Time_Us() - t;
+        if(dt > worst) worst = dt;
+    }
+    bench_report("SD_Write per sector", BENCH_BYTES, SD_Time_Us() - t0, worst);
+    return(SD_OK);
+}
+
+/**
+    \brief The same records through the log writer.
+ */
+static SDRESULTS bench_sd_log(SD_DEV *dev)
+{
+    SD_LOG log;
+    DWORD done, region;
+    BYTE rec[BENCH_RECORD];
+    memset(rec, 0xA5, sizeof(rec));
+    region = BENCH_REGION + (BENCH_BYTES / SD_LOG_PAYLOAD) + 16;
+    if(SD_Log_Open(&log, dev, BENCH_REGION, region, bench_log_bufs) != SD_OK) return(SD_ERROR);
+    for(done = 0; done < BENCH_BYTES; done += BENCH_RECORD)
+        if(SD_Log_Append(&log, rec, BENCH_RECORD) != SD_OK) return(SD_ERROR);
+    if(SD_Log_Sync(&log) != SD_OK) return(SD_ERROR);
+    bench_report("SD_Log_Append", log.stats.bytes,
+                 log.stats.t_last - log.stats.t_first, log.stats.worst_us);
+    printf("%-28s %8lu sectors, %lu checkpoints, %lu B/s sustained\n", "",
+           (unsigned long)log.stats.sectors, (unsigned long)log.stats.checkpoints,
+           (unsigned long)SD_Log_Rate(&log));
+    return(SD_OK);
+}
+
+int main(int argc, char *argv[])
+{
+    SD_DEV dev[1];
+    if(argc < 2)
+    {
+        printf("usage: %s image\n", argv[0]);
+        return(1);
+    }
+    memset(dev, 0, sizeof(dev));
+    strncpy(dev->fn, argv[1], sizeof(dev->fn) - 1);
+    if(SD_Init(dev) != SD_OK)
+    {
+        printf("can't open %s\n", argv[1]);
+        return(1);
+    }
+    if(bench_sd_write(dev) != SD_OK) printf("SD_Write failed\n");
+    if(bench_sd_log(dev) != SD_OK) printf("SD_Log failed\n");
+    return(0);
+}
+
+// «sd_bench.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
@@ -0,0 +1,212 @@
+/*
+ *  File: sd_bench_cpp.cpp
+ *  License at the end of file.
+ *
+ *  The C API against the SdCard template (sd_card.hpp), both over the SPI
+ *  simulator (spi_sim.c), so every byte of the protocol is clocked.
+ *
+ *  Build and run (GNU/Linux):
+ *    dd if=/dev/zero of=sim_sd.raw bs=1k count=0 seek=65536
+ *    gcc -O2 -I.. -c ../sd_io.c spi_sim.c
+ *    g++ -std=c++17 -O2 -I.. -o sd_bench_cpp sd_bench_cpp.cpp sd_io.o spi_sim.o
+ *    ./sd_bench_cpp sim_sd.raw
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sd_card.hpp"
+
+extern "C" {
+#include "spi_sim.h"
+}
+
+#define BENCH_SECTORS   2048                    // Sectors of each test
+#define BENCH_BURST     32                      // Sectors of a multiple block
+#define BENCH_REGION    1024                    // First sector of the tests
+
+static BYTE bench_src[BENCH_BURST * SD_BLK_SIZE];
+static BYTE bench_dst[BENCH_BURST * SD_BLK_SIZE];
+
+struct CrcOptions : ulibsd::SdOptions {
+    static constexpr bool crc = true;
+};
+
+struct WriteBackOptions : ulibsd::SdOptions {
+    static constexpr bool write_back = true;
+};
+
+struct SingleOptions : ulibsd::SdOptions {
+    static constexpr bool multi_block = false;
+};
+
+/******************************************************************************
+ Private Methods - Benchmarks
+******************************************************************************/
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Fill the source with a pattern that depends on the sector */
+static void bench_fill(LBA_t sector, DWORD count)
+{
+    for(DWORD idx = 0; idx != count * SD_BLK_SIZE; idx++)
+        bench_src[idx] = (BYTE)((sector + idx / SD_BLK_SIZE) * 7 + idx);
+}
+
+/**
+    \brief Print a result line.
+    \param name Test name.
+    \param sec Elapsed seconds.
+    \param bytes SPI bytes clocked by the test.
+    \param ok The data read back matches.
+ */
+static void bench_report(const char *name, double sec, DWORD bytes, bool ok)
+{
+    printf("%-30s %8.2f MB/s  %6lu SPI bytes/sector  %s\n", name,
+           (double)BENCH_SECTORS * SD_BLK_SIZE / sec / 1e6,
+           (unsigned long)(bytes / BENCH_SECTORS), ok ? "ok" : "MISMATCH");
+}
+
+/**
+    \brief The C API: SD_Write/SD_Read per sector, then SD_Write_Blocks.
+ */
+static void bench_c(void)
+{
+    SD_DEV dev[1];
+    DWORD b0, n;
+    double t0;
+    bool ok = true;
+    memset(dev, 0, sizeof(dev));
+    if(SD_Init(dev) != SD_OK)
+    {
+        printf("SD_Init failed\n");
+        return;
+    }
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(BENCH_REGION + n, 1);
+        if(SD_Write(dev, bench_src, BENCH_REGION + n) != SD_OK) ok = false;
+    }
+    bench_report("C SD_Write", bench_now() - t0, SIM_Bytes(0) - b0, ok);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(BENCH_REGION + n, 1);
+        if((SD_Read(dev, bench_dst, BENCH_REGION + n, 0, SD_BLK_SIZE) != SD_OK)
+           ||memcmp(bench_src, bench_dst, SD_BLK_SIZE)) ok = false;
+    }
+    bench_report("C SD_Read", bench_now() - t0, SIM_Bytes(0) - b0, ok);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n += BENCH_BURST)
+    {
+        bench_fill(BENCH_REGION + n, BENCH_BURST);
+        if(SD_Write_Blocks(dev, bench_src, BENCH_REGION + n, BENCH_BURST) != SD_OK) ok = false;
+    }
+    bench_report("C SD_Write_Blocks", bench_now() - t0, SIM_Bytes(0) - b0, ok);
+}
+
+/**
+    \brief The template with a set of options.
+ */
+template<class Options>
+static void bench_cpp(const char *name)
+{
+    ulibsd::SdCard<ulibsd::SpiPort, Options> card;
+    char line[64];
+    DWORD b0, n;
+    double t0;
+    bool ok = true;
+    if(card.init() != SD_OK)
+    {
+        printf("%s: init failed\n", name);
+        return;
+    }
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(BENCH_REGION + n, 1);
+        if(card.write(bench_src, BENCH_REGION + n) != SD_OK) ok = false;
+    }
+    if(card.sync() != SD_OK) ok = false;
+    snprintf(line, sizeof(line), "%s write", name);
+    bench_report(line, bench_now() - t0, SIM_Bytes(0) - b0, ok);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(BENCH_REGION + n, 1);
+        if((card.read(bench_dst, BENCH_REGION + n) != SD_OK)
+           ||memcmp(bench_src, bench_dst, SD_BLK_SIZE)) ok = false;
+    }
+    snprintf(line, sizeof(line), "%s read", name);
+    bench_report(line, bench_now() - t0, SIM_Bytes(0) - b0, ok);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n += BENCH_BURST)
+    {
+        bench_fill(BENCH_REGION + n, BENCH_BURST);
+        if(card.write_blocks(bench_src, BENCH_REGION + n, BENCH_BURST) != SD_OK) ok = false;
+    }
+    if(card.sync() != SD_OK) ok = false;
+    snprintf(line, sizeof(line), "%s write_blocks", name);
+    bench_report(line, bench_now() - t0, SIM_Bytes(0) - b0, ok);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n += BENCH_BURST)
+    {
+        bench_fill(BENCH_REGION + n, BENCH_BURST);
+        if((card.read_blocks(bench_dst, BENCH_REGION + n, BENCH_BURST) != SD_OK)
+           ||memcmp(bench_src, bench_dst, sizeof(bench_dst))) ok = false;
+    }
+    snprintf(line, sizeof(line), "%s read_blocks", name);
+    bench_report(line, bench_now() - t0, SIM_Bytes(0) - b0, ok);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s image\n", argv[0]);
+        return(1);
+    }
+    if(SIM_Open(0, argv[1], TRUE) != 0)
+    {
+        printf("can't open %s\n", argv[1]);
+        return(1);
+    }
+    SIM_Select(0);
+    bench_c();
+    bench_cpp<ulibsd::SdOptions>("SdCard");
+    bench_cpp<CrcOptions>("SdCard crc");
+    bench_cpp<WriteBackOptions>("SdCard write_back");
+    bench_cpp<SingleOptions>("SdCard single");
+    return(0);
+}
+
+// «sd_bench_cpp.cpp» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
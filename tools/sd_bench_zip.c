@@ -0,0 +1,178 @@
+/*
+ *  File: sd_bench_zip.c
+ *  License at the end of file.
+ *
+ *  Effective throughput of the compressed block layer (sd_zip.c) against
+ *  SD_Write, with telemetry records, over the SPI simulator (spi_sim.c). The
+ *  bus figure is the rate of logical data when the SPI clock (SD_IO_SPI_KHZ)
+ *  is the only limit.
+ *
+ *  Build and run (GNU/Linux):
+ *    dd if=/dev/zero of=sim_sd.raw bs=1k count=0 seek=65536
+ *    gcc -O2 -I.. -o sd_bench_zip sd_bench_zip.c ../sd_io.c ../sd_zip.c spi_sim.c
+ *    ./sd_bench_zip sim_sd.raw
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sd_io.h"
+#include "sd_zip.h"
+#include "spi_sim.h"
+
+#define BENCH_SECTORS   4096                    // Logical sectors of each test
+#define BENCH_REGION    8192                    // First sector of the tests
+
+static BYTE bench_buf[SD_BLK_SIZE];
+static BYTE bench_chk[SD_BLK_SIZE];
+static BYTE bench_work[SD_ZIP_WORK];
+
+/******************************************************************************
+ Private Methods - Benchmarks
+******************************************************************************/
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/**
+    \brief A sector of telemetry: 16 records of 32 bytes with a time stamp,
+           eight slow channels, flags and a counter.
+ */
+static void bench_fill(DWORD sector)
+{
+    DWORD rec, t, ch;
+    BYTE *p;
+    for(rec = 0; rec != SD_BLK_SIZE / 32; rec++)
+    {
+        p = bench_buf + rec * 32;
+        t = (sector * (SD_BLK_SIZE / 32) + rec) * 10;
+        memcpy(p, &t, 4);
+        for(ch = 0; ch != 8; ch++)
+        {
+            WORD v = (WORD)(1000 * ch + ((t / (100 * (ch + 1))) & 0x0F));
+            memcpy(p + 4 + ch * 2, &v, 2);
+        }
+        memset(p + 20, 0, 8);
+        p[20] = (BYTE)(t >> 16 & 1);
+        memcpy(p + 28, &rec, 4);
+    }
+}
+
+/**
+    \brief Print a result line.
+    \param name Test name.
+    \param sec Elapsed seconds.
+    \param bytes SPI bytes clocked.
+ */
+static void bench_report(const char *name, double sec, DWORD bytes)
+{
+    double logical = (double)BENCH_SECTORS * SD_BLK_SIZE;
+    double bus = (double)bytes / (SD_IO_SPI_KHZ * 1000.0 / 8);
+    printf("%-22s %8.2f MB/s  %6lu SPI bytes/sector  %6.2f MB/s on the bus\n", name,
+           logical / sec / 1e6, (unsigned long)(bytes / BENCH_SECTORS), logical / bus / 1e6);
+}
+
+/**
+    \brief The plain loop of SD_Write.
+ */
+static SDRESULTS bench_sd_write(SD_DEV *dev)
+{
+    DWORD n, b0 = SIM_Bytes(0);
+    double t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(n);
+        if(SD_Write(dev, bench_buf, BENCH_REGION + n) != SD_OK) return(SD_ERROR);
+    }
+    bench_report("SD_Write", bench_now() - t0, SIM_Bytes(0) - b0);
+    return(SD_OK);
+}
+
+/**
+    \brief The same sectors through the layer, then read back.
+ */
+static SDRESULTS bench_sd_zip(SD_DEV *dev)
+{
+    SD_ZIP zip;
+    DWORD n, b0;
+    double t0;
+    if(SD_Zip_Open(&zip, dev, BENCH_REGION, BENCH_REGION + BENCH_SECTORS, BENCH_SECTORS, bench_work) != SD_OK)
+        return(SD_ERROR);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(n);
+        if(SD_Zip_Write(&zip, bench_buf, n) != SD_OK) return(SD_ERROR);
+    }
+    if(SD_Zip_Sync(&zip) != SD_OK) return(SD_ERROR);
+    bench_report("SD_Zip_Write", bench_now() - t0, SIM_Bytes(0) - b0);
+    printf("%-22s %8lu data, %lu journal, %lu map sectors, ratio %lu.%02lu\n", "",
+           (unsigned long)zip.stats.sectors, (unsigned long)zip.stats.journals,
+           (unsigned long)zip.stats.maps, (unsigned long)(SD_Zip_Ratio(&zip) / 100),
+           (unsigned long)(SD_Zip_Ratio(&zip) % 100));
+    // Recover from the card and check every sector
+    if(SD_Zip_Open(&zip, dev, BENCH_REGION, BENCH_REGION + BENCH_SECTORS, BENCH_SECTORS, bench_work) != SD_OK)
+        return(SD_ERROR);
+    b0 = SIM_Bytes(0);
+    t0 = bench_now();
+    for(n = 0; n != BENCH_SECTORS; n++)
+    {
+        bench_fill(n);
+        if(SD_Zip_Read(&zip, bench_chk, n, 0, SD_BLK_SIZE) != SD_OK) return(SD_ERROR);
+        if(memcmp(bench_buf, bench_chk, SD_BLK_SIZE) != 0)
+        {
+            printf("sector %lu differs\n", (unsigned long)n);
+            return(SD_ERROR);
+        }
+    }
+    bench_report("SD_Zip_Read", bench_now() - t0, SIM_Bytes(0) - b0);
+    return(SD_OK);
+}
+
+int main(int argc, char *argv[])
+{
+    SD_DEV dev[1];
+    if(argc < 2)
+    {
+        printf("usage: %s image\n", argv[0]);
+        return(1);
+    }
+    if(SIM_Open(0, argv[1], TRUE) != 0)
+    {
+        printf("can't open %s\n", argv[1]);
+        return(1);
+    }
+    SIM_Select(0);
+    memset(dev, 0, sizeof(dev));
+    if(SD_Init(dev) != SD_OK)
+    {
+        printf("SD_Init failed\n");
+        return(1);
+    }
+    if(bench_sd_write(dev) != SD_OK) printf("SD_Write failed\n");
+    if(bench_sd_zip(dev) != SD_OK) printf("SD_Zip failed\n");
+    return(0);
+}
+
+// «sd_bench_zip.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
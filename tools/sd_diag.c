@@ -0,0 +1,80 @@
+/*
+ *  File: sd_diag.c
+ *  License at the end of file.
+ *
+ *  Decoder of the diagnostics of the driver (SD_Diag_Dump): the target
+ *  only stores the id of each message and its arguments, the formats
+ *  (SD_DIAG_FORMATS of sd_io.h) are applied here. Build it with the sd_io.h
+ *  of the target.
+ *
+ *  Build and run (GNU/Linux):
+ *    gcc -O2 -DSD_IO_DIAG -I.. -o sd_diag sd_diag.c
+ *    ./sd_diag diag.bin
+ */
+
+#include <stdio.h>
+#include "sd_io.h"
+
+static const char *diag_formats[SD_DIAG_MSGS] = SD_DIAG_FORMATS;
+static const char diag_levels[] = "?EWID";
+
+static DWORD diag_get32(const BYTE *p)
+{
+    return((DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24));
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    BYTE hdr[SD_DIAG_DUMP_HDR], r[SD_DIAG_DUMP_REC];
+    DWORD n, idx, t0 = 0;
+    unsigned long arg[SD_DIAG_ARGS];
+    BYTE id, level, a;
+    if(argc != 2)
+    {
+        printf("usage: %s diag.bin\n", argv[0]);
+        return(1);
+    }
+    fp = fopen(argv[1], "rb");
+    if((fp == NULL)||(fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr))||
+       (diag_get32(hdr) != SD_DIAG_MAGIC)||(diag_get32(hdr + 4) != 1))
+    {
+        printf("%s isn't a dump of SD_Diag_Dump\n", argv[1]);
+        return(1);
+    }
+    n = diag_get32(hdr + 12);
+    printf("%lu messages, the last %lu\n", (unsigned long)diag_get32(hdr + 8), (unsigned long)n);
+    for(idx = 0; idx != n; idx++)
+    {
+        if(fread(r, 1, sizeof(r), fp) != sizeof(r)) break;
+        if(idx == 0) t0 = diag_get32(r);
+        id = r[4];
+        level = r[5];
+        for(a = 0; a < SD_DIAG_ARGS; a++) arg[a] = diag_get32(r + 8 + 4 * a);
+        // Time from the first message, it wraps around with SD_Time_Us
+        printf("%10lu %c ", (unsigned long)(diag_get32(r) - t0),
+               diag_levels[(level < sizeof(diag_levels) - 1) ? level : 0]);
+        printf(diag_formats[(id < SD_DIAG_MSGS) ? id : 0], arg[0], arg[1], arg[2], arg[3]);
+        printf("\n");
+    }
+    fclose(fp);
+    return(0);
+}
+
+// «sd_diag.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
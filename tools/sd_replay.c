@@ -0,0 +1,358 @@
+/*
+ *  File: sd_replay.c
+ *  License at the end of file.
+ *
+ *  Replay of a trace (SD_Trace_Dump) over the x86 emulation, at full speed
+ *  or with the original timing, through a driver configuration:
+ *    raw     the operations as they were recorded.
+ *    blocks  runs of sequential single sector writes joined in
+ *            SD_Write_Blocks (up to REPLAY_RUN sectors).
+ *    plan    the writes go through the write planner (sd_plan.c).
+ *  The report compares the latency of each kind of operation and the
+ *  throughput against the ones recorded. The data of the writes isn't in
+ *  the trace, a pattern is written instead. Built with SD_IO_MODEL, -c
+ *  times the emulated card with a profile (tools/cards), to predict the
+ *  figures of that card.
+ *
+ *  Build and run (GNU/Linux):
+ *    dd if=/dev/zero of=sim_sd.raw bs=1k count=0 seek=65536
+ *    gcc -O2 -D_M_IX86 -DSD_IO_MODEL -I.. -o sd_replay sd_replay.c ../sd_io.c ../sd_plan.c
+ *    ./sd_replay [-t] [-m raw|blocks|plan] [-c card.txt] trace.bin sim_sd.raw
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sd_io.h"
+#include "sd_plan.h"
+
+#define REPLAY_RUN      64      // Longest run of the blocks configuration
+#define REPLAY_PLAN     32      // Sectors of the planner buffer
+#define REPLAY_OPS      9       // Operation codes, SD_TRACE_READ.. plus one
+
+/* Trace operations, as in SD_TRACE_* of sd_io.h (SD_IO_TRACE) */
+enum { OP_READ = 1, OP_WRITE, OP_BLOCKS, OP_STREAM, OP_ERASE, OP_DISCARD,
+       OP_READV, OP_WRITEV };
+
+static const char *replay_names[REPLAY_OPS] = {
+    "?", "read", "write", "write_blocks", "stream_write", "erase", "discard",
+    "readv", "writev"
+};
+
+typedef struct {
+    DWORD t_us, lat_us, len;
+    QWORD sector;
+    WORD ofs;
+    BYTE op, res;
+} REPLAY_REC;
+
+typedef struct {
+    DWORD count, errors;
+    QWORD bytes;
+    double orig_us;         /* Sum of the recorded latencies            */
+    DWORD orig_max;
+    double *lat;            /* Latencies of the replay (us)             */
+} REPLAY_STAT;
+
+static REPLAY_STAT replay_stat[REPLAY_OPS];
+static BYTE replay_buf[REPLAY_RUN * SD_BLK_SIZE];
+static BYTE replay_plan_buf[REPLAY_PLAN * SD_BLK_SIZE];
+static LBA_t replay_run_first;
+static DWORD replay_run_len;
+
+/******************************************************************************
+ Private Methods - Replay
+******************************************************************************/
+
+static double replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#ifdef SD_IO_MODEL
+    // Plus the virtual time of the card
+    return(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3 + (double)SD_Model_Us());
+#else
+    return(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+#endif
+}
+
+/**
+    \brief Load a dump of SD_Trace_Dump.
+    \return Records, NULL if the file isn't a trace.
+ */
+static REPLAY_REC *replay_load(const char *fn, DWORD *n)
+{
+    FILE *fp = fopen(fn, "rb");
+    BYTE hdr[16], r[24];
+    REPLAY_REC *recs;
+    DWORD idx;
+    if(fp == NULL) return(NULL);
+    if((fread(hdr, 1, 16, fp) != 16)||(SD_Get32(hdr) != 0x52544453UL)||
+       (SD_Get32(hdr + 4) != 1))
+    {
+        fclose(fp);
+        return(NULL);
+    }
+    *n = SD_Get32(hdr + 12);
+    recs = calloc(*n ? *n : 1, sizeof(REPLAY_REC));
+    for(idx = 0; (recs != NULL) && (idx != *n); idx++)
+    {
+        if(fread(r, 1, 24, fp) != 24) break;
+        recs[idx].t_us = SD_Get32(r);
+        recs[idx].lat_us = SD_Get32(r + 4);
+        recs[idx].sector = SD_Get32(r + 8) | ((QWORD)SD_Get32(r + 12) << 32);
+        recs[idx].len = SD_Get32(r + 16);
+        recs[idx].ofs = (WORD)(r[20] | (r[21] << 8));
+        recs[idx].op = r[22];
+        recs[idx].res = r[23];
+    }
+    *n = idx;
+    fclose(fp);
+    return(recs);
+}
+
+/* Data of the writes: the sector number in each word */
+static void replay_fill(LBA_t sector, DWORD count)
+{
+    DWORD idx;
+    for(idx = 0; idx != count * SD_BLK_SIZE / 4; idx++)
+        memcpy(replay_buf + idx * 4, &(DWORD){(DWORD)sector + idx / (SD_BLK_SIZE / 4)}, 4);
+}
+
+/* Write the pending run of the blocks configuration */
+static SDRESULTS replay_run_flush(SD_DEV *dev)
+{
+    SDRESULTS res = SD_OK;
+    if(replay_run_len)
+    {
+        replay_fill(replay_run_first, replay_run_len);
+        res = SD_Write_Blocks(dev, replay_buf, replay_run_first, replay_run_len);
+    }
+    replay_run_len = 0;
+    return(res);
+}
+
+/**
+    \brief Replay one record.
+    \param mode 'r' raw, 'b' blocks, 'p' plan.
+ */
+static SDRESULTS replay_one(SD_DEV *dev, SD_PLAN *plan, char mode, const REPLAY_REC *r)
+{
+    SDRESULTS res;
+    BOOL single = (r->op == OP_WRITE)||(r->op == OP_STREAM);
+    DWORD idx, n;
+    // Single sector writes, joined by the configuration
+    if(single && (mode == 'b'))
+    {
+        if(replay_run_len && ((replay_run_first + replay_run_len != r->sector)||
+                              (replay_run_len == REPLAY_RUN)))
+        {
+            res = replay_run_flush(dev);
+            if(res != SD_OK) return(res);
+        }
+        if(replay_run_len == 0) replay_run_first = (LBA_t)r->sector;
+        replay_run_len++;
+        return(SD_OK);
+    }
+    SD_IOVEC iov[1];
+    if((single || (r->op == OP_BLOCKS) || (r->op == OP_WRITEV)) && (mode == 'p'))
+    {
+        res = SD_OK;
+        for(idx = 0; (res == SD_OK) && (idx != (single ? 1 : r->len)); idx++)
+        {
+            replay_fill((LBA_t)r->sector + idx, 1);
+            res = SD_Plan_Write(plan, replay_buf, (LBA_t)r->sector + idx);
+        }
+        return(res);
+    }
+    // Anything else sees the card up to date
+    if(mode == 'b')
+    {
+        res = replay_run_flush(dev);
+        if(res != SD_OK) return(res);
+    }
+    if(mode == 'p')
+    {
+        res = SD_Plan_Flush(plan);
+        if(res != SD_OK) return(res);
+    }
+    switch(r->op)
+    {
+        case OP_READ:
+            if((r->len == 0)||(r->ofs + r->len > SD_BLK_SIZE)) return(SD_PARERR);
+            return(SD_Read(dev, replay_buf, (LBA_t)r->sector, r->ofs, (WORD)r->len));
+        case OP_WRITE:
+        case OP_STREAM:
+            replay_fill((LBA_t)r->sector, 1);
+            return(SD_Write(dev, replay_buf, (LBA_t)r->sector));
+        case OP_BLOCKS:
+            res = SD_OK;
+            for(idx = 0; (res == SD_OK) && (idx < r->len); idx += n)
+            {
+                n = (r->len - idx > REPLAY_RUN) ? REPLAY_RUN : r->len - idx;
+                replay_fill((LBA_t)r->sector + idx, n);
+                res = SD_Write_Blocks(dev, replay_buf, (LBA_t)r->sector + idx, n);
+            }
+            return(res);
+        case OP_READV:
+        case OP_WRITEV:
+            res = SD_OK;
+            for(idx = 0; (res == SD_OK) && (idx < r->len); idx += n)
+            {
+                n = (r->len - idx > REPLAY_RUN) ? REPLAY_RUN : r->len - idx;
+                iov[0].buf = replay_buf;
+                iov[0].len = n * SD_BLK_SIZE;
+                if(r->op == OP_READV)
+                    res = SD_ReadV(dev, iov, 1, (LBA_t)r->sector + idx);
+                else {
+                    replay_fill((LBA_t)r->sector + idx, n);
+                    res = SD_WriteV(dev, iov, 1, (LBA_t)r->sector + idx);
+                }
+            }
+            return(res);
+        case OP_ERASE:
+            return(SD_Erase(dev, (LBA_t)r->sector, (LBA_t)(r->sector + r->len - 1)));
+        case OP_DISCARD:
+            return(SD_Discard(dev, (LBA_t)r->sector, (LBA_t)(r->sector + r->len - 1)));
+    }
+    return(SD_PARERR);
+}
+
+static int replay_cmp(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return((x > y) - (x < y));
+}
+
+int main(int argc, char *argv[])
+{
+    SD_DEV dev[1];
+    SD_PLAN plan;
+    REPLAY_REC *recs;
+    REPLAY_STAT *st;
+    DWORD n, idx, op;
+    QWORD bytes = 0;
+    BOOL timed = FALSE;
+    char mode = 'r';
+    const char *names = "raw";
+    const char *card = NULL;
+#ifdef SD_IO_MODEL
+    SD_MODEL model;
+#endif
+    double t0, t, wait, sum, elapsed, orig;
+    int arg = 1;
+    for(; (arg < argc) && (argv[arg][0] == '-'); arg++)
+    {
+        if(strcmp(argv[arg], "-t") == 0) timed = TRUE;
+        else if((strcmp(argv[arg], "-m") == 0) && (arg + 1 < argc))
+        {
+            names = argv[++arg];
+            mode = names[0];
+        }
+        else if((strcmp(argv[arg], "-c") == 0) && (arg + 1 < argc)) card = argv[++arg];
+    }
+    if((arg + 2 > argc)||((mode != 'r') && (mode != 'b') && (mode != 'p')))
+    {
+        printf("usage: %s [-t] [-m raw|blocks|plan] [-c card.txt] trace image\n", argv[0]);
+        return(1);
+    }
+#ifdef SD_IO_MODEL
+    if(SD_Model_Load(&model, card) != SD_OK)
+    {
+        printf("can't load the card %s\n", card);
+        return(1);
+    }
+#else
+    if(card != NULL)
+    {
+        printf("-c needs SD_IO_MODEL\n");
+        return(1);
+    }
+#endif
+    recs = replay_load(argv[arg], &n);
+    if((recs == NULL)||(n == 0))
+    {
+        printf("%s isn't a trace\n", argv[arg]);
+        return(1);
+    }
+    memset(dev, 0, sizeof(dev));
+    strncpy(dev->fn, argv[arg + 1], sizeof(dev->fn) - 1);
+#ifdef SD_IO_MODEL
+    if(card != NULL) SD_Model_Start(dev, &model);
+#endif
+    if(SD_Init(dev) != SD_OK)
+    {
+        printf("can't open %s\n", argv[arg + 1]);
+        return(1);
+    }
+    if((mode == 'p') && (SD_Plan_Init(&plan, dev, replay_plan_buf, REPLAY_PLAN) != SD_OK)) return(1);
+    for(op = 0; op != REPLAY_OPS; op++) replay_stat[op].lat = calloc(n, sizeof(double));
+    t0 = replay_now();
+    for(idx = 0; idx != n; idx++)
+    {
+        op = (recs[idx].op < REPLAY_OPS) ? recs[idx].op : 0;
+        st = &replay_stat[op];
+        // The original arrival, from the first record
+        if(timed)
+        {
+            wait = (double)(DWORD)(recs[idx].t_us - recs[0].t_us) - (replay_now() - t0);
+            if(wait > 0)
+            {
+                struct timespec ts = { (time_t)(wait / 1e6), (long)((long long)wait % 1000000) * 1000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        t = replay_now();
+        if(replay_one(dev, &plan, mode, &recs[idx]) != SD_OK) st->errors++;
+        st->lat[st->count++] = replay_now() - t;
+        st->orig_us += recs[idx].lat_us;
+        if(recs[idx].lat_us > st->orig_max) st->orig_max = recs[idx].lat_us;
+        st->bytes += (op == OP_READ) ? recs[idx].len :
+                     ((op == OP_ERASE)||(op == OP_DISCARD)) ? 0 :
+                     (QWORD)(((op == OP_BLOCKS)||(op == OP_READV)||(op == OP_WRITEV)) ?
+                             recs[idx].len : 1) * SD_BLK_SIZE;
+    }
+    if(mode == 'b') replay_run_flush(dev);
+    if(mode == 'p') SD_Plan_Flush(&plan);
+    elapsed = replay_now() - t0;
+    orig = (double)(DWORD)(recs[n - 1].t_us + recs[n - 1].lat_us - recs[0].t_us);
+    printf("%lu records, configuration %s, %s, card %s\n", (unsigned long)n, names,
+           timed ? "original timing" : "full speed", card ? card : "without timing");
+    printf("%-14s %8s %6s %12s %12s %12s %12s %12s\n", "operation", "count", "errors",
+           "rec mean us", "rec max us", "mean us", "p99 us", "max us");
+    for(op = 0; op != REPLAY_OPS; op++)
+    {
+        st = &replay_stat[op];
+        if(st->count == 0) continue;
+        qsort(st->lat, st->count, sizeof(double), replay_cmp);
+        for(sum = 0, idx = 0; idx != st->count; idx++) sum += st->lat[idx];
+        printf("%-14s %8lu %6lu %12.1f %12lu %12.1f %12.1f %12.1f\n", replay_names[op],
+               (unsigned long)st->count, (unsigned long)st->errors, st->orig_us / st->count,
+               (unsigned long)st->orig_max, sum / st->count,
+               st->lat[(st->count - 1) * 99 / 100], st->lat[st->count - 1]);
+        bytes += st->bytes;
+    }
+    printf("recorded %.2f MB/s over %.0f us, replay %.2f MB/s over %.0f us\n",
+           orig > 0 ? bytes / orig : 0.0, orig, elapsed > 0 ? bytes / elapsed : 0.0, elapsed);
+    if(mode == 'p') printf("planner score %u\n", SD_Plan_Score(&plan));
+    return(0);
+}
+
+// «sd_replay.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
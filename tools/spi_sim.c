@@ -0,0 +1,503 @@
+/*
+ *  File: spi_sim.c
+ *  License at the end of file.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // pread()/pwrite()
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "spi_sim.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SIM_BLK_SIZE    512
+#define SIM_OUT_SIZE    2048    // Queue of bytes the card will send
+
+/* State of the card receiver */
+typedef enum {
+    SIM_CMD = 0,                // Waiting for a command
+    SIM_WR_TOKEN,               // Waiting for a data token (CMD24/CMD25)
+    SIM_WR_DATA                 // Receiving a data block
+} SIM_STATE;
+
+/* Emulated card */
+typedef struct _SIM_CARD {
+    int fd;
+    QWORD sectors;
+    BOOL hc;            /* SDHC: CCS set and block addressing               */
+    BOOL cs;            /* Selected                                         */
+    BOOL idle;          /* In idle state (not initialized)                  */
+    BOOL acmd;          /* Last command was CMD55                           */
+    BYTE acmd41;        /* ACMD41 polls, the card is ready at the second    */
+    SIM_STATE st;
+    BYTE cmd[6];
+    BYTE cmd_len;
+    BYTE out[SIM_OUT_SIZE];
+    WORD out_head, out_tail;
+    WORD busy;          /* Busy bytes left                                  */
+    BOOL rd_multi;      /* CMD18 in course                                  */
+    QWORD rd_lba;
+    BOOL wr_multi;      /* CMD25 in course                                  */
+    QWORD wr_lba;
+    BYTE wbuf[SIM_BLK_SIZE + 2];
+    WORD wlen;
+    QWORD er_first, er_last;
+    DWORD bytes;
+} SIM_CARD;
+
+static SIM_CARD sim[SIM_SLOTS];
+static BYTE sim_slot;
+static QWORD sim_timer;
+
+/******************************************************************************
+ Private Methods Prototypes - Emulated card
+******************************************************************************/
+
+/**
+    \brief Monotonic time in microseconds.
+ */
+static QWORD __SIM_Now(void);
+
+/**
+    \brief CRC16 (CCITT) of a data block, as the card sends it.
+ */
+static WORD __SIM_CRC16(const BYTE *dat, WORD cnt);
+
+/**
+    \brief Queue a byte to send.
+ */
+static void __SIM_Push(SIM_CARD *c, BYTE b);
+
+/**
+    \brief Queue a data packet: Nac, token, data and CRC.
+ */
+static void __SIM_Push_Block(SIM_CARD *c, const BYTE *dat, WORD cnt);
+
+/**
+    \brief Queue a sector of the image as a data packet.
+ */
+static void __SIM_Push_Sector(SIM_CARD *c, QWORD lba);
+
+/**
+    \brief Sector of the argument of a data command.
+ */
+static QWORD __SIM_Lba(SIM_CARD *c, DWORD arg);
+
+/**
+    \brief Execute the command received and queue its response.
+ */
+static void __SIM_Command(SIM_CARD *c);
+
+/******************************************************************************
+ Private Methods - Emulated card
+******************************************************************************/
+
+static QWORD __SIM_Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((QWORD)ts.tv_sec * 1000000ULL + (QWORD)(ts.tv_nsec / 1000));
+}
+
+static WORD __SIM_CRC16(const BYTE *dat, WORD cnt)
+{
+    WORD crc = 0;
+    BYTE bit;
+    while(cnt--)
+    {
+        crc ^= (WORD)(*dat++) << 8;
+        for(bit = 0; bit != 8; bit++)
+            crc = (crc & 0x8000) ? (WORD)((crc << 1) ^ 0x1021) : (WORD)(crc << 1);
+    }
+    return(crc);
+}
+
+static void __SIM_Push(SIM_CARD *c, BYTE b)
+{
+    c->out[c->out_tail] = b;
+    c->out_tail = (c->out_tail + 1) % SIM_OUT_SIZE;
+}
+
+static void __SIM_Push_Block(SIM_CARD *c, const BYTE *dat, WORD cnt)
+{
+    WORD crc = __SIM_CRC16(dat, cnt);
+    WORD idx;
+    __SIM_Push(c, 0xFF);
+    __SIM_Push(c, 0xFE);
+    for(idx = 0; idx != cnt; idx++) __SIM_Push(c, dat[idx]);
+    __SIM_Push(c, (BYTE)(crc >> 8));
+    __SIM_Push(c, (BYTE)crc);
+}
+
+static void __SIM_Push_Sector(SIM_CARD *c, QWORD lba)
+{
+    BYTE dat[SIM_BLK_SIZE];
+    if(pread(c->fd, dat, SIM_BLK_SIZE, (off_t)(lba * SIM_BLK_SIZE)) != SIM_BLK_SIZE)
+        memset(dat, 0, SIM_BLK_SIZE);
+    __SIM_Push_Block(c, dat, SIM_BLK_SIZE);
+}
+
+static QWORD __SIM_Lba(SIM_CARD *c, DWORD arg)
+{
+    return(c->hc ? arg : arg / SIM_BLK_SIZE);
+}
+
+static void __SIM_Command(SIM_CARD *c)
+{
+    BYTE idx = c->cmd[0] & 0x3F;
+    DWORD arg = ((DWORD)c->cmd[1] << 24) | ((DWORD)c->cmd[2] << 16) |
+                ((DWORD)c->cmd[3] << 8) | c->cmd[4];
+    BYTE r1 = c->idle ? 0x01 : 0x00;
+    BOOL acmd = c->acmd;
+    c->acmd = FALSE;
+    // Stop transmission: drop the rest of the data, a stuff byte and R1
+    if(idx == 12)
+    {
+        c->out_head = c->out_tail;
+        c->rd_multi = FALSE;
+        __SIM_Push(c, 0xFF);
+        __SIM_Push(c, 0x00);
+        return;
+    }
+    __SIM_Push(c, 0xFF);    // NCR
+    if(acmd)
+    {
+        switch(idx)
+        {
+            case 41:    // SD_SEND_OP_COND
+                if(++c->acmd41 > 1) c->idle = FALSE;
+                __SIM_Push(c, c->idle ? 0x01 : 0x00);
+                return;
+            case 13: {  // SD_STATUS: class 10, AU 4MB, erase 2s per AU + 1s
+                BYTE sds[64];
+                memset(sds, 0, sizeof(sds));
+                sds[8] = 4;
+                sds[10] = 0x90;
+                sds[12] = 1;
+                sds[13] = (2 << 2) | 1;
+                sds[24] = 0x02;
+                __SIM_Push(c, r1);
+                __SIM_Push(c, 0x00);
+                __SIM_Push_Block(c, sds, sizeof(sds));
+                return; }
+            case 23:    // SET_WR_BLK_ERASE_COUNT
+                __SIM_Push(c, r1);
+                return;
+            case 51: {  // SEND_SCR: SD 3.0, erased reads as zero
+                static const BYTE scr[8] = {0x02, 0x35, 0x80, 0x03, 0, 0, 0, 0};
+                __SIM_Push(c, r1);
+                __SIM_Push_Block(c, scr, sizeof(scr));
+                return; }
+            default:
+                __SIM_Push(c, r1 | 0x04);
+                return;
+        }
+    }
+    switch(idx)
+    {
+        case 0:
+            c->idle = TRUE;
+            c->acmd41 = 0;
+            c->st = SIM_CMD;
+            __SIM_Push(c, 0x01);
+            return;
+        case 8:     // R7, echo of the check pattern
+            __SIM_Push(c, r1);
+            __SIM_Push(c, 0x00);
+            __SIM_Push(c, 0x00);
+            __SIM_Push(c, 0x01);
+            __SIM_Push(c, (BYTE)arg);
+            return;
+        case 9: {   // CSD, version 2.0 on SDHC
+            BYTE csd[16];
+            DWORD c_size = (DWORD)(c->sectors / 1024 - 1);
+            memset(csd, 0, sizeof(csd));
+            csd[0] = c->hc ? 0x40 : 0x00;
+            csd[1] = 0x0E;
+            csd[3] = 0x32;
+            csd[4] = 0x5B;
+            csd[5] = 0x59;
+            csd[7] = (BYTE)((c_size >> 16) & 0x3F);
+            csd[8] = (BYTE)(c_size >> 8);
+            csd[9] = (BYTE)c_size;
+            csd[10] = 0x7F;
+            csd[11] = 0x80;
+            csd[12] = 0x0A;
+            csd[13] = 0x40;
+            csd[15] = 0x01;
+            if(!c->hc)
+            {
+                // CSD version 1.0: 512 bytes blocks, C_SIZE_MULT 7 (x512)
+                c_size = (DWORD)(c->sectors / 512 - 1);
+                csd[5] = 0x59;
+                csd[6] = (BYTE)((c_size >> 10) & 0x03);
+                csd[7] = (BYTE)(c_size >> 2);
+                csd[8] = (BYTE)((c_size & 0x03) << 6);
+                csd[9] = 0x03;
+                // No ERASE_BLK_EN: erases in groups of 128 blocks
+                csd[10] = 0x3F;
+            }
+            __SIM_Push(c, r1);
+            __SIM_Push_Block(c, csd, sizeof(csd));
+            return; }
+        case 10: {  // CID
+            static const BYTE cid[16] = {
+                0x03, 'S', 'D', 'S', 'I', 'M', '0', '1',
+                0x10, 0x12, 0x34, 0x56, 0x78, 0x01, 0x4A, 0x01
+            };
+            __SIM_Push(c, r1);
+            __SIM_Push_Block(c, cid, sizeof(cid));
+            return; }
+        case 13:    // SEND_STATUS, R2
+            __SIM_Push(c, r1);
+            __SIM_Push(c, 0x00);
+            return;
+        case 16: case 59:
+            __SIM_Push(c, r1);
+            return;
+        case 17:
+            __SIM_Push(c, r1);
+            __SIM_Push_Sector(c, __SIM_Lba(c, arg));
+            return;
+        case 18:
+            __SIM_Push(c, r1);
+            c->rd_multi = TRUE;
+            c->rd_lba = __SIM_Lba(c, arg);
+            return;
+        case 24: case 25:
+            __SIM_Push(c, r1);
+            c->wr_multi = (idx == 25) ? TRUE : FALSE;
+            c->wr_lba = __SIM_Lba(c, arg);
+            c->st = SIM_WR_TOKEN;
+            return;
+        case 32:
+            c->er_first = __SIM_Lba(c, arg);
+            __SIM_Push(c, r1);
+            return;
+        case 33:
+            c->er_last = __SIM_Lba(c, arg);
+            __SIM_Push(c, r1);
+            return;
+        case 38: {
+            BYTE zero[SIM_BLK_SIZE];
+            QWORD lba;
+            memset(zero, 0, sizeof(zero));
+            // SDSC erases the whole groups touched by the range
+            if(!c->hc)
+            {
+                c->er_first -= c->er_first % 128;
+                c->er_last += 127 - c->er_last % 128;
+            }
+            for(lba = c->er_first; lba <= c->er_last; lba++)
+                if(pwrite(c->fd, zero, SIM_BLK_SIZE, (off_t)(lba * SIM_BLK_SIZE)) != SIM_BLK_SIZE) break;
+            __SIM_Push(c, r1);
+            c->busy = SIM_BUSY_ERASE;
+            return; }
+        case 55:
+            c->acmd = TRUE;
+            __SIM_Push(c, r1);
+            return;
+        case 58:    // R3, OCR with power up status and CCS
+            __SIM_Push(c, r1);
+            __SIM_Push(c, c->hc ? 0xC0 : 0x80);
+            __SIM_Push(c, 0xFF);
+            __SIM_Push(c, 0x80);
+            __SIM_Push(c, 0x00);
+            return;
+        default:    // Illegal command
+            __SIM_Push(c, r1 | 0x04);
+            return;
+    }
+}
+
+/******************************************************************************
+ Public Methods - Emulated card
+******************************************************************************/
+
+int SIM_Open(BYTE slot, const char *fn, BOOL hc)
+{
+    SIM_CARD *c;
+    if(slot >= SIM_SLOTS) return(-1);
+    c = &sim[slot];
+    if(c->fd > 0) close(c->fd);
+    memset(c, 0, sizeof(SIM_CARD));
+    c->fd = open(fn, O_RDWR);
+    if(c->fd < 0) return(-1);
+    c->sectors = (QWORD)lseek(c->fd, 0, SEEK_END) / SIM_BLK_SIZE;
+    c->hc = hc;
+    c->idle = TRUE;
+    return(0);
+}
+
+void SIM_Select(BYTE slot)
+{
+    sim_slot = slot;
+}
+
+DWORD SIM_Bytes(BYTE slot)
+{
+    return(sim[slot].bytes);
+}
+
+void SIM_Reset(BYTE slot)
+{
+    sim[slot].idle = TRUE;
+    sim[slot].acmd41 = 0;
+}
+
+/******************************************************************************
+ Public Methods - SPI port (spi_io.h)
+******************************************************************************/
+
+void SPI_Init(void)
+{
+}
+
+BYTE SPI_RW(BYTE d)
+{
+    SIM_CARD *c = &sim[sim_slot];
+    BYTE o = 0xFF;
+    c->bytes++;
+    if(c->cs == FALSE) return(0xFF);
+    // Output: queued bytes, then busy, then the next sector of a CMD18
+    if(c->out_head != c->out_tail)
+    {
+        o = c->out[c->out_head];
+        c->out_head = (c->out_head + 1) % SIM_OUT_SIZE;
+    }
+    else if(c->busy)
+    {
+        c->busy--;
+        o = 0x00;
+    }
+    else if(c->rd_multi)
+    {
+        __SIM_Push_Sector(c, c->rd_lba++);
+        o = c->out[c->out_head];
+        c->out_head = (c->out_head + 1) % SIM_OUT_SIZE;
+    }
+    // Input
+    switch(c->st)
+    {
+        case SIM_WR_TOKEN:
+            if(d == 0xFE || d == 0xFC)
+            {
+                c->st = SIM_WR_DATA;
+                c->wlen = 0;
+                break;
+            }
+            if(d == 0xFD)
+            {
+                c->st = SIM_CMD;
+                __SIM_Push(c, 0xFF);
+                c->busy = SIM_BUSY_STOP;
+                break;
+            }
+            // A command ends the data phase
+            if((d & 0xC0) != 0x40) break;
+            c->st = SIM_CMD;
+            // fall through
+        case SIM_CMD:
+            if((c->cmd_len == 0) && ((d & 0xC0) != 0x40)) break;
+            c->cmd[c->cmd_len++] = d;
+            if(c->cmd_len == 6)
+            {
+                c->cmd_len = 0;
+                __SIM_Command(c);
+            }
+            break;
+        case SIM_WR_DATA:
+            c->wbuf[c->wlen++] = d;
+            if(c->wlen == SIM_BLK_SIZE + 2)
+            {
+                if(pwrite(c->fd, c->wbuf, SIM_BLK_SIZE, (off_t)(c->wr_lba * SIM_BLK_SIZE)) == SIM_BLK_SIZE)
+                    __SIM_Push(c, 0xE5);    // Data accepted
+                else
+                    __SIM_Push(c, 0xED);    // Write error
+                c->wr_lba++;
+                c->busy = SIM_BUSY_WRITE;
+                c->st = c->wr_multi ? SIM_WR_TOKEN : SIM_CMD;
+            }
+            break;
+    }
+    return(o);
+}
+
+void SPI_Release(void)
+{
+    WORD idx;
+    for(idx=0; idx<10; idx++) SPI_RW(0xFF);
+}
+
+void SPI_CS_Low(void)
+{
+    sim[sim_slot].cs = TRUE;
+}
+
+void SPI_CS_High(void)
+{
+    sim[sim_slot].cs = FALSE;
+}
+
+void SPI_Slot(BYTE slot)
+{
+    SIM_Select(slot);
+}
+
+void SPI_Freq_High(void)
+{
+}
+
+void SPI_Freq_Low(void)
+{
+}
+
+DWORD SPI_Freq_Khz(DWORD khz)
+{
+    // Bytes take no time in the emulation, any clock is as good
+    return(khz);
+}
+
+void SPI_Timer_On(WORD ms)
+{
+    sim_timer = __SIM_Now() + (QWORD)ms * 1000;
+}
+
+BOOL SPI_Timer_Status(void)
+{
+    return((__SIM_Now() < sim_timer) ? TRUE : FALSE);
+}
+
+void SPI_Timer_Off(void)
+{
+    sim_timer = 0;
+}
+
+DWORD SPI_Clock_Us(void)
+{
+    return((DWORD)__SIM_Now());
+}
+
+// «spi_sim.c» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/
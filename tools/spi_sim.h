@@ -0,0 +1,67 @@
+/*
+ *  File: spi_sim.h
+ *  License at the end of file.
+ *
+ *  SPI port for the host: the methods of spi_io.h talk to an emulated SD
+ *  card in SPI mode, backed by an image file. The card answers at byte level
+ *  (commands, R1/R2/R3/R7, data tokens, data responses and busy), so the
+ *  protocol code of sd_io.c runs unchanged over it.
+ */
+
+#ifndef _SPI_SIM_H_
+#define _SPI_SIM_H_
+
+#include "spi_io.h"
+
+/*****************************************************************************/
+/* Configurations                                                            */
+/*****************************************************************************/
+#define SIM_SLOTS       4       // Emulated cards, one of them selected
+#define SIM_BUSY_WRITE  10      // Busy bytes after a data block
+#define SIM_BUSY_STOP   20      // Busy bytes after the stop tran token
+#define SIM_BUSY_ERASE  50      // Busy bytes after an erase
+/*****************************************************************************/
+
+/**
+    \brief Insert a card in a slot.
+    \param slot Slot of the card, 0..SIM_SLOTS-1.
+    \param fn Image file, its size gives the capacity of the card.
+    \param hc TRUE for a SDHC card (block addressing), FALSE for a SDSC.
+    \return Zero if all goes well.
+ */
+int SIM_Open (BYTE slot, const char *fn, BOOL hc);
+
+/**
+    \brief Route the next SPI methods to the card in a slot (SPI_Slot).
+ */
+void SIM_Select (BYTE slot);
+
+/**
+    \brief Bytes clocked over the SPI bus of a slot.
+ */
+DWORD SIM_Bytes (BYTE slot);
+
+/**
+    \brief Power-on reset of a card: back to idle state, as after a brown-out.
+ */
+void SIM_Reset (BYTE slot);
+
+#endif
+
+// «spi_sim.h» is part of:
+/*----------------------------------------------------------------------------/
+/  ulibSD - Library for SD cards semantics            (C)Nelson Lombardo, 2015
+/-----------------------------------------------------------------------------/
+/ ulibSD library is a free software that opened under license policy of
+/ following conditions.
+/
+/ Copyright (C) 2015, ChaN, all right reserved.
+/
+/ 1. Redistributions of source code must retain the above copyright notice,
+/    this condition and the following disclaimer.
+/
+/ This software is provided by the copyright holder and contributors "AS IS"
+/ and any warranties related to this software are DISCLAIMED.
+/ The copyright owner or contributors be NOT LIABLE for any damages caused
+/ by use of this software.
+/----------------------------------------------------------------------------*/